@@ -1,5 +1,6 @@
 #define IRIS_EVENT_BROKER
 #include "iris.h"
+#include "sink.h"
 
 #include <pthread.h>
 #include <syslog.h>
@@ -15,49 +16,278 @@
 #include "common.h"
 #include "icinga.h"
 
-#define WHIMP_OUT_ON_RELOAD
+/* Stock (unpatched) Icinga has no register_fd(); weak linkage lets us
+   load anyway, and run with `sink = checkresult' there instead. */
+extern int register_fd(int fd) __attribute__((weak));
+extern char *check_result_path;
+extern host *host_list;
+extern service *service_list;
 
 NEB_API_VERSION(CURRENT_NEB_API_VERSION);
 
 /*************************************************************/
 
-static int _facility(const char *name)
+static void *IRIS_MODULE = NULL;
+static struct sink *SINK = NULL;
+pthread_t tid;
+static int RUNNING = 0;
+int sockfd = -1, epfd = -1;
+
+/* Every host and host/service Icinga knows about, so that results for
+   anything else can be thrown away here instead of being queued up
+   for the reaper to look up, and discard.  Rebuilt (by the Icinga
+   thread) at every EVENTLOOPSTART, and swapped in under KNOWN_LOCK.
+   Object keys are "host" and "host\0service".
+
+   Host and service names are interned as well, one copy per distinct
+   name, and each object points at its own; the check_result we hand
+   to Icinga still needs copies it can free(), but those come straight
+   from here, lengths and all, rather than being strndup()'d out of
+   every PDU. */
+struct known_object {
+	const char *host;
+	const char *service;  /* NULL for host results */
+	size_t      hlen;
+	size_t      slen;
+};
+
+struct known {
+	struct hash         *names;
+	struct hash         *objects;
+	struct known_object *all;
+};
+
+static struct known *KNOWN = NULL;
+static pthread_rwlock_t KNOWN_LOCK = PTHREAD_RWLOCK_INITIALIZER;
+static int REJECT_UNKNOWN = 1;
+
+/* how often each unknown key was seen; iris thread only */
+static struct hash *UNKNOWN = NULL;
+static unsigned long UNKNOWN_TOTAL = 0, UNKNOWN_OTHERS = 0;
+static time_t UNKNOWN_SINCE = 0;
+
+/* for the admin `stats' command; iris thread only */
+static unsigned long REJECTED = 0, SUBMITTED = 0;
+
+/*************************************************************/
+
+static size_t object_key(char *buf, const char *host, const char *service)
 {
-	return strcmp(name, "local0") == 0 ? LOG_LOCAL0
-	     : strcmp(name, "local1") == 0 ? LOG_LOCAL1
-	     : strcmp(name, "local2") == 0 ? LOG_LOCAL2
-	     : strcmp(name, "local3") == 0 ? LOG_LOCAL3
-	     : strcmp(name, "local4") == 0 ? LOG_LOCAL4
-	     : strcmp(name, "local5") == 0 ? LOG_LOCAL5
-	     : strcmp(name, "local6") == 0 ? LOG_LOCAL6
-	     : strcmp(name, "local7") == 0 ? LOG_LOCAL7
-	                                   : LOG_DAEMON;
+	size_t h = strlen(host), s;
+
+	memcpy(buf, host, h + 1);
+	if (!service)
+		return h;
+	s = strlen(service);
+	memcpy(buf + h + 1, service, s);
+	return h + 1 + s;
 }
 
-/*************************************************************/
+static void known_free(struct known *k)
+{
+	if (!k)
+		return;
+	hash_free(k->objects, NULL);
+	hash_free(k->names, NULL);
+	free(k->all);
+	free(k);
+}
 
-static void *IRIS_MODULE = NULL;
-pthread_t tid;
-int sockfd, epfd;
+static void known_swap(struct known *k)
+{
+	struct known *old;
 
-/*************************************************************/
+	pthread_rwlock_wrlock(&KNOWN_LOCK);
+	old = KNOWN;
+	KNOWN = k;
+	pthread_rwlock_unlock(&KNOWN_LOCK);
+	known_free(old);
+}
+
+static int known_add(struct known *k, struct known_object *o, const char *host, const char *service)
+{
+	char key[IRIS_PDU_HOST_LEN + IRIS_PDU_SERVICE_LEN];
+
+	o->hlen = strlen(host);
+	o->slen = service ? strlen(service) : 0;
+	if (o->hlen >= IRIS_PDU_HOST_LEN || o->slen >= IRIS_PDU_SERVICE_LEN)
+		return 0; /* can't be named in a PDU anyway */
+
+	if (!(o->host = intern(k->names, host, o->hlen)))
+		return -1;
+	if (service && !(o->service = intern(k->names, service, o->slen)))
+		return -1;
+	return hash_set(k->objects, key, object_key(key, host, service), o);
+}
+
+/* runs on the Icinga thread, with the object lists loaded */
+static void known_rebuild(void)
+{
+	struct known *k;
+	struct known_object *o;
+	host *hst;
+	service *svc;
+	unsigned int n = 0;
+
+	for (hst = host_list; hst; hst = hst->next) n++;
+	for (svc = service_list; svc; svc = svc->next) n++;
+
+	if (!(k = calloc(1, sizeof(struct known)))
+	 || !(k->all = calloc(n ? n : 1, sizeof(struct known_object)))
+	 || !(k->objects = hash_new(n))
+	 || !(k->names = hash_new(n / 4))) {
+		syslog(LOG_ERROR, "failed to allocate the known-object table: %s", strerror(errno));
+		known_free(k);
+		known_swap(NULL);
+		return;
+	}
+
+	o = k->all;
+	for (hst = host_list; hst; hst = hst->next)
+		if (known_add(k, o++, hst->name, NULL) != 0)
+			goto fail;
+	for (svc = service_list; svc; svc = svc->next)
+		if (known_add(k, o++, svc->host_name, svc->description) != 0)
+			goto fail;
+
+	known_swap(k);
+	syslog(LOG_PROC, "accepting results for %u known hosts and services (%u distinct names)",
+			k->objects->count, k->names->count);
+	return;
+
+fail:
+	syslog(LOG_ERROR, "failed to build the known-object table: %s", strerror(errno));
+	known_free(k);
+	known_swap(NULL);
+}
+
+struct unknown {
+	const char   *key;
+	size_t        len;
+	unsigned long n;
+};
 
-void iris_call_submit_result(struct pdu *pdu)
+static void unknown_top(const char *key, size_t len, void *value, void *udata)
 {
+	struct unknown *top = udata;
+	unsigned long n = (uintptr_t)value;
+	int i;
+
+	for (i = 0; i < IRIS_UNKNOWN_TOP; i++) {
+		if (top[i].key && top[i].n >= n)
+			continue;
+		memmove(&top[i+1], &top[i], (IRIS_UNKNOWN_TOP - i - 1) * sizeof(struct unknown));
+		top[i].key = key;
+		top[i].len = len;
+		top[i].n   = n;
+		return;
+	}
+}
+
+/* logs (and then forgets) the worst offenders */
+static void unknown_stats(void)
+{
+	struct unknown top[IRIS_UNKNOWN_TOP];
+	size_t h;
+	int i;
+
+	syslog(LOG_PROC, "rejected %lu results for %u unknown hosts/services%s in the last %ds",
+			UNKNOWN_TOTAL, UNKNOWN ? UNKNOWN->count : 0,
+			UNKNOWN_OTHERS ? " (and then some)" : "", IRIS_UNKNOWN_STATS);
+
+	memset(top, 0, sizeof(top));
+	hash_each(UNKNOWN, unknown_top, top);
+	for (i = 0; i < IRIS_UNKNOWN_TOP && top[i].key; i++) {
+		h = strlen(top[i].key);
+		syslog(LOG_PROC, "  %lu results for unknown %s%s%s", top[i].n, top[i].key,
+				h < top[i].len ? "/" : "", h < top[i].len ? top[i].key + h + 1 : "");
+	}
+
+	hash_free(UNKNOWN, NULL);
+	UNKNOWN = NULL;
+	UNKNOWN_TOTAL = UNKNOWN_OTHERS = 0;
+}
+
+/* counts a result for something Icinga has never heard of */
+static void unknown(const char *key, size_t len)
+{
+	uintptr_t n;
+	time_t now;
+
+	time(&now);
+	if (!UNKNOWN_SINCE)
+		UNKNOWN_SINCE = now;
+	if (!UNKNOWN)
+		UNKNOWN = hash_new(64);
+
+	UNKNOWN_TOTAL++;
+	REJECTED++;
+	n = (uintptr_t)hash_get(UNKNOWN, key, len);
+	if (n || (UNKNOWN && UNKNOWN->count < IRIS_UNKNOWN_KEYS))
+		hash_set(UNKNOWN, key, len, (void*)(n + 1));
+	else
+		UNKNOWN_OTHERS++;
+
+	if (now - UNKNOWN_SINCE >= IRIS_UNKNOWN_STATS) {
+		unknown_stats();
+		UNKNOWN_SINCE = now;
+	}
+}
+
+static char* copy(const char *s, size_t len)
+{
+	char *p = malloc(len + 1);
+	if (p)
+		memcpy(p, s, len + 1);
+	return p;
+}
+
+int iris_call_submit_result(struct pdu *pdu)
+{
+	char key[IRIS_PDU_HOST_LEN + IRIS_PDU_SERVICE_LEN];
+	const struct known_object *o = NULL;
+	char *host = NULL, *service = NULL;
+	int is_host = strcmp(pdu->service, "HOST") == 0, found;
+	size_t len;
+
+	len = object_key(key, pdu->host, is_host ? NULL : pdu->service);
+
+	pthread_rwlock_rdlock(&KNOWN_LOCK);
+	found = !KNOWN || (o = hash_get(KNOWN->objects, key, len)) != NULL;
+	if (o && !SINK) {
+		host = copy(o->host, o->hlen);
+		if (o->service)
+			service = copy(o->service, o->slen);
+	}
+	pthread_rwlock_unlock(&KNOWN_LOCK);
+
+	if (!found && REJECT_UNKNOWN) {
+		unknown(key, len);
+		return IRIS_ACK_UNKNOWN;
+	}
+
+	if (SINK)
+		return sink_submit(SINK, pdu) == 0 ? IRIS_ACK_OK : IRIS_ACK_QUEUE_FULL;
+
 	check_result *res = malloc(sizeof(check_result));
 	if (init_check_result(res) != OK) {
 		syslog(LOG_ERROR, "Failed to initialize Icinga check_result object for submission of"
 				" %s/%s %d '%s'", pdu->host, pdu->service, pdu->rc, pdu->output);
-		return;
+		free(host);
+		free(service);
+		free(res);
+		return IRIS_ACK_QUEUE_FULL;
 	}
 
 	res->next           = NULL;
 	res->output_file    = NULL;
 	res->output_file_fd = -1;
 
-	res->host_name = strndup(pdu->host, IRIS_PDU_HOST_LEN-1);
-	if (strcmp(pdu->service, "HOST") != 0) {
-		res->service_description = strndup(pdu->service, IRIS_PDU_SERVICE_LEN-1);
+	/* unknown objects (with reject_unknown off) still get copied out
+	   of the PDU; Icinga will discard those results soon enough */
+	res->host_name = host ? host : strndup(pdu->host, IRIS_PDU_HOST_LEN-1);
+	if (!is_host) {
+		res->service_description = service ? service : strndup(pdu->service, IRIS_PDU_SERVICE_LEN-1);
 		res->object_check_type = SERVICE_CHECK;
 	}
 
@@ -72,7 +302,9 @@ void iris_call_submit_result(struct pdu *pdu)
 
 	// Icinga is now responsible for malloc'd _res_ memory
 	add_check_result_to_list(res);
-	vdebug("submitted result to main process");
+	SUBMITTED++;
+	trace(IRIS_TRACE_ICINGA, "submitted result to main process");
+	return IRIS_ACK_OK;
 }
 
 int iris_call_recv_data(int fd)
@@ -82,14 +314,44 @@ int iris_call_recv_data(int fd)
 
 int iris_call_register_fd(int fd)
 {
+	if (!register_fd) return 0;
 	return register_fd(fd);
 }
 
+/* Icinga's own check result list can't be looked at from here (it
+   isn't ours to lock), so without a sink, all there is to go on is
+   how many results we've put on it */
+static void iris_stats(void)
+{
+	admin_stat("icinga.rejected", REJECTED);
+	if (SINK)
+		sink_stats(SINK);
+	else
+		admin_stat("icinga.submitted", SUBMITTED);
+}
+
+/* the settings that can change without a restart (see config_watch) */
+static void iris_apply(const struct server *s)
+{
+	server_apply(s);
+	REJECT_UNKNOWN = s->reject_unknown;
+
+	closelog(); /* reopen syslog handle, with our new settings */
+	openlog(s->syslog_ident, LOG_PID|LOG_CONS, log_facility(s->syslog_facility));
+}
+
+static void iris_watch(void)
+{
+	if (config_watch(epfd, IRIS_DEFAULT_CONFIG_FILE, iris_apply) != 0)
+		syslog(LOG_WARN, "not watching %s for changes: %s",
+				IRIS_DEFAULT_CONFIG_FILE, strerror(errno));
+}
+
 void* iris_daemon(void *udata)
 {
 	struct server s;
 	server_init(&s);
-	openlog(s.syslog_ident, LOG_PID|LOG_CONS, _facility(s.syslog_facility));
+	openlog(s.syslog_ident, LOG_PID|LOG_CONS, log_facility(s.syslog_facility));
 
 	syslog(LOG_PROC, "v" VERSION " starting up");
 
@@ -105,15 +367,41 @@ void* iris_daemon(void *udata)
 		}
 	}
 
-	closelog(); /* reopen syslog handle, with our new settings */
-	openlog(s.syslog_ident, LOG_PID|LOG_CONS, _facility(s.syslog_facility));
+	iris_apply(&s);
+	admin_stats_extra(iris_stats);
+	if (trace_start() != 0)
+		syslog(LOG_WARN, "failed to start the trace thread: %s", strerror(errno));
 	syslog(LOG_PROC, "maximum concurrent clients is %d",
 			client_init(s.max_clients));
 
-	// bind and listen on our port, all interfaces
-	syslog(LOG_PROC, "binding on *:%s", s.port);
-	if ((sockfd = net_bind(NULL, s.port)) < 0) {
-		syslog(LOG_ERROR, "Failed to bind to *:%s: %s", s.port, strerror(errno));
+	if (s.sink) {
+		if (!s.sink_path && strcmp(s.sink, "checkresult") == 0 && check_result_path)
+			s.sink_path = strdup(check_result_path);
+
+		if (!(SINK = sink_new(&s)) || sink_start(SINK) != 0) {
+			syslog(LOG_EMERG, "failed to start the %s sink: %s", s.sink, strerror(errno));
+			exit(2);
+		}
+		syslog(LOG_PROC, "submitting results via the %s sink%s%s", s.sink,
+				s.sink_path ? " to " : "", s.sink_path ? s.sink_path : "");
+
+	} else if (!register_fd) {
+		syslog(LOG_WARN, "Icinga lacks the registered fd / check result mutex patches;"
+				" you probably want `sink = checkresult' in %s", IRIS_DEFAULT_CONFIG_FILE);
+	}
+
+	/* after a reload, the last copy of us left its listeners, clients
+	   and all behind for us; otherwise, start from scratch */
+	if (iris_adopt(&s, &sockfd, &epfd) == 0) {
+		server_apply(&s); /* over whatever the last copy was running */
+		iris_watch();
+		mainloop(sockfd, epfd);
+		return NULL;
+	}
+
+	// bind and listen on our port (or configured addresses)
+	if ((sockfd = net_bind_server(&s)) < 0) {
+		syslog(LOG_ERROR, "Failed to bind the result listener(s): %s", strerror(errno));
 		exit(2);
 	}
 
@@ -122,12 +410,57 @@ void* iris_daemon(void *udata)
 		syslog(LOG_ERROR, "Initialization of IO/polling (via epoll) failed: %s", strerror(errno));
 		exit(2);
 	}
+	if (net_listeners(&s, epfd) < 0)
+		exit(2);
+	iris_watch();
 
 	// and loop
 	mainloop(sockfd, epfd);
 	return NULL;
 }
 
+/* stops the reactor thread where it stands, taking nothing down */
+static void iris_pause(void)
+{
+	if (!RUNNING)
+		return;
+	mainloop_stop(IRIS_STOP_PAUSE);
+	pthread_join(tid, NULL);
+	RUNNING = 0;
+}
+
+/* Once Icinga is going down for good, reads whatever the clients have
+   already sent (see IRIS_STOP_DRAIN), on this thread.  Without a sink,
+   results would only end up on a check result list nobody will reap,
+   so they go into check_result_path instead, for the next Icinga. */
+static void iris_drain(void)
+{
+	struct server s;
+
+	if (sockfd < 0)
+		return;
+
+	if (!SINK && check_result_path) {
+		server_init(&s);
+		free(s.sink);
+		free(s.sink_path);
+		s.sink      = strdup("checkresult");
+		s.sink_path = strdup(check_result_path);
+		SINK = s.sink && s.sink_path ? sink_new(&s) : NULL;
+		server_free(&s); /* sink_new has its own copies */
+		if (SINK && sink_start(SINK) != 0) {
+			sink_stop(SINK);
+			SINK = NULL;
+		}
+		if (!SINK)
+			syslog(LOG_ERROR, "failed to start a checkresult sink to drain into: %s",
+					strerror(errno));
+	}
+
+	mainloop_stop(IRIS_STOP_DRAIN);
+	mainloop(sockfd, epfd);
+}
+
 int iris_hook(int event, void *data)
 {
 	if (event != NEBCALLBACK_PROCESS_DATA) return 0;
@@ -135,23 +468,16 @@ int iris_hook(int event, void *data)
 	nebstruct_process_data *proc = (nebstruct_process_data*)data;
 	switch (proc->type) {
 	case NEBTYPE_PROCESS_EVENTLOOPSTART:
-		pthread_create(&tid, 0, iris_daemon, data);
+		known_rebuild();
+		if (pthread_create(&tid, 0, iris_daemon, data) == 0)
+			RUNNING = 1;
 		break;
 
 	case NEBTYPE_PROCESS_EVENTLOOPEND:
-		syslog(LOG_PROC, "v" VERSION " shutting down");
-
-#ifdef WHIMP_OUT_ON_RELOAD
-		syslog(LOG_PROC, "not properly shutting down - WHIMPING OUT ON RELOAD");
-#else
-		pthread_cancel(tid);
-		pthread_join(tid, NULL);
-
-		client_deinit();
-		vdebug("closing sockfd %d and epfd %d", sockfd, epfd);
-		close(sockfd); close(epfd);
-#endif
-
+		/* stop reading (anything that comes in meanwhile waits in the
+		   kernel) until we know whether this is a reload or the end */
+		syslog(LOG_PROC, "v" VERSION " pausing");
+		iris_pause();
 		break;
 
 	default:
@@ -168,7 +494,7 @@ int nebmodule_init(int flags, char *args, nebmodule *mod)
 	int rc;
 	IRIS_MODULE = mod;
 
-	vdebug("init started");
+	trace(IRIS_TRACE_ICINGA, "init started");
 	rc = neb_register_callback(NEBCALLBACK_PROCESS_DATA, IRIS_MODULE, 0, iris_hook);
 	if (rc != 0) {
 		syslog(LOG_ERROR, "PROCESS_DATA event registration failed, error %i", rc);
@@ -180,6 +506,28 @@ int nebmodule_init(int flags, char *args, nebmodule *mod)
 int nebmodule_deinit(int flags, int reason)
 {
 	neb_deregister_callback(NEBCALLBACK_PROCESS_DATA, iris_hook);
-	vdebug("deinit complete");
+	iris_pause();
+
+	if (reason == NEBMODULE_NEB_RESTART && sockfd >= 0 && iris_handoff(sockfd, epfd) == 0) {
+		syslog(LOG_PROC, "v" VERSION " reloading; the next copy takes over from here");
+
+	} else {
+		syslog(LOG_PROC, "v" VERSION " shutting down");
+		iris_drain();
+		client_deinit();
+		trace(IRIS_TRACE_ICINGA, "closing sockfd %d and epfd %d", sockfd, epfd);
+		net_close(epfd);
+	}
+	sockfd = epfd = -1;
+
+	/* results already handed to the sink get written out either way */
+	sink_stop(SINK);
+	SINK = NULL;
+
+	known_swap(NULL);
+	hash_free(UNKNOWN, NULL);
+	UNKNOWN = NULL;
+	trace(IRIS_TRACE_ICINGA, "deinit complete");
+	trace_stop(); /* before our code goes away from under it */
 	return 0;
 }
@@ -0,0 +1,485 @@
+#include "iris.h"
+#include <getopt.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+// make iris.o happy
+int iris_call_submit_result(struct pdu *pdu) { return 0; }
+int iris_call_recv_data(int fd) { return 0; }
+int iris_call_register_fd(int fd) { return 0; }
+
+/* iris-top - what a running iris (or irisd) is taking in, and from whom
+
+   Asks admin_unix for `stats', `top-talkers' and `top-hosts' every -d
+   seconds (1, by default), and shows the rates between one answer and
+   the next:
+
+     results/s  bytes/s   everything handed on / read, over any listener
+     bogus/s              by reason: crc, version, age (too old / too far
+                          in the future), command (unparseable lines),
+                          size (short UDP datagrams), and unknown (hosts
+                          and services Icinga has never heard of)
+     clients              active, ready (paused, having used up their
+                          budget), waiting (queued for a client slot)
+     queue                the sink's, or how fast results go to Icinga
+     sources              by address: clients, results/s, bytes/s
+                          (from the source table, so rates still come
+                          out right for agents that connect and hang
+                          up in between)
+     hosts                by results/s
+
+   One connection a second, and nothing in iris counts per host until
+   somebody asks for top-hosts; it's safe to leave running during a
+   storm.  Keys: b, r, c, a sort the sources by bytes, results, clients
+   or address; q quits.  With -b (batch), it prints plain lines instead,
+   for logging or piping into something else, -n times (or forever). */
+
+#define TOP_SOURCES 1000  /* asked for, to work rates out from */
+#define TOP_HOSTS   1000
+#define MAX_STATS    128
+
+struct stat_line {
+	char          name[64];
+	unsigned long value;
+};
+
+struct row {
+	char          name[IRIS_PDU_HOST_LEN];
+	unsigned int  clients;
+	unsigned long bytes;
+	unsigned long results;
+	double        bytes_s;
+	double        results_s;
+};
+
+struct sample {
+	struct timespec  at;
+	struct stat_line stats[MAX_STATS];
+	int              num_stats;
+	struct row      *sources;
+	int              num_sources;
+	struct row      *hosts;
+	int              num_hosts;
+};
+
+static struct termios TERM;
+static int RAW = 0;
+static char SORT = 'b';
+
+static void cooked(void)
+{
+	if (RAW)
+		tcsetattr(0, TCSANOW, &TERM);
+	RAW = 0;
+}
+
+static void quit(int sig)
+{
+	cooked();
+	printf("\n");
+	exit(0);
+}
+
+static void raw(void)
+{
+	struct termios t;
+
+	if (tcgetattr(0, &TERM) != 0)
+		return;
+	t = TERM;
+	t.c_lflag &= ~(ICANON | ECHO);
+	t.c_cc[VMIN]  = 0;
+	t.c_cc[VTIME] = 0;
+	if (tcsetattr(0, TCSANOW, &t) == 0)
+		RAW = 1;
+	atexit(cooked);
+	signal(SIGINT,  quit);
+	signal(SIGTERM, quit);
+}
+
+/* counters can only go backwards if iris was restarted in between */
+static double rate(unsigned long now, unsigned long was, double secs)
+{
+	return (now >= was ? now - was : now) / secs;
+}
+
+static const char* human(double v, char *buf, size_t len)
+{
+	const char *units = " KMGT";
+	while (v >= 1000.0 && units[1]) {
+		v /= 1024.0;
+		units++;
+	}
+	snprintf(buf, len, *units == ' ' ? "%.0f" : "%.1f%c", v, *units);
+	return buf;
+}
+
+static int stat_get(const struct sample *s, const char *name, unsigned long *value)
+{
+	int i;
+	for (i = 0; i < s->num_stats; i++) {
+		if (strcmp(s->stats[i].name, name) == 0) {
+			*value = s->stats[i].value;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static double stat_rate(const struct sample *now, const struct sample *was, const char *name, double secs)
+{
+	unsigned long a = 0, b = 0;
+	if (!stat_get(now, name, &a) || !stat_get(was, name, &b))
+		return 0.0;
+	return rate(a, b, secs);
+}
+
+static int row_by_name(const void *a, const void *b)
+{
+	return strcmp(((const struct row*)a)->name, ((const struct row*)b)->name);
+}
+
+static int row_by_key(const void *a, const void *b)
+{
+	const struct row *x = a, *y = b;
+	switch (SORT) {
+	case 'a': return strcmp(x->name, y->name);
+	case 'c': return x->clients < y->clients ? 1 : x->clients > y->clients ? -1 : row_by_name(a, b);
+	case 'r': return x->results_s < y->results_s ? 1 : x->results_s > y->results_s ? -1 : row_by_name(a, b);
+	default:  return x->bytes_s < y->bytes_s ? 1 : x->bytes_s > y->bytes_s ? -1 : row_by_name(a, b);
+	}
+}
+
+/* fills in each row's rates against the same name in was (sorted by
+   name); rows nobody has seen before get nothing, this time round */
+static void rates(struct row *rows, int n, struct row *was, int num_was, double secs)
+{
+	struct row *w;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (!(w = bsearch(&rows[i], was, num_was, sizeof(struct row), row_by_name)))
+			continue;
+		rows[i].bytes_s   = rate(rows[i].bytes,   w->bytes,   secs);
+		rows[i].results_s = rate(rows[i].results, w->results, secs);
+	}
+}
+
+/* splits the three answers back up; each table starts with a header */
+static int parse(char *answer, struct sample *s)
+{
+	char *line, *save = NULL;
+	int part = 0, head = 1;
+	struct row *r;
+
+	for (line = strtok_r(answer, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+		if (strcmp(line, ".") == 0) {
+			part++;
+			head = 1;
+			continue;
+		}
+		if (strncmp(line, "error:", 6) == 0) {
+			fprintf(stderr, "%s\n", line);
+			return -1;
+		}
+
+		if (part == 0 && s->num_stats < MAX_STATS) {
+			if (sscanf(line, "%63s %lu", s->stats[s->num_stats].name,
+					&s->stats[s->num_stats].value) == 2)
+				s->num_stats++;
+
+		} else if (head) {
+			head = 0;
+
+		} else if (part == 1 && s->num_sources < TOP_SOURCES) {
+			r = &s->sources[s->num_sources];
+			memset(r, 0, sizeof(struct row));
+			if (sscanf(line, "%63s %u %lu %lu", r->name, &r->clients, &r->bytes, &r->results) == 4)
+				s->num_sources++;
+
+		} else if (part == 2 && s->num_hosts < TOP_HOSTS) {
+			r = &s->hosts[s->num_hosts];
+			memset(r, 0, sizeof(struct row));
+			if (sscanf(line, "%63s %lu", r->name, &r->results) == 2)
+				s->num_hosts++;
+		}
+	}
+	return part == 3 ? 0 : -1;
+}
+
+static int sample(const char *sock, struct sample *s)
+{
+	char cmds[64], *answer;
+	int rc;
+
+	s->num_stats = s->num_sources = s->num_hosts = 0;
+	snprintf(cmds, sizeof(cmds), "stats\ntop-talkers %d\ntop-hosts %d\n", TOP_SOURCES, TOP_HOSTS);
+	if (!(answer = admin_query(sock, cmds, 3)))
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &s->at);
+	rc = parse(answer, s);
+	free(answer);
+	if (rc != 0)
+		errno = EPROTO;
+	return rc;
+}
+
+static void show(const struct sample *now, const struct sample *was, int top, int batch)
+{
+	double secs = (now->at.tv_sec - was->at.tv_sec) + (now->at.tv_nsec - was->at.tv_nsec) / 1e9;
+	double crc, version, age, command, size, unknown;
+	unsigned long active = 0, ready = 0, waiting = 0, queued = 0, qsize = 0;
+	char b1[16], b2[16], queue[128];
+	time_t t = time(NULL);
+	int i, have_sink;
+
+	crc     = stat_rate(now, was, "ingest.bogus.crc",     secs);
+	version = stat_rate(now, was, "ingest.bogus.version", secs);
+	age     = stat_rate(now, was, "ingest.bogus.age",     secs);
+	command = stat_rate(now, was, "ingest.bogus.command", secs);
+	size    = stat_rate(now, was, "ingest.bogus.size",    secs);
+	unknown = stat_rate(now, was, "icinga.rejected",      secs);
+	stat_get(now, "clients.active",  &active);
+	stat_get(now, "clients.ready",   &ready);
+	stat_get(now, "clients.waiting", &waiting);
+
+	have_sink = stat_get(now, "sink.queued", &queued) && stat_get(now, "sink.size", &qsize);
+	if (have_sink)
+		snprintf(queue, sizeof(queue), "sink %lu/%lu, %.0f written/s, %.0f dropped/s, %.0f failed/s",
+				queued, qsize,
+				stat_rate(now, was, "sink.written", secs),
+				stat_rate(now, was, "sink.dropped", secs),
+				stat_rate(now, was, "sink.failed",  secs));
+	else
+		snprintf(queue, sizeof(queue), "icinga %.0f submitted/s",
+				stat_rate(now, was, "icinga.submitted", secs));
+
+	if (batch) {
+		printf("%li results/s %.0f bytes/s %.0f bogus/s crc %.0f version %.0f age %.0f"
+		       " command %.0f size %.0f unknown %.0f clients %lu ready %lu waiting %lu",
+				(long)t,
+				stat_rate(now, was, "ingest.results", secs),
+				stat_rate(now, was, "ingest.bytes", secs),
+				crc, version, age, command, size, unknown, active, ready, waiting);
+		if (have_sink)
+			printf(" queued %lu/%lu\n", queued, qsize);
+		else
+			printf("\n");
+		for (i = 0; i < now->num_sources && i < top; i++)
+			printf("%li source %s clients %u results/s %.0f bytes/s %.0f\n", (long)t,
+					now->sources[i].name, now->sources[i].clients,
+					now->sources[i].results_s, now->sources[i].bytes_s);
+		for (i = 0; i < now->num_hosts && i < top; i++)
+			printf("%li host %s results/s %.0f\n", (long)t,
+					now->hosts[i].name, now->hosts[i].results_s);
+		fflush(stdout);
+		return;
+	}
+
+	printf("\033[H\033[2J");
+	printf("iris-top - %.24s, every %.1fs    sort: [b]ytes [r]esults [c]lients [a]ddress  [q]uit\n\n",
+			ctime(&t), secs);
+	printf("results/s %10.0f    bytes/s %8s\n",
+			stat_rate(now, was, "ingest.results", secs),
+			human(stat_rate(now, was, "ingest.bytes", secs), b1, sizeof(b1)));
+	printf("bogus/s   %10.0f    crc %.0f  version %.0f  age %.0f  command %.0f  size %.0f  unknown %.0f\n",
+			crc + version + age + command + size + unknown,
+			crc, version, age, command, size, unknown);
+	printf("clients   %10lu    ready %lu  waiting %lu\n", active, ready, waiting);
+	printf("queue     %s\n\n", queue);
+
+	printf("%-39s %7s %10s %10s\n", "SOURCE", "CLIENTS", "RESULTS/s", "BYTES/s");
+	for (i = 0; i < now->num_sources && i < top; i++)
+		printf("%-39s %7u %10.0f %10s\n", now->sources[i].name, now->sources[i].clients,
+				now->sources[i].results_s, human(now->sources[i].bytes_s, b2, sizeof(b2)));
+	printf("\n%-39s %7s %10s\n", "HOST", "", "RESULTS/s");
+	for (i = 0; i < now->num_hosts && i < top; i++)
+		printf("%-39s %7s %10.0f\n", now->hosts[i].name, "", now->hosts[i].results_s);
+	fflush(stdout);
+}
+
+static int host_by_rate(const void *a, const void *b)
+{
+	const struct row *x = a, *y = b;
+	return x->results_s < y->results_s ? 1 : x->results_s > y->results_s ? -1 : row_by_name(a, b);
+}
+
+/* works out the rates in now, against was, and sorts now for show() */
+static void compare(struct sample *now, struct sample *was)
+{
+	double secs = (now->at.tv_sec - was->at.tv_sec) + (now->at.tv_nsec - was->at.tv_nsec) / 1e9;
+
+	qsort(was->sources, was->num_sources, sizeof(struct row), row_by_name);
+	qsort(was->hosts,   was->num_hosts,   sizeof(struct row), row_by_name);
+	rates(now->sources, now->num_sources, was->sources, was->num_sources, secs);
+	rates(now->hosts,   now->num_hosts,   was->hosts,   was->num_hosts,   secs);
+	qsort(now->sources, now->num_sources, sizeof(struct row), row_by_key);
+	qsort(now->hosts,   now->num_hosts,   sizeof(struct row), host_by_rate);
+}
+
+/* waits out the interval, reacting to keys as they come; now and was
+   are what's on the screen (if anything is, yet) */
+static int keys(struct sample *now, struct sample *was, int shown, int top, int ms)
+{
+	struct pollfd pfd = { .fd = 0, .events = POLLIN };
+	struct timespec start, t;
+	char c;
+	int left = ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (left > 0 && poll(&pfd, 1, left) > 0) {
+		if (read(0, &c, 1) == 1) {
+			if (c == 'q')
+				return 1;
+			if (shown && strchr("brca", c)) {
+				SORT = c;
+				qsort(now->sources, now->num_sources, sizeof(struct row), row_by_key);
+				show(now, was, top, 0);
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		left = ms - ((t.tv_sec - start.tv_sec) * 1000 + (t.tv_nsec - start.tv_nsec) / 1000000);
+	}
+	return 0;
+}
+
+void usage(const char *prog)
+{
+	fprintf(stderr, "USAGE: %s [-c /path/to/iris.conf | -s /path/to/admin.sock]\n"
+	                "          [-d seconds] [-N rows] [-o b|r|c|a] [-b [-n iterations]]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	const char *short_opts = "h?c:s:d:N:o:bn:";
+	struct option long_opts[] = {
+		{ "help",             no_argument, NULL, 'h' },
+		{ "config",     required_argument, NULL, 'c' },
+		{ "socket",     required_argument, NULL, 's' },
+		{ "delay",      required_argument, NULL, 'd' },
+		{ "rows",       required_argument, NULL, 'N' },
+		{ "sort",       required_argument, NULL, 'o' },
+		{ "batch",            no_argument, NULL, 'b' },
+		{ "iterations", required_argument, NULL, 'n' },
+		{ 0, 0, 0, 0 }
+	};
+
+	int opt, idx = 0, rc, top = 10, batch = 0, iterations = 0, n;
+	double delay = 1.0;
+	char *conf = strdup(IRIS_DEFAULT_CONFIG_FILE);
+	char *sock = NULL;
+	struct sample a, b, *now = &a, *was = &b, *tmp;
+
+	while ( (opt = getopt_long(argc, argv, short_opts, long_opts, &idx)) != -1 ) {
+		switch (opt) {
+			case 'c':
+				free(conf);
+				conf = strdup(optarg);
+				break;
+
+			case 's':
+				free(sock);
+				sock = strdup(optarg);
+				break;
+
+			case 'd':
+				if ((delay = atof(optarg)) < 0.1) {
+					fprintf(stderr, "-d: at least 0.1 seconds, please\n");
+					return 1;
+				}
+				break;
+
+			case 'N':
+				if ((top = atoi(optarg)) <= 0) {
+					fprintf(stderr, "-N: needs a number of rows\n");
+					return 1;
+				}
+				break;
+
+			case 'o':
+				if (strlen(optarg) != 1 || !strchr("brca", *optarg)) {
+					fprintf(stderr, "-o: sort by b(ytes), r(esults), c(lients) or a(ddress)\n");
+					return 1;
+				}
+				SORT = *optarg;
+				break;
+
+			case 'b':
+				batch = 1;
+				break;
+
+			case 'n':
+				iterations = atoi(optarg);
+				break;
+
+			case 'h':
+			case '?':
+			default:
+				usage(argv[0]);
+				return 1;
+				break;
+		}
+	}
+
+	if (!sock) {
+		struct server s;
+		server_init(&s);
+		if ((rc = parse_config_file(conf, &s)) != 0) {
+			fprintf(stderr, "%s: %s\n", conf, rc < 0 ? strerror(errno) : "errors were encountered");
+			return 2;
+		}
+		if (!s.admin_unix) {
+			fprintf(stderr, "%s: no admin_unix socket configured (or use -s)\n", conf);
+			return 2;
+		}
+		sock = strdup(s.admin_unix);
+		server_free(&s);
+	}
+
+	a.sources = calloc(TOP_SOURCES, sizeof(struct row));
+	b.sources = calloc(TOP_SOURCES, sizeof(struct row));
+	a.hosts   = calloc(TOP_HOSTS, sizeof(struct row));
+	b.hosts   = calloc(TOP_HOSTS, sizeof(struct row));
+	if (!a.sources || !b.sources || !a.hosts || !b.hosts) {
+		perror("calloc");
+		return 2;
+	}
+
+	if (sample(sock, was) != 0) {
+		fprintf(stderr, "%s: %s\n", sock, strerror(errno));
+		return 2;
+	}
+	if (!batch && isatty(0)) {
+		raw();
+		printf("\033[H\033[2Jiris-top - asking %s every %.1fs ...\n", sock, delay);
+		fflush(stdout);
+	}
+
+	for (n = 0; !iterations || n < iterations; n++) {
+		if (batch || !RAW)
+			usleep(delay * 1000000);
+		else if (keys(was, now, n > 0, top, delay * 1000))
+			break;
+
+		if (sample(sock, now) != 0) {
+			cooked();
+			fprintf(stderr, "%s: %s\n", sock, strerror(errno));
+			return 2;
+		}
+		compare(now, was);
+		show(now, was, top, batch);
+
+		tmp = was;
+		was = now;
+		now = tmp;
+	}
+
+	cooked();
+	free(a.sources);
+	free(b.sources);
+	free(a.hosts);
+	free(b.hosts);
+	free(conf);
+	free(sock);
+	return 0;
+}
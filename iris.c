@@ -1,20 +1,121 @@
 #include "iris.h"
+#include "probes.h"
+#include <pthread.h>
 
 #if _POSIX_MONOTONIC_CLOCK > 0
 #  error "_POSIX_MONOTONIC_CLOCK not set; is the MONOTONIC clock available?"
 #else
 #endif
 
-struct client *CLIENTS = NULL;
+/* the client table, in chunks of IRIS_CLIENT_CHUNK slots; only the
+   first CLIENTS_ALLOCATED slots (of NUM_CLIENTS) exist */
+struct client **CLIENTS = NULL;
 unsigned int NUM_CLIENTS = 0;
+unsigned int CLIENTS_ALLOCATED = 0;
+
+/* spare receive buffers, linked through their first bytes */
+void *PDU_POOL = NULL;
+unsigned int PDU_POOL_SIZE = 0;
 time_t MAX_LIFETIME = 20;
+int LISTEN_BACKLOG = SOMAXCONN;
+int OVERFLOW_POLICY = IRIS_OVERFLOW_REJECT;
+unsigned int OVERFLOW_MAX = 1024;
+
+struct client_stats CLIENT_STATS = {0};
+
+/* connections accepted while every client slot was taken, waiting
+   (outside of epoll) for one to free up; see overflow_policy */
+struct overflow {
+	int                     fd;
+	int                     listener;
+	time_t                  since;
+	struct sockaddr_storage peer;
+} *OVERFLOW = NULL;
+unsigned int OVERFLOW_HEAD = 0;
+int OVERFLOW_EPFD = -1;
+
+struct listener {
+	int fd;
+	int proto;
+	int flags;
+	int queued;
+	struct shmring *ring;
+} LISTENERS[IRIS_MAX_LISTENERS];
+unsigned int NUM_LISTENERS = 0;
+
+/* fds that ran out of budget with work left over, oldest first */
+int *READY = NULL;
+unsigned int READY_SIZE = 0, READY_HEAD = 0, READY_COUNT = 0;
+
+/* extra PDU listeners bound by net_bind_server, for net_listeners */
+int PENDING[IRIS_MAX_LISTENERS];
+unsigned int NUM_PENDING = 0;
+
+uint32_t UDP_DROPPED = 0;
+time_t UDP_STATS_AT = 0;
 
-extern void iris_call_submit_result(struct pdu *pdu);
+/* an eventfd in the epoll set, so other threads (and signal handlers)
+   can stop mainloop; STOP_ERRNO is why they couldn't, for it to log */
+int CONTROL_FD = -1;
+volatile sig_atomic_t STOP = 0;
+volatile sig_atomic_t STOP_ERRNO = 0;
+
+/* see trace(), in iris.h; TRACE_GLOBAL is TRACE_MASK, unless only
+   some clients are being traced (in which case it's 0) */
+volatile uint32_t TRACE_MASK = 0;
+volatile uint32_t TRACE_GLOBAL = 0;
+char TRACE_SCOPE[IRIS_TRACE_SCOPES][IRIS_ADDRSTRLEN];
+int NUM_TRACE_SCOPES = 0;
+
+struct {
+	pthread_mutex_t lock;
+	pthread_cond_t  ready;
+	pthread_t       tid;
+	int             running;
+
+	char            lines[IRIS_TRACE_RING][IRIS_TRACE_LINE];
+	unsigned int    head;
+	unsigned int    count;
+	unsigned long   dropped;
+} TRACE = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+extern int iris_call_submit_result(struct pdu *pdu);
 extern int iris_call_recv_data(int fd);
 extern int iris_call_register_fd(int fd);
 
 unsigned long CRC32[256] = {0};
 
+struct ingest_stats INGEST = {0};
+
+/* results per host, while anyone is watching (see admin_hosts) */
+static struct hash *HOSTS = NULL;
+static time_t HOSTS_UNTIL = 0;
+static unsigned long HOSTS_OTHERS = 0;
+static void hosts_count(const char *host);
+
+/* per-source accounting (see source_get) */
+static struct source *SOURCES = NULL;
+static unsigned int NUM_SOURCES = 0;
+static unsigned long SOURCES_EVICTED = 0;
+static struct hash *SOURCE_INDEX = NULL;
+static struct source* client_source(struct client *c);
+static void source_count(struct client *c, size_t bytes, int results, int bogus);
+
+/* iris_call_submit_result, between probes (see probes.h); returns
+   IRIS_ACK_OK, or the reason the result was thrown away */
+static inline int submit(int fd, struct pdu *pdu)
+{
+	int rc;
+
+	IRIS_PROBE2(submit_start, fd, pdu);
+	INGEST.results++;
+	if (HOSTS)
+		hosts_count(pdu->host);
+	rc = iris_call_submit_result(pdu);
+	IRIS_PROBE1(submit_done, fd);
+	return rc;
+}
+
 void strip(char *s)
 {
 	char *p;
@@ -53,6 +154,183 @@ unsigned long crc32(void *ptr, int len)
 	return (crc ^ 0xFFFFFFFF);
 }
 
+/* FNV-1a */
+static uint32_t hash_key(const char *key, size_t len)
+{
+	uint32_t h = 2166136261u;
+	while (len-- > 0)
+		h = (h ^ (uint8_t)*key++) * 16777619u;
+	return h;
+}
+
+/* room for n keys without growing */
+struct hash* hash_new(unsigned int n)
+{
+	struct hash *h;
+	unsigned int size = 16;
+
+	while (size / 4 * 3 < n)
+		size <<= 1;
+
+	if (!(h = calloc(1, sizeof(struct hash))))
+		return NULL;
+	if (!(h->slots = calloc(size, sizeof(struct hash_entry)))) {
+		free(h);
+		return NULL;
+	}
+	h->size = size;
+	return h;
+}
+
+void hash_free(struct hash *h, void (*destroy)(void *value))
+{
+	unsigned int i;
+
+	if (!h)
+		return;
+	for (i = 0; i < h->size; i++) {
+		if (!h->slots[i].key)
+			continue;
+		free(h->slots[i].key);
+		if (destroy)
+			destroy(h->slots[i].value);
+	}
+	free(h->slots);
+	free(h);
+}
+
+static struct hash_entry* hash_find(const struct hash *h, const char *key, size_t len, uint32_t hash)
+{
+	struct hash_entry *e;
+	unsigned int i;
+
+	for (i = hash & (h->size - 1); ; i = (i + 1) & (h->size - 1)) {
+		e = &h->slots[i];
+		if (!e->key
+		 || (e->hash == hash && e->len == len && memcmp(e->key, key, len) == 0))
+			return e;
+	}
+}
+
+void* hash_get(const struct hash *h, const char *key, size_t len)
+{
+	struct hash_entry *e;
+
+	if (!h)
+		return NULL;
+	e = hash_find(h, key, len, hash_key(key, len));
+	return e->key ? e->value : NULL;
+}
+
+static int hash_grow(struct hash *h)
+{
+	struct hash_entry *old = h->slots, *e;
+	unsigned int i, size = h->size;
+
+	if (!(h->slots = calloc(size * 2, sizeof(struct hash_entry)))) {
+		h->slots = old;
+		return -1;
+	}
+	h->size = size * 2;
+	for (i = 0; i < size; i++) {
+		if (!old[i].key)
+			continue;
+		e = hash_find(h, old[i].key, old[i].len, old[i].hash);
+		memcpy(e, &old[i], sizeof(struct hash_entry));
+	}
+	free(old);
+	return 0;
+}
+
+/* adds key, or replaces its value */
+int hash_set(struct hash *h, const char *key, size_t len, void *value)
+{
+	struct hash_entry *e;
+	uint32_t hash = hash_key(key, len);
+
+	e = hash_find(h, key, len, hash);
+	if (e->key) {
+		e->value = value;
+		return 0;
+	}
+
+	if (h->count + 1 > h->size / 4 * 3) {
+		if (hash_grow(h) != 0)
+			return -1;
+		e = hash_find(h, key, len, hash);
+	}
+	if (!(e->key = malloc(len + 1)))
+		return -1;
+	memcpy(e->key, key, len);
+	e->key[len] = '\0';
+	e->len   = len;
+	e->hash  = hash;
+	e->value = value;
+	h->count++;
+	return 0;
+}
+
+/* removes key, returning its value (NULL if it wasn't there) */
+void* hash_del(struct hash *h, const char *key, size_t len)
+{
+	struct hash_entry *e;
+	unsigned int i, j, home, mask;
+	void *value;
+
+	if (!h)
+		return NULL;
+	e = hash_find(h, key, len, hash_key(key, len));
+	if (!e->key)
+		return NULL;
+	value = e->value;
+	free(e->key);
+	h->count--;
+
+	/* close the gap: anything further along the same run that could
+	   have gone here moves up, or lookups would stop short of it */
+	mask = h->size - 1;
+	i = e - h->slots;
+	for (j = (i + 1) & mask; h->slots[j].key; j = (j + 1) & mask) {
+		home = h->slots[j].hash & mask;
+		if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+			h->slots[i] = h->slots[j];
+			i = j;
+		}
+	}
+	memset(&h->slots[i], 0, sizeof(struct hash_entry));
+	return value;
+}
+
+void hash_each(const struct hash *h,
+		void (*fn)(const char *key, size_t len, void *value, void *udata), void *udata)
+{
+	unsigned int i;
+
+	if (!h)
+		return;
+	for (i = 0; i < h->size; i++) {
+		if (h->slots[i].key)
+			fn(h->slots[i].key, h->slots[i].len, h->slots[i].value, udata);
+	}
+}
+
+/* one shared, immutable copy of s, good for as long as h is; handing
+   out the hash's own copy of the key costs nothing extra */
+const char* intern(struct hash *h, const char *s, size_t len)
+{
+	struct hash_entry *e;
+	uint32_t hash = hash_key(s, len);
+
+	e = hash_find(h, s, len, hash);
+	if (e->key)
+		return e->key;
+	if (hash_set(h, s, len, NULL) != 0)
+		return NULL;
+	e = hash_find(h, s, len, hash);
+	e->value = e->key;
+	return e->key;
+}
+
 int nonblocking(int fd)
 {
 	int flags = fcntl(fd, F_GETFL, 0);
@@ -75,6 +353,239 @@ int close_on_exec(int fd)
 	return 0;
 }
 
+int log_facility(const char *name)
+{
+	return strcmp(name, "local0") == 0 ? LOG_LOCAL0
+	     : strcmp(name, "local1") == 0 ? LOG_LOCAL1
+	     : strcmp(name, "local2") == 0 ? LOG_LOCAL2
+	     : strcmp(name, "local3") == 0 ? LOG_LOCAL3
+	     : strcmp(name, "local4") == 0 ? LOG_LOCAL4
+	     : strcmp(name, "local5") == 0 ? LOG_LOCAL5
+	     : strcmp(name, "local6") == 0 ? LOG_LOCAL6
+	     : strcmp(name, "local7") == 0 ? LOG_LOCAL7
+	                                   : LOG_DAEMON;
+}
+
+static const char *TRACE_NAMES[] = {
+	"loop", "net", "client", "read", "pdu", "tls", "sink", "icinga", NULL
+};
+
+/* "net,client,read" (or "all", or "none") -> a category mask */
+int trace_parse(const char *list, uint32_t *mask)
+{
+	const char *a, *b;
+	size_t len;
+	int i;
+
+	*mask = 0;
+	for (a = list; *a; a = *b ? b + 1 : b) {
+		for (b = a; *b && *b != ','; b++)
+			;
+		len = b - a;
+		if (len == 3 && strncmp(a, "all", 3) == 0) {
+			*mask |= IRIS_TRACE_ALL;
+			continue;
+		}
+		if (len == 4 && strncmp(a, "none", 4) == 0)
+			continue;
+		for (i = 0; TRACE_NAMES[i]; i++) {
+			if (strlen(TRACE_NAMES[i]) == len && strncmp(a, TRACE_NAMES[i], len) == 0)
+				break;
+		}
+		if (!TRACE_NAMES[i])
+			return -1;
+		*mask |= 1 << i;
+	}
+	return 0;
+}
+
+/* ... and back again */
+const char* trace_names(uint32_t mask, char *buf, size_t len)
+{
+	size_t n = 0;
+	int i;
+
+	mask &= IRIS_TRACE_ALL;
+	if (mask == 0 || mask == IRIS_TRACE_ALL) {
+		snprintf(buf, len, "%s", mask ? "all" : "none");
+		return buf;
+	}
+	buf[0] = '\0';
+	for (i = 0; TRACE_NAMES[i]; i++) {
+		if ((mask & (1 << i)) && n < len)
+			n += snprintf(buf + n, len - n, "%s%s", n ? "," : "", TRACE_NAMES[i]);
+	}
+	return buf;
+}
+
+/* an address, the way net_ntop (and so client->addr) would print it;
+   "local" means clients on the unix socket */
+static int canon_addr(const char *in, char *out)
+{
+	unsigned char addr[sizeof(struct in6_addr)];
+
+	if (strcmp(in, "local") == 0)
+		snprintf(out, IRIS_ADDRSTRLEN, "<local>");
+	else if (inet_pton(AF_INET, in, addr) == 1)
+		inet_ntop(AF_INET, addr, out, IRIS_ADDRSTRLEN);
+	else if (inet_pton(AF_INET6, in, addr) == 1)
+		inet_ntop(AF_INET6, addr, out, IRIS_ADDRSTRLEN);
+	else
+		return -1;
+	return 0;
+}
+
+static int trace_match(const char *addr)
+{
+	int i;
+
+	if (NUM_TRACE_SCOPES == 0)
+		return 1;
+	for (i = 0; i < NUM_TRACE_SCOPES; i++) {
+		if (strcmp(TRACE_SCOPE[i], addr) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+void trace_set(uint32_t mask)
+{
+	TRACE_MASK   = mask;
+	TRACE_GLOBAL = NUM_TRACE_SCOPES ? 0 : mask;
+}
+
+/* Only trace clients from these addresses (or everything, if n is 0);
+   clients already connected are re-checked, so this is a reactor
+   thread thing, like server_apply */
+int trace_scope(char *const *addrs, int n)
+{
+	char scope[IRIS_TRACE_SCOPES][IRIS_ADDRSTRLEN];
+	struct client *c;
+	unsigned int i;
+	int j;
+
+	if (n > IRIS_TRACE_SCOPES) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (j = 0; j < n; j++) {
+		if (canon_addr(addrs[j], scope[j]) != 0) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	memcpy(TRACE_SCOPE, scope, n * sizeof(scope[0]));
+	NUM_TRACE_SCOPES = n;
+	trace_set(TRACE_MASK);
+
+	for (i = 0; i < CLIENTS_ALLOCATED; i++) {
+		c = client_at(i);
+		if (c->fd >= 0 && trace_match(c->addr))
+			c->flags |= IRIS_CLIENT_TRACED;
+		else
+			c->flags &= ~IRIS_CLIENT_TRACED;
+	}
+	return 0;
+}
+
+/* Formats a line and queues it for the trace thread; it never waits,
+   not even for the lock (the thread only holds it for a memcpy) */
+void trace_emit(const char *fmt, ...)
+{
+	char line[IRIS_TRACE_LINE];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+
+	if (pthread_mutex_trylock(&TRACE.lock) != 0) {
+		__sync_fetch_and_add(&TRACE.dropped, 1);
+		return;
+	}
+	if (TRACE.count == IRIS_TRACE_RING) {
+		__sync_fetch_and_add(&TRACE.dropped, 1);
+		pthread_mutex_unlock(&TRACE.lock);
+		return;
+	}
+	memcpy(TRACE.lines[(TRACE.head + TRACE.count) % IRIS_TRACE_RING], line, sizeof(line));
+	if (TRACE.count++ == 0)
+		pthread_cond_signal(&TRACE.ready);
+	pthread_mutex_unlock(&TRACE.lock);
+}
+
+/* takes the oldest line off the ring; returns its length, or -1 if
+   there weren't any */
+int trace_read(char *buf, size_t len)
+{
+	int n = -1;
+
+	pthread_mutex_lock(&TRACE.lock);
+	if (TRACE.count > 0) {
+		n = snprintf(buf, len, "%s", TRACE.lines[TRACE.head]);
+		TRACE.head = (TRACE.head + 1) % IRIS_TRACE_RING;
+		TRACE.count--;
+	}
+	pthread_mutex_unlock(&TRACE.lock);
+	return n;
+}
+
+unsigned long trace_dropped(void)
+{
+	return __sync_add_and_fetch(&TRACE.dropped, 0);
+}
+
+static void* trace_thread(void *arg)
+{
+	char line[IRIS_TRACE_LINE];
+	unsigned long dropped, reported = 0;
+	int running = 1;
+
+	while (running) {
+		pthread_mutex_lock(&TRACE.lock);
+		while (TRACE.running && TRACE.count == 0)
+			pthread_cond_wait(&TRACE.ready, &TRACE.lock);
+		running = TRACE.running;
+		pthread_mutex_unlock(&TRACE.lock);
+
+		/* what's left gets written out before we go */
+		while (trace_read(line, sizeof(line)) >= 0)
+			syslog(LOG_DEBUG, "%s", line);
+
+		if ((dropped = trace_dropped()) != reported) {
+			syslog(LOG_WARN, "trace ring overflowed; %lu lines dropped so far", dropped);
+			reported = dropped;
+		}
+	}
+	return NULL;
+}
+
+int trace_start(void)
+{
+	int rc;
+
+	if (TRACE.running)
+		return 0;
+	TRACE.running = 1;
+	if ((rc = pthread_create(&TRACE.tid, NULL, trace_thread, NULL)) != 0) {
+		TRACE.running = 0;
+		errno = rc;
+		return -1;
+	}
+	return 0;
+}
+
+void trace_stop(void)
+{
+	if (!TRACE.running)
+		return;
+	pthread_mutex_lock(&TRACE.lock);
+	TRACE.running = 0;
+	pthread_cond_signal(&TRACE.ready);
+	pthread_mutex_unlock(&TRACE.lock);
+	pthread_join(TRACE.tid, NULL);
+}
+
 int server_init(struct server *s)
 {
 	if (!s) {
@@ -83,17 +594,106 @@ int server_init(struct server *s)
 	}
 
 	s->port            = strdup("5668");
+	s->num_listen      = 0;
+	s->cmd_port        = NULL;
+	s->listen_unix     = NULL;
+	s->cmd_unix        = NULL;
+	s->admin_unix      = NULL;
+	s->unix_skip_crc   = 0;
+	s->reject_unknown  = 1;
+	s->udp_port        = NULL;
+	s->ack_port        = NULL;
+	s->tls_port        = NULL;
+	s->tls_cert        = NULL;
+	s->tls_key         = NULL;
+	s->listen_shm      = NULL;
+	s->shm_slots       = IRIS_SHM_SLOTS;
 	s->max_clients     = 16 * 1024;
-	s->max_lifetime    = MAX_LIFETIME;
+	s->max_lifetime    = 20;
+	s->listen_backlog  = SOMAXCONN;
+	s->overflow_policy = IRIS_OVERFLOW_REJECT;
+	s->overflow_queue  = 1024;
 	s->syslog_ident    = strdup("iris");
 	s->syslog_facility = strdup("daemon");
 
+	s->sink              = NULL;
+	s->sink_path         = NULL;
+	s->sink_queue        = 4096;
+	s->sink_batch        = 256;
+	s->sink_flush        = 1;
+
+	s->upstream          = NULL;
+	s->upstream_lifetime = 15;
+	s->spool_dir         = NULL;
+
+#ifdef DEBUG
+	s->trace             = IRIS_TRACE_ALL;
+#else
+	s->trace             = 0;
+#endif
+	s->num_trace_from    = 0;
+
 	if (!s->port)            return 2;
 	if (!s->syslog_ident)    return 2;
 	if (!s->syslog_facility) return 2;
 	return 0;
 }
 
+void server_free(struct server *s)
+{
+	int i;
+
+	if (!s) return;
+	free(s->port);
+	for (i = 0; i < s->num_listen; i++)
+		free(s->listen[i]);
+	free(s->cmd_port);
+	free(s->listen_unix);
+	free(s->cmd_unix);
+	free(s->admin_unix);
+	free(s->udp_port);
+	free(s->ack_port);
+	free(s->tls_port);
+	free(s->tls_cert);
+	free(s->tls_key);
+	free(s->listen_shm);
+	free(s->syslog_ident);
+	free(s->syslog_facility);
+	free(s->sink);
+	free(s->sink_path);
+	free(s->upstream);
+	free(s->spool_dir);
+	for (i = 0; i < s->num_trace_from; i++)
+		free(s->trace_from[i]);
+	memset(s, 0, sizeof(struct server));
+}
+
+/* Problems that parse_config can't see, one directive at a time;
+   returns how many there were (each is reported on stderr) */
+int server_check(const struct server *s)
+{
+	int n = 0;
+
+	if (s->max_clients == 0) {
+		fprintf(stderr, "max_clients must be at least 1\n");
+		n++;
+	}
+	if (s->tls_port && (!s->tls_cert || !s->tls_key)) {
+		fprintf(stderr, "tls_port needs both tls_cert and tls_key\n");
+		n++;
+	}
+	if (s->overflow_policy == IRIS_OVERFLOW_QUEUE && s->overflow_queue == 0) {
+		fprintf(stderr, "overflow_policy = queue needs an overflow_queue\n");
+		n++;
+	}
+	if (s->sink_batch > s->sink_queue) {
+		fprintf(stderr, "sink_batch (%u) can't be more than sink_queue (%u)\n",
+				s->sink_batch, s->sink_queue);
+		n++;
+	}
+	return n;
+}
+
 int parse_config_file(const char *file, struct server *s)
 {
 	FILE *io;
@@ -107,6 +707,13 @@ int parse_config_file(const char *file, struct server *s)
 	return rc;
 }
 
+static int parse_bool(const char *v)
+{
+	if (strcasecmp(v, "yes") == 0 || strcasecmp(v, "true")  == 0 || strcmp(v, "1") == 0) return 1;
+	if (strcasecmp(v, "no")  == 0 || strcasecmp(v, "false") == 0 || strcmp(v, "0") == 0) return 0;
+	return -1;
+}
+
 int parse_config(FILE *io, struct server *s)
 {
 	char buf[8192];
@@ -157,6 +764,64 @@ int parse_config(FILE *io, struct server *s)
 		if (strcmp(directive, "port") == 0) {
 			free(s->port);
 			s->port = strdup(value);
+		} else if (strcmp(directive, "listen") == 0) {
+			if (s->num_listen == IRIS_MAX_LISTENERS) {
+				fprintf(stderr, "too many listen addresses, line %d: %s\n", line, buf);
+				return 12;
+			}
+			s->listen[s->num_listen++] = strdup(value);
+		} else if (strcmp(directive, "cmd_port") == 0) {
+			free(s->cmd_port);
+			s->cmd_port = strdup(value);
+		} else if (strcmp(directive, "listen_unix") == 0) {
+			free(s->listen_unix);
+			s->listen_unix = strdup(value);
+		} else if (strcmp(directive, "cmd_unix") == 0) {
+			free(s->cmd_unix);
+			s->cmd_unix = strdup(value);
+		} else if (strcmp(directive, "admin_unix") == 0) {
+			free(s->admin_unix);
+			s->admin_unix = strdup(value);
+		} else if (strcmp(directive, "reject_unknown") == 0) {
+			if ((s->reject_unknown = parse_bool(value)) < 0) {
+				fprintf(stderr, "malformed configuration, line %d: %s\n", line, buf);
+				return 16;
+			}
+
+		} else if (strcmp(directive, "unix_skip_crc") == 0) {
+			if ((s->unix_skip_crc = parse_bool(value)) < 0) {
+				fprintf(stderr, "malformed configuration, line %d: %s\n", line, buf);
+				return 10;
+			}
+		} else if (strcmp(directive, "ack_port") == 0) {
+			free(s->ack_port);
+			s->ack_port = strdup(value);
+
+		} else if (strcmp(directive, "tls_port") == 0) {
+			free(s->tls_port);
+			s->tls_port = strdup(value);
+
+		} else if (strcmp(directive, "tls_cert") == 0) {
+			free(s->tls_cert);
+			s->tls_cert = strdup(value);
+
+		} else if (strcmp(directive, "tls_key") == 0) {
+			free(s->tls_key);
+			s->tls_key = strdup(value);
+
+		} else if (strcmp(directive, "udp_port") == 0) {
+			free(s->udp_port);
+			s->udp_port = strdup(value);
+		} else if (strcmp(directive, "listen_shm") == 0) {
+			free(s->listen_shm);
+			s->listen_shm = strdup(value);
+		} else if (strcmp(directive, "shm_slots") == 0) {
+			errno = 0;
+			s->shm_slots = strtol(value, &endptr, 10);
+			if (errno != 0 || endptr == value || s->shm_slots == 0) {
+				fprintf(stderr, "malformed configuration, line %d: %s\n", line, buf);
+				return 11;
+			}
 		} else if (strcmp(directive, "max_clients") == 0) {
 			errno = 0;
 			s->max_clients = strtol(value, &endptr, 10);
@@ -171,7 +836,31 @@ int parse_config(FILE *io, struct server *s)
 				fprintf(stderr, "malformed configuration, line %d: %s\n", line, buf);
 				return 5;
 			}
-			MAX_LIFETIME = s->max_lifetime;
+		} else if (strcmp(directive, "listen_backlog") == 0) {
+			errno = 0;
+			s->listen_backlog = strtol(value, &endptr, 10);
+			if (errno != 0 || endptr == value || s->listen_backlog <= 0) {
+				fprintf(stderr, "malformed configuration, line %d: %s\n", line, buf);
+				return 13;
+			}
+		} else if (strcmp(directive, "overflow_policy") == 0) {
+			if (strcmp(value, "reject") == 0) {
+				s->overflow_policy = IRIS_OVERFLOW_REJECT;
+			} else if (strcmp(value, "queue") == 0) {
+				s->overflow_policy = IRIS_OVERFLOW_QUEUE;
+			} else if (strcmp(value, "evict") == 0) {
+				s->overflow_policy = IRIS_OVERFLOW_EVICT;
+			} else {
+				fprintf(stderr, "malformed configuration, line %d: %s\n", line, buf);
+				return 14;
+			}
+		} else if (strcmp(directive, "overflow_queue") == 0) {
+			errno = 0;
+			s->overflow_queue = strtol(value, &endptr, 10);
+			if (errno != 0 || endptr == value) {
+				fprintf(stderr, "malformed configuration, line %d: %s\n", line, buf);
+				return 15;
+			}
 		} else if (strcmp(directive, "syslog_ident") == 0) {
 			free(s->syslog_ident);
 			s->syslog_ident = strdup(value);
@@ -180,6 +869,59 @@ int parse_config(FILE *io, struct server *s)
 				*a = tolower(*a);
 			free(s->syslog_facility);
 			s->syslog_facility = strdup(value);
+		} else if (strcmp(directive, "upstream") == 0) {
+			free(s->upstream);
+			s->upstream = strdup(value);
+		} else if (strcmp(directive, "sink") == 0) {
+			free(s->sink);
+			s->sink = strdup(value);
+		} else if (strcmp(directive, "sink_path") == 0) {
+			free(s->sink_path);
+			s->sink_path = strdup(value);
+		} else if (strcmp(directive, "sink_queue") == 0) {
+			errno = 0;
+			s->sink_queue = strtol(value, &endptr, 10);
+			if (errno != 0 || endptr == value || s->sink_queue == 0) {
+				fprintf(stderr, "malformed configuration, line %d: %s\n", line, buf);
+				return 9;
+			}
+		} else if (strcmp(directive, "sink_batch") == 0) {
+			errno = 0;
+			s->sink_batch = strtol(value, &endptr, 10);
+			if (errno != 0 || endptr == value || s->sink_batch == 0) {
+				fprintf(stderr, "malformed configuration, line %d: %s\n", line, buf);
+				return 6;
+			}
+		} else if (strcmp(directive, "sink_flush") == 0) {
+			errno = 0;
+			s->sink_flush = strtol(value, &endptr, 10);
+			if (errno != 0 || endptr == value || s->sink_flush <= 0) {
+				fprintf(stderr, "malformed configuration, line %d: %s\n", line, buf);
+				return 7;
+			}
+		} else if (strcmp(directive, "upstream_lifetime") == 0) {
+			errno = 0;
+			s->upstream_lifetime = strtol(value, &endptr, 10);
+			if (errno != 0 || endptr == value) {
+				fprintf(stderr, "malformed configuration, line %d: %s\n", line, buf);
+				return 8;
+			}
+		} else if (strcmp(directive, "spool_dir") == 0) {
+			free(s->spool_dir);
+			s->spool_dir = strdup(value);
+
+		} else if (strcmp(directive, "trace") == 0) {
+			if (trace_parse(value, &s->trace) != 0) {
+				fprintf(stderr, "malformed configuration, line %d: %s\n", line, buf);
+				return 17;
+			}
+		} else if (strcmp(directive, "trace_from") == 0) {
+			char addr[IRIS_ADDRSTRLEN];
+			if (s->num_trace_from == IRIS_TRACE_SCOPES || canon_addr(value, addr) != 0) {
+				fprintf(stderr, "malformed configuration, line %d: %s\n", line, buf);
+				return 18;
+			}
+			s->trace_from[s->num_trace_from++] = strdup(value);
 		} else {
 			fprintf(stderr, "unrecognized configuration directive '%s', on line %i\n",
 				directive, line);
@@ -194,7 +936,7 @@ ssize_t pdu_read(int fd, uint8_t *buf, size_t start)
 	uint8_t *ptr = buf+start;
 
 	if (!buf) {
-		vdebug("pdu_read: received a NULL buffer...");
+		trace(IRIS_TRACE_READ, "pdu_read: received a NULL buffer...");
 		errno = EINVAL;
 		return -1;
 	}
@@ -207,7 +949,7 @@ ssize_t pdu_read(int fd, uint8_t *buf, size_t start)
 	}
 
 	if (start != 0) {
-		vdebug("pdu_read: starting at byte offset %lu for read of %lu bytes from %s fd %d",
+		trace(IRIS_TRACE_READ, "pdu_read: starting at byte offset %lu for read of %lu bytes from %s fd %d",
 				start, len, client_addr(fd), fd);
 	}
 
@@ -215,11 +957,9 @@ ssize_t pdu_read(int fd, uint8_t *buf, size_t start)
 	while (len > 0 && (n = read(fd, ptr+offset, len)) > 0) {
 		 offset += n; len -= n;
 	}
-	if (n < 0) {
-		if (errno == EAGAIN || errno == EWOULDBLOCK)
-			return offset;
-		return n;
-	}
+	if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		offset = n;
+	IRIS_PROBE3(read, fd, start, offset);
 	return offset;
 }
 
@@ -238,7 +978,37 @@ ssize_t pdu_write(int fd, const uint8_t *buf)
 	return n < 0 ? n : off - buf;
 }
 
-void pdu_dump(const struct pdu *pdu)
+/* reads one ack frame (blocking), and puts it in host byte order */
+int ack_read(int fd, struct ack *ack)
+{
+	ssize_t n, len = sizeof(struct ack);
+	uint8_t *off = (uint8_t*)ack;
+
+	while (len > 0) {
+		if ((n = read(fd, off, len)) <= 0) {
+			if (n == 0) errno = ECONNRESET;
+			return -1;
+		}
+		off += n; len -= n;
+	}
+	ack->type   = ntohs(ack->type);
+	ack->reason = ntohs(ack->reason);
+	ack->seq    = ntohl(ack->seq);
+	return 0;
+}
+
+const char *ack_reason(int reason)
+{
+	switch (reason) {
+	case IRIS_ACK_OK:         return "ok";
+	case IRIS_ACK_BOGUS:      return "bad CRC or protocol version";
+	case IRIS_ACK_QUEUE_FULL: return "queue-full";
+	case IRIS_ACK_UNKNOWN:    return "unknown";
+	default:                  return "unknown reason";
+	}
+}
+
+void pdu_dump(const struct pdu *pdu)
 {
 	if (!pdu) return;
 
@@ -277,7 +1047,7 @@ int pdu_pack(struct pdu *pdu)
 	return 0;
 }
 
-int pdu_unpack(struct pdu *pdu)
+static int _pdu_unpack(struct pdu *pdu, int check_crc)
 {
 	if (!pdu) return -1;
 
@@ -287,14 +1057,22 @@ int pdu_unpack(struct pdu *pdu)
 
 	// check the CRC32
 	their_crc = ntohl(pdu->crc32); // LCOV_EXCL_LINE
-	pdu->crc32 = 0L;
-	our_crc = crc32((uint8_t*)pdu, sizeof(struct pdu));
-	// put the CRC32 back...
-	pdu->crc32 = their_crc;
-	if (our_crc != their_crc) {
-		syslog(LOG_INFO, "Bogus Packet - CRC mismatch (calculated %x != %x)", our_crc, their_crc);
-		vdump(pdu);
-		return -1;
+	if (check_crc) {
+		pdu->crc32 = 0L;
+		our_crc = crc32((uint8_t*)pdu, sizeof(struct pdu));
+		// put the CRC32 back...
+		pdu->crc32 = their_crc;
+		if (our_crc != their_crc) {
+			syslog(LOG_INFO, "Bogus Packet - CRC mismatch (calculated %x != %x)", our_crc, their_crc);
+			INGEST.bogus_crc++;
+			IRIS_PROBE2(crc_fail, their_crc, our_crc);
+			trace(IRIS_TRACE_PDU, "bogus packet: v%u ts %u rc %u host '%.64s' service '%.64s'",
+					ntohs(pdu->version), ntohl(pdu->ts), ntohs(pdu->rc),
+					pdu->host, pdu->service);
+			return -1;
+		}
+	} else {
+		pdu->crc32 = their_crc;
 	}
 
 	pdu->version = ntohs(pdu->version); // LCOV_EXCL_LINE
@@ -303,6 +1081,7 @@ int pdu_unpack(struct pdu *pdu)
 
 	if (pdu->version != IRIS_PROTOCOL_VERSION) {
 		syslog(LOG_INFO, "Bogus Packet - Incorrect PDU version (got %d, wanted %d)", pdu->version, IRIS_PROTOCOL_VERSION);
+		INGEST.bogus_version++;
 		return -1;
 	}
 
@@ -314,6 +1093,8 @@ int pdu_unpack(struct pdu *pdu)
 		age = (long)(now - pdu->ts);
 	}
 	if (age > 900) { // FIXME: configuration file?
+		IRIS_PROBE2(too_old, age, pdu->ts);
+		INGEST.bogus_age++;
 		syslog(LOG_INFO, "Bogus Packet - PDU timestamp is %lus in the %s", age,
 			(pdu->ts > (uint32_t)(now) ? "future" : "past"));
 		return -1;
@@ -323,287 +1104,3328 @@ int pdu_unpack(struct pdu *pdu)
 	return 0;
 }
 
-int net_bind(const char *host, const char *port)
+int pdu_unpack(struct pdu *pdu)
 {
-	int fd, rc;
-	struct addrinfo hints, *res, *head;
+	return _pdu_unpack(pdu, 1);
+}
+
+/* for PDUs from local (Unix socket) peers, where the kernel has
+   already guaranteed us the bytes that were sent */
+int pdu_unpack_trusted(struct pdu *pdu)
+{
+	return _pdu_unpack(pdu, 0);
+}
+
+/* Splits "host:port", "[v6addr]:port", "host", "[v6addr]" or a bare
+   v6addr (in place) into its host and port parts; *port is left alone
+   if there isn't one. */
+static void net_split(char *spec, char **host, char **port)
+{
+	char *p;
+
+	if (*spec == '[' && (p = strchr(spec, ']')) != NULL) {
+		*host = spec + 1;
+		*p++ = '\0';
+		if (*p == ':') *port = p + 1;
+		return;
+	}
+
+	*host = spec;
+	if ((p = strchr(spec, ':')) != NULL && p == strrchr(spec, ':')) {
+		*p++ = '\0';
+		*port = p;
+	}
+}
+
+/* Formats a peer address for logging and the client table; v4-mapped
+   IPv6 addresses (from dual-stack sockets) come out as plain IPv4. */
+const char* net_ntop(const struct sockaddr *sa, char *buf, size_t len)
+{
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6*)sa;
+
+	if (!sa) {
+		snprintf(buf, len, "<unknown-peer>");
+
+	} else if (sa->sa_family == AF_INET) {
+		inet_ntop(AF_INET, &((const struct sockaddr_in*)sa)->sin_addr, buf, len);
+
+	} else if (sa->sa_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+		inet_ntop(AF_INET, &sin6->sin6_addr.s6_addr[12], buf, len);
+
+	} else if (sa->sa_family == AF_INET6) {
+		inet_ntop(AF_INET6, &sin6->sin6_addr, buf, len);
+
+	} else if (sa->sa_family == AF_UNIX) {
+		snprintf(buf, len, "<local>");
+
+	} else {
+		snprintf(buf, len, "<unknown-peer>");
+	}
+	return buf;
+}
+
+static int net_socket(const struct addrinfo *ai, int v6only)
+{
+	int fd, on = 1;
+
+	fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (fd < 0) {
+		syslog(LOG_ERROR, "socket() call failed: %s", strerror(errno));
+		return -1;
+	}
+
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
+		syslog(LOG_ERROR, "failed to set SO_REUSEADDR on socket: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if (ai->ai_family == AF_INET6
+	 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) < 0) {
+		syslog(LOG_ERROR, "failed to set IPV6_V6ONLY on socket: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if (bind(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	if (nonblocking(fd) != 0) {
+		syslog(LOG_ERROR, "failed to set socket non-blocking: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if (close_on_exec(fd) != 0) {
+		syslog(LOG_ERROR, "failed to set socket close-on-exec: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static struct addrinfo* net_resolve(const char *host, const char *port, int family, int type)
+{
+	struct addrinfo hints, *res;
+	int rc;
 
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_flags    = AI_PASSIVE;
-	hints.ai_family   = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_family   = family;
+	hints.ai_socktype = type;
 
 	rc = getaddrinfo(host, port, &hints, &res);
 	if (rc != 0) {
 		syslog(LOG_ERROR, "getaddrinfo failed: %s", gai_strerror(rc));
+		return NULL;
+	}
+	return res;
+}
+
+/* Every TCP listener we have expects the peer to speak first, so
+   TCP_DEFER_ACCEPT keeps us from waking up until it has. */
+static int net_listen(int fd)
+{
+	int defer = IRIS_DEFER_ACCEPT;
+
+	if (listen(fd, LISTEN_BACKLOG) < 0) {
+		syslog(LOG_ERROR, "listen() call failed: %s", strerror(errno));
+		return -1;
+	}
+	if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer)) < 0)
+		syslog(LOG_WARN, "failed to set TCP_DEFER_ACCEPT on socket: %s", strerror(errno));
+
+	iris_call_register_fd(fd);
+	return 0;
+}
+
+/* Binds the first address that host:port resolves to.  With no host,
+   that's the IPv6 wildcard, dual-stack (so IPv4 peers show up as
+   v4-mapped addresses), unless the kernel has no IPv6 at all. */
+static int net_bind_one(const char *host, const char *port, int type)
+{
+	struct addrinfo *res, *ai;
+	int fd = -1;
+
+	if (!host) {
+		int probe = socket(AF_INET6, type, 0);
+		if (probe >= 0) close(probe);
+		if (!(res = net_resolve(NULL, port, probe >= 0 ? AF_INET6 : AF_INET, type)))
+			return -1;
+	} else {
+		if (!(res = net_resolve(host, port, AF_UNSPEC, type)))
+			return -1;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		if ((fd = net_socket(ai, host != NULL)) >= 0)
+			break; // bound; stop trying addrinfo results!
+	}
+
+	freeaddrinfo(res);
+	return fd;
+}
+
+/* Binds every address that a `listen` spec (see net_split) resolves
+   to, each on its own socket; a host of "*" means every wildcard. */
+int net_bind_all(const char *spec, const char *port, int *fds, int max)
+{
+	struct addrinfo *res, *ai;
+	char *copy, *host, *p = NULL;
+	char addr[INET6_ADDRSTRLEN];
+	int fd, n = 0;
+
+	if (!(copy = strdup(spec)))
+		return -1;
+	net_split(copy, &host, &p);
+	if (p) port = p;
+	if (strcmp(host, "*") == 0 || !*host)
+		host = NULL;
+
+	if (!(res = net_resolve(host, port, AF_UNSPEC, SOCK_STREAM))) {
+		free(copy);
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (ai = res; ai && n < max; ai = ai->ai_next) {
+		if ((fd = net_socket(ai, 1)) < 0) {
+			syslog(LOG_ERROR, "failed to bind to [%s]:%s: %s",
+					net_ntop(ai->ai_addr, addr, sizeof(addr)), port, strerror(errno));
+			continue;
+		}
+		if (net_listen(fd) != 0) {
+			close(fd);
+			continue;
+		}
+		fds[n++] = fd;
+	}
+
+	freeaddrinfo(res);
+	free(copy);
+	return n;
+}
+
+int net_bind(const char *host, const char *port)
+{
+	int fd;
+
+	if ((fd = net_bind_one(host, port, SOCK_STREAM)) < 0)
+		return -1;
+
+	if (net_listen(fd) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int net_bind_udp(const char *host, const char *port)
+{
+	int fd, on = 1, size = IRIS_UDP_RCVBUF;
+
+	if ((fd = net_bind_one(host, port, SOCK_DGRAM)) < 0)
+		return -1;
+
+	/* the kernel silently caps this at net.core.rmem_max */
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0)
+		syslog(LOG_WARN, "failed to set SO_RCVBUF on UDP socket: %s", strerror(errno));
+
+	/* have the kernel tell us how many datagrams it had to drop */
+	if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0)
+		syslog(LOG_WARN, "failed to set SO_RXQ_OVFL on UDP socket: %s", strerror(errno));
+
+	iris_call_register_fd(fd);
+	return fd;
+}
+
+/* Binds and listens on a unix socket at path.  A non-zero mode caps
+   the socket's permissions (via the umask, so it never exists with
+   anything looser); 0 leaves them to the umask we were started with. */
+int net_bind_unix(const char *path, mode_t mode)
+{
+	struct sockaddr_un addr;
+	mode_t mask = 0;
+	int fd, rc;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (!path || strlen(path) >= sizeof(addr.sun_path)) {
+		syslog(LOG_ERROR, "unix socket path '%s' is too long", path ? path : "(null)");
+		errno = EINVAL;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		syslog(LOG_ERROR, "socket() call failed: %s", strerror(errno));
+		return -1;
+	}
+
+	unlink(path); /* left over from the last run */
+	if (mode)
+		mask = umask(~mode & 0777);
+	rc = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+	if (mode)
+		umask(mask);
+	if (rc != 0) {
+		syslog(LOG_ERROR, "failed to bind to %s: %s", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if (nonblocking(fd) != 0) {
+		syslog(LOG_ERROR, "failed to set socket non-blocking: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if (close_on_exec(fd) != 0) {
+		syslog(LOG_ERROR, "failed to set socket close-on-exec: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if (listen(fd, LISTEN_BACKLOG) < 0) {
+		syslog(LOG_ERROR, "listen() call failed: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	iris_call_register_fd(fd);
+	return fd;
+}
+
+int net_poller(int sockfd)
+{
+	int epfd;
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+
+	if ((epfd = epoll_create(42)) < 0) return -1;
+
+	ev.data.fd = sockfd;
+	ev.events = EPOLLIN | EPOLLET;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev) != 0) return -1;
+
+	if ((CONTROL_FD = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0) return -1;
+	ev.data.fd = CONTROL_FD;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, CONTROL_FD, &ev) != 0) return -1;
+
+	/* so that the main listener can be found on the ready list, too */
+	if (NUM_LISTENERS < IRIS_MAX_LISTENERS) {
+		memset(&LISTENERS[NUM_LISTENERS], 0, sizeof(LISTENERS[0]));
+		LISTENERS[NUM_LISTENERS].fd    = sockfd;
+		LISTENERS[NUM_LISTENERS].proto = IRIS_PROTO_PDU;
+		NUM_LISTENERS++;
+	}
+	return epfd;
+}
+
+static int listener_find(int fd)
+{
+	int i;
+	for (i = 0; i < NUM_LISTENERS; i++) {
+		if (LISTENERS[i].fd == fd)
+			return i;
+	}
+	return -1;
+}
+
+/* TLS (make TLS=1) is only offered on tls_port, for plain PDUs.  The
+   handshake is driven from recv_data as the client's bytes arrive;
+   once it's done, and if the kernel (and OpenSSL) can take over
+   record decryption, the connection goes back to plain read()s. */
+#ifdef HAVE_TLS
+static SSL_CTX *TLS_CTX = NULL;
+
+#define tls_established(c) SSL_is_init_finished((SSL*)(c)->tls)
+
+static const char* tls_error(void)
+{
+	unsigned long e = ERR_get_error();
+	return e ? ERR_reason_error_string(e) : strerror(errno);
+}
+
+int tls_init(const struct server *s)
+{
+	if (TLS_CTX)
+		return 0;
+	if (!s->tls_cert || !s->tls_key) {
+		syslog(LOG_ERROR, "tls_port needs both tls_cert and tls_key");
+		return -1;
+	}
+
+	if (!(TLS_CTX = SSL_CTX_new(TLS_server_method()))) {
+		syslog(LOG_ERROR, "failed to set up TLS: %s", tls_error());
+		return -1;
+	}
+	SSL_CTX_set_min_proto_version(TLS_CTX, TLS1_2_VERSION);
+	if (SSL_CTX_use_certificate_chain_file(TLS_CTX, s->tls_cert) != 1
+	 || SSL_CTX_use_PrivateKey_file(TLS_CTX, s->tls_key, SSL_FILETYPE_PEM) != 1
+	 || SSL_CTX_check_private_key(TLS_CTX) != 1) {
+		syslog(LOG_ERROR, "failed to load TLS certificate %s / key %s: %s",
+				s->tls_cert, s->tls_key, tls_error());
+		SSL_CTX_free(TLS_CTX);
+		TLS_CTX = NULL;
+		return -1;
+	}
+
+	/* agents reconnect all the time; let them resume (tickets for
+	   TLS 1.3, and 1.2 clients that ask), and only issue one ticket */
+	SSL_CTX_set_session_cache_mode(TLS_CTX, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_set_session_id_context(TLS_CTX, (const unsigned char*)"iris", 4);
+	SSL_CTX_set_num_tickets(TLS_CTX, 1);
+	SSL_CTX_set_mode(TLS_CTX, SSL_MODE_RELEASE_BUFFERS);
+
+	/* plenty of senders just close() when they're done; that's EOF,
+	   not an error worth logging */
+	SSL_CTX_set_options(TLS_CTX, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#ifdef SSL_OP_ENABLE_KTLS
+	SSL_CTX_set_options(TLS_CTX, SSL_OP_ENABLE_KTLS);
+#endif
+	return 0;
+}
+
+static int tls_accept(struct client *c)
+{
+	SSL *ssl;
+	int one = 1;
+
+	if (!TLS_CTX || !(ssl = SSL_new(TLS_CTX))) {
+		syslog(LOG_ERROR, "failed to start TLS for %s: %s", c->addr, tls_error());
+		return -1;
+	}
+	SSL_set_fd(ssl, c->fd);
+	SSL_set_accept_state(ssl);
+	c->tls = ssl;
+
+	/* handshake flights go out as several small writes; don't let
+	   Nagle hold the later ones back for the client's delayed ACK */
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return 0;
+}
+
+/* returns 0 once the handshake is done, -1 if it isn't (yet) */
+static int tls_handshake(struct client *c)
+{
+	SSL *ssl = c->tls;
+	int rc;
+
+	if ((rc = SSL_do_handshake(ssl)) == 1) {
+		CLIENT_STATS.handshakes++;
+		if (SSL_session_reused(ssl))
+			CLIENT_STATS.resumed++;
+		if (BIO_get_ktls_recv(SSL_get_rbio(ssl))) {
+			c->flags |= IRIS_CLIENT_KTLS;
+			CLIENT_STATS.ktls++;
+		}
+		ctrace(c, IRIS_TRACE_TLS, "TLS handshake with %s, fd %d done (%s%s)", c->addr, c->fd,
+				SSL_session_reused(ssl) ? "resumed" : "full",
+				c->flags & IRIS_CLIENT_KTLS ? ", kTLS" : "");
+		return 0;
+	}
+
+	switch (SSL_get_error(ssl, rc)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		return -1;
+	}
+	syslog(LOG_INFO, "TLS handshake with %s failed: %s", c->addr, tls_error());
+	CLIENT_STATS.tls_failed++;
+	client_close(c->fd);
+	return -1;
+}
+
+/* like pdu_read, for clients that OpenSSL is decrypting */
+static ssize_t tls_read(struct client *c, uint8_t *buf, size_t start)
+{
+	int n = 0, len = sizeof(struct pdu) - start, offset = 0;
+
+	while (len > 0 && (n = SSL_read(c->tls, buf+start+offset, len)) > 0) {
+		offset += n; len -= n;
+	}
+	if (len == 0)
+		return offset;
+
+	switch (SSL_get_error(c->tls, n)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		errno = EAGAIN;
+		return offset;
+	case SSL_ERROR_ZERO_RETURN:
+		errno = 0;
+		return offset;
+	}
+	if (offset == 0) {
+		syslog(LOG_INFO, "TLS error from %s: %s", c->addr, tls_error());
+		errno = ECONNRESET;
 		return -1;
 	}
+	return offset;
+}
+
+static void tls_close(struct client *c)
+{
+	if (tls_established(c))
+		SSL_shutdown(c->tls);
+	SSL_free(c->tls);
+	c->tls = NULL;
+}
+
+#else
+int tls_init(const struct server *s)
+{
+	syslog(LOG_ERROR, "tls_port is set, but iris was built without TLS support (make TLS=1)");
+	errno = ENOTSUP;
+	return -1;
+}
+
+#define tls_established(c) (1)
+#define tls_accept(c)      (-1)
+#define tls_handshake(c)   (0)
+#define tls_read(c,b,s)    (-1)
+#define tls_close(c)
+#endif
+
+/* reads (the rest of) a PDU, whichever way the client needs reading */
+/* notes that c isn't idle, for client_evict (the coarse clock will do) */
+static inline void client_heard(struct client *c)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	c->last = now.tv_sec;
+}
+
+static ssize_t client_read(struct client *c)
+{
+	ssize_t len;
+
+	if (c->tls && !(c->flags & IRIS_CLIENT_KTLS))
+		return tls_read(c, (uint8_t*)c->pdu, c->offset);
+
+	len = pdu_read(c->fd, (uint8_t*)c->pdu, c->offset);
+	if (len < 0 && errno == EIO && (c->flags & IRIS_CLIENT_KTLS)) {
+		/* kTLS won't hand control records (close_notify, ...) to read() */
+		ctrace(c, IRIS_TRACE_TLS, "non-data TLS record from %s, fd %d; treating it as EOF", c->addr, c->fd);
+		errno = 0;
+		return 0;
+	}
+	return len;
+}
+
+/* Registers a freshly accepted connection with epoll and gives it a
+   client slot (which the caller has made sure there is) */
+static int client_admit(int connfd, int sockfd, const struct sockaddr_storage *peer, int epfd)
+{
+	struct epoll_event ev = {0};
+	struct client *client;
+	struct source *src;
+	int i;
+
+	ev.data.fd = connfd;
+	ev.events = EPOLLIN | EPOLLET;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev) != 0) {
+		syslog(LOG_ERROR, "failed to inform epoll about new socket fd: %s", strerror(errno));
+		trace(IRIS_TRACE_CLIENT, "closing fd %d", connfd);
+		close(connfd);
+		return -1;
+	}
+
+	client = client_new(connfd, (const struct sockaddr*)peer);
+	if (!client) { /* can't happen; but don't leave it registered */
+		close(connfd);
+		return -1;
+	}
+	for (i = 0; i < NUM_LISTENERS; i++) {
+		if (LISTENERS[i].fd != sockfd) continue;
+		client->proto  = LISTENERS[i].proto;
+		client->flags |= LISTENERS[i].flags;
+	}
+	if (client->proto != IRIS_PROTO_ADMIN && (src = client_source(client)) != NULL) {
+		src->connections++;
+		src->last = time(NULL);
+	}
+	if ((client->flags & IRIS_CLIENT_TLS) && tls_accept(client) != 0) {
+		client_close(connfd);
+		return -1;
+	}
+	ctrace(client, IRIS_TRACE_NET, "accepted inbound connection from %s, fd %d", client->addr, connfd);
+	IRIS_PROBE2(accept, sockfd, connfd);
+	return connfd;
+}
+
+static int overflow_push(int connfd, int sockfd, const struct sockaddr_storage *peer)
+{
+	struct overflow *o;
+	struct timespec now;
+
+	if (!OVERFLOW || CLIENT_STATS.waiting >= OVERFLOW_MAX)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	o = &OVERFLOW[(OVERFLOW_HEAD + CLIENT_STATS.waiting++) % OVERFLOW_MAX];
+	o->fd       = connfd;
+	o->listener = sockfd;
+	o->since    = now.tv_sec;
+	memcpy(&o->peer, peer, sizeof(o->peer));
+	return 0;
+}
+
+static struct overflow* overflow_shift(void)
+{
+	struct overflow *o;
+
+	if (CLIENT_STATS.waiting == 0)
+		return NULL;
+	o = &OVERFLOW[OVERFLOW_HEAD];
+	OVERFLOW_HEAD = (OVERFLOW_HEAD + 1) % OVERFLOW_MAX;
+	CLIENT_STATS.waiting--;
+	return o;
+}
+
+/* Closes the client that has gone longest without sending anything
+   (and isn't in the middle of a PDU), to make room for a new one.
+   Admin clients, and anyone still owed an answer, are left alone. */
+static int client_evict(void)
+{
+	struct client *victim = NULL, *c;
+	int i;
+
+	for (i = 0; i < CLIENTS_ALLOCATED; i++) {
+		c = client_at(i);
+		if (c->fd < 0 || c->offset != 0 || c->out || c->proto == IRIS_PROTO_ADMIN)
+			continue;
+		if (!victim || c->last < victim->last)
+			victim = c;
+	}
+	if (!victim)
+		return -1;
+
+	ctrace(victim, IRIS_TRACE_CLIENT, "evicting client %d // %s to make room", victim->fd, victim->addr);
+	CLIENT_STATS.evicted++;
+	client_close(victim->fd);
+	return 0;
+}
+
+/* client_admit(), for net_accept(): a failure there must never look
+   like EAGAIN, or the caller would think the backlog was empty */
+static int net_admit(int connfd, int sockfd, const struct sockaddr_storage *peer, int epfd)
+{
+	int fd = client_admit(connfd, sockfd, peer, epfd);
+	if (fd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		errno = ECONNABORTED;
+	return fd;
+}
+
+/* Accepts the next connection off of sockfd, and returns it (or -1).
+   errno is EAGAIN once nothing else is waiting; anything else means
+   that one connection didn't make it, and there may be more behind
+   it. */
+int net_accept(int sockfd, int epfd)
+{
+	static time_t last_purge = 0, last_stats = 0;
+	struct sockaddr_storage in_addr;
+	socklen_t in_len;
+	struct timespec now;
+	int connfd, err;
+
+	/* a full sweep of the client table per connection adds up, when
+	   most connections are one PDU long; once a second is plenty */
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec != last_purge) {
+		clients_purge();
+		last_purge = now.tv_sec;
+	}
+	if (now.tv_sec - last_stats >= IRIS_STATS_INTERVAL) {
+		if (last_stats)
+			clients_stats();
+		last_stats = now.tv_sec;
+	}
+	OVERFLOW_EPFD = epfd;
+
+	for (;;) {
+		trace(IRIS_TRACE_NET, "accepting inbound connection");
+		in_len = sizeof(in_addr);
+		if ((connfd = accept4(sockfd, (struct sockaddr*)&in_addr, &in_len,
+				SOCK_NONBLOCK|SOCK_CLOEXEC)) < 0) {
+			// EAGAIN / EWOULDBLOCK == no more pending connections
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				trace(IRIS_TRACE_NET, "accept bailed with an EAGAIN, done accepting inbound connections");
+				errno = EAGAIN;
+				return -1;
+			}
+
+			err = errno;
+			syslog(LOG_WARN, "accept failed: %s", strerror(err));
+			errno = err;
+			return -1;
+		}
+		CLIENT_STATS.accepted++;
+
+		if (CLIENT_STATS.active < NUM_CLIENTS)
+			return net_admit(connfd, sockfd, &in_addr, epfd);
+
+		/* every slot is taken */
+		if (OVERFLOW_POLICY == IRIS_OVERFLOW_QUEUE
+		 && overflow_push(connfd, sockfd, &in_addr) == 0) {
+			CLIENT_STATS.queued++;
+			continue;
+		}
+		if (OVERFLOW_POLICY == IRIS_OVERFLOW_EVICT && client_evict() == 0)
+			return net_admit(connfd, sockfd, &in_addr, epfd);
+
+		CLIENT_STATS.rejected++;
+		if ((CLIENT_STATS.rejected & (CLIENT_STATS.rejected - 1)) == 0) /* 1, 2, 4 ... */
+			syslog(LOG_WARN, "all %u client slots are in use; %lu connections rejected so far"
+					" (see max_clients / overflow_policy)", NUM_CLIENTS, CLIENT_STATS.rejected);
+		close(connfd);
+	}
+}
+
+int net_listener(int epfd, int fd, int proto, int flags)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+
+	if (NUM_LISTENERS >= IRIS_MAX_LISTENERS) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	ev.data.fd = fd;
+	ev.events = EPOLLIN | EPOLLET;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) return -1;
+
+	LISTENERS[NUM_LISTENERS].fd    = fd;
+	LISTENERS[NUM_LISTENERS].proto = proto;
+	LISTENERS[NUM_LISTENERS].flags = flags;
+	LISTENERS[NUM_LISTENERS].queued = 0;
+	LISTENERS[NUM_LISTENERS].ring  = NULL;
+	NUM_LISTENERS++;
+	return 0;
+}
+
+/* a shared-memory ring sits in the epoll set by way of its
+   wakeup FIFO, and mainloop drains the ring when that fires */
+int net_shmring(int epfd, struct shmring *r)
+{
+	if (net_listener(epfd, r->wakefd, IRIS_PROTO_SHM, 0) != 0)
+		return -1;
+	LISTENERS[NUM_LISTENERS-1].ring = r;
+	return 0;
+}
+
+/* The config file being watched for changes (see config_watch), and
+   the settings last read from it */
+struct {
+	char          *file;
+	const char    *name;  /* within file */
+	struct server *current;
+	void         (*apply)(const struct server *s);
+} WATCH = { NULL, NULL, NULL, NULL };
+
+static void config_unwatch(void)
+{
+	server_free(WATCH.current);
+	free(WATCH.current);
+	free(WATCH.file);
+	memset(&WATCH, 0, sizeof(WATCH));
+}
+
+/* closes every listener; when draining, whatever is already sitting
+   in a ring or a UDP socket gets read first */
+static void listeners_close(int drain)
+{
+	int i;
+
+	for (i = 0; i < NUM_LISTENERS; i++) {
+		switch (LISTENERS[i].proto) {
+		case IRIS_PROTO_SHM:
+			if (drain)
+				shmring_consume(LISTENERS[i].ring);
+			shmring_close(LISTENERS[i].ring);
+			break;
+
+		case IRIS_PROTO_UDP:
+			if (drain)
+				recv_datagrams(LISTENERS[i].fd);
+			/* fall through */
+		case IRIS_PROTO_CONF:
+		default:
+			close(LISTENERS[i].fd);
+			break;
+		}
+	}
+	NUM_LISTENERS = 0;
+	config_unwatch();
+}
+
+/* undoes net_poller / net_listeners (and net_bind_server) */
+void net_close(int epfd)
+{
+	int i;
+
+	listeners_close(0);
+	for (i = 0; i < NUM_PENDING; i++)
+		close(PENDING[i]);
+	NUM_PENDING = 0;
+
+	if (CONTROL_FD >= 0)
+		close(CONTROL_FD);
+	CONTROL_FD = -1;
+	STOP = 0;
+	if (epfd >= 0)
+		close(epfd);
+#ifdef HAVE_TLS
+	SSL_CTX_free(TLS_CTX);
+	TLS_CTX = NULL;
+#endif
+}
+
+static int differs(const char *a, const char *b)
+{
+	return (a || b) && (!a || !b || strcmp(a, b) != 0);
+}
+
+/* whatever can't be changed without rebinding, or restarting a sink */
+static void config_needs_restart(const struct server *was, const struct server *now)
+{
+	int i, listen = was->num_listen != now->num_listen;
+
+	for (i = 0; !listen && i < now->num_listen; i++)
+		listen = differs(was->listen[i], now->listen[i]);
+
+#define restart_if(changed, what) \
+	if (changed) syslog(LOG_WARN, "%s changed; that takes a restart", what)
+	restart_if(listen, "listen");
+	restart_if(differs(was->port, now->port), "port");
+	restart_if(differs(was->cmd_port, now->cmd_port), "cmd_port");
+	restart_if(differs(was->listen_unix, now->listen_unix), "listen_unix");
+	restart_if(differs(was->cmd_unix, now->cmd_unix), "cmd_unix");
+	restart_if(differs(was->admin_unix, now->admin_unix), "admin_unix");
+	restart_if(was->unix_skip_crc != now->unix_skip_crc, "unix_skip_crc");
+	restart_if(differs(was->udp_port, now->udp_port), "udp_port");
+	restart_if(differs(was->ack_port, now->ack_port), "ack_port");
+	restart_if(differs(was->tls_port, now->tls_port)
+	        || differs(was->tls_cert, now->tls_cert)
+	        || differs(was->tls_key, now->tls_key), "tls_port/cert/key");
+	restart_if(differs(was->listen_shm, now->listen_shm)
+	        || was->shm_slots != now->shm_slots, "listen_shm/shm_slots");
+	restart_if(differs(was->sink, now->sink)
+	        || differs(was->sink_path, now->sink_path)
+	        || was->sink_queue != now->sink_queue
+	        || was->sink_batch != now->sink_batch
+	        || was->sink_flush != now->sink_flush, "sink");
+	restart_if(differs(was->upstream, now->upstream)
+	        || was->upstream_lifetime != now->upstream_lifetime
+	        || differs(was->spool_dir, now->spool_dir), "upstream");
+#undef restart_if
+}
+
+/* Re-reads the watched config file and, if it checks out (the same way
+   `iriscfg -t` checks it), hands the new settings to apply(); if not,
+   nothing changes.  Runs on the reactor thread. */
+int config_reload(void)
+{
+	struct server *s;
+
+	if (!WATCH.file) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (!(s = calloc(1, sizeof(struct server))) || server_init(s) != 0) {
+		free(s);
+		return -1;
+	}
+	if (parse_config_file(WATCH.file, s) != 0 || server_check(s) != 0) {
+		syslog(LOG_ERROR, "%s has errors (see iriscfg -t %s); keeping the running configuration",
+				WATCH.file, WATCH.file);
+		server_free(s);
+		free(s);
+		return -1;
+	}
+
+	if (WATCH.current)
+		config_needs_restart(WATCH.current, s);
+	if (WATCH.apply)
+		WATCH.apply(s);
+	else
+		server_apply(s);
+
+	/* only now, in case apply() reopened syslog with our new ident */
+	server_free(WATCH.current);
+	free(WATCH.current);
+	WATCH.current = s;
+
+	syslog(LOG_PROC, "reloaded %s (max_clients %u, max_lifetime %lis, overflow_queue %u)",
+			WATCH.file, NUM_CLIENTS, (long)MAX_LIFETIME, OVERFLOW_MAX);
+	return 0;
+}
+
+/* Watches file for changes (written in place, or renamed over) via
+   inotify on its directory, and reloads it when it does.  apply() gets
+   the new settings; it should call server_apply(), and pick up
+   anything else of its own. */
+int config_watch(int epfd, const char *file, void (*apply)(const struct server *s))
+{
+	char dir[PATH_MAX];
+	char *slash;
+	int fd;
+
+	config_unwatch();
+	if (!(WATCH.file = strdup(file)))
+		return -1;
+	WATCH.apply = apply;
+	slash = strrchr(WATCH.file, '/');
+	WATCH.name = slash ? slash + 1 : WATCH.file;
+
+	if (!slash)
+		strcpy(dir, ".");
+	else
+		snprintf(dir, sizeof(dir), "%.*s", slash == WATCH.file ? 1 : (int)(slash - WATCH.file), WATCH.file);
+
+	/* what's running now is what we compare the next version to */
+	if ((WATCH.current = calloc(1, sizeof(struct server))) != NULL) {
+		server_init(WATCH.current);
+		if (parse_config_file(file, WATCH.current) != 0) {
+			server_free(WATCH.current);
+			server_init(WATCH.current);
+		}
+	}
+
+	if ((fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) < 0)
+		return -1;
+	if (inotify_add_watch(fd, dir, IN_CLOSE_WRITE|IN_MOVED_TO) < 0
+	 || net_listener(epfd, fd, IRIS_PROTO_CONF, 0) != 0) {
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+/* was it our file that changed? */
+static void config_changed(int fd)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+	int ours = 0;
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event*)p;
+			if (ev->len && WATCH.name && strcmp(ev->name, WATCH.name) == 0)
+				ours = 1;
+		}
+	}
+	if (ours)
+		config_reload();
+}
+
+/* Binds the PDU listener(s): every `listen` address, if there are
+   any, or else the dual-stack wildcard on `port`.  Returns the first
+   (for net_poller / mainloop); net_listeners picks up the rest. */
+int net_bind_server(const struct server *s)
+{
+	int fds[IRIS_MAX_LISTENERS], i, n, total = 0;
+
+	if (s->num_listen == 0) {
+		syslog(LOG_PROC, "binding on *:%s", s->port);
+		return net_bind(NULL, s->port);
+	}
+
+	for (i = 0; i < s->num_listen; i++) {
+		syslog(LOG_PROC, "binding on %s", s->listen[i]);
+		if ((n = net_bind_all(s->listen[i], s->port, fds + total,
+				IRIS_MAX_LISTENERS - total)) <= 0) {
+			syslog(LOG_ERROR, "Failed to bind to %s", s->listen[i]);
+			while (total > 0) close(fds[--total]);
+			return -1;
+		}
+		total += n;
+	}
+
+	NUM_PENDING = 0;
+	for (i = 1; i < total; i++)
+		PENDING[NUM_PENDING++] = fds[i];
+	return fds[0];
+}
+
+/* binds and registers the listeners that sit alongside the main
+   PDU port (the one handed to mainloop), per the configuration */
+int net_listeners(const struct server *s, int epfd)
+{
+	int fd, n = 0, i;
+
+	for (i = 0; i < NUM_PENDING; i++) {
+		if (net_listener(epfd, PENDING[i], IRIS_PROTO_PDU, 0) != 0) {
+			syslog(LOG_ERROR, "Failed to register listener fd %d: %s",
+					PENDING[i], strerror(errno));
+			return -1;
+		}
+		n++;
+	}
+	NUM_PENDING = 0;
+
+	if (s->cmd_port) {
+		syslog(LOG_PROC, "binding external command listener on *:%s", s->cmd_port);
+		if ((fd = net_bind(NULL, s->cmd_port)) < 0
+		 || net_listener(epfd, fd, IRIS_PROTO_CMD, 0) != 0) {
+			syslog(LOG_ERROR, "Failed to listen for external commands on *:%s: %s",
+					s->cmd_port, strerror(errno));
+			return -1;
+		}
+		n++;
+	}
+
+	if (s->ack_port) {
+		syslog(LOG_PROC, "binding acknowledging result listener on *:%s", s->ack_port);
+		if ((fd = net_bind(NULL, s->ack_port)) < 0
+		 || net_listener(epfd, fd, IRIS_PROTO_PDU, IRIS_CLIENT_ACK) != 0) {
+			syslog(LOG_ERROR, "Failed to listen for acknowledged results on *:%s: %s",
+					s->ack_port, strerror(errno));
+			return -1;
+		}
+		n++;
+	}
+
+	if (s->tls_port) {
+		syslog(LOG_PROC, "binding TLS result listener on *:%s", s->tls_port);
+		if (tls_init(s) != 0)
+			return -1;
+		if ((fd = net_bind(NULL, s->tls_port)) < 0
+		 || net_listener(epfd, fd, IRIS_PROTO_PDU, IRIS_CLIENT_TLS) != 0) {
+			syslog(LOG_ERROR, "Failed to listen for TLS on *:%s: %s",
+					s->tls_port, strerror(errno));
+			return -1;
+		}
+		n++;
+	}
+
+	if (s->udp_port) {
+		syslog(LOG_PROC, "binding on udp *:%s", s->udp_port);
+		if ((fd = net_bind_udp(NULL, s->udp_port)) < 0
+		 || net_listener(epfd, fd, IRIS_PROTO_UDP, 0) != 0) {
+			syslog(LOG_ERROR, "Failed to listen on udp *:%s: %s",
+					s->udp_port, strerror(errno));
+			return -1;
+		}
+		n++;
+	}
+
+	if (s->listen_unix) {
+		syslog(LOG_PROC, "binding on unix:%s%s", s->listen_unix,
+				s->unix_skip_crc ? " (skipping CRC checks)" : "");
+		if ((fd = net_bind_unix(s->listen_unix, 0)) < 0
+		 || net_listener(epfd, fd, IRIS_PROTO_PDU,
+				s->unix_skip_crc ? IRIS_CLIENT_TRUSTED : 0) != 0) {
+			syslog(LOG_ERROR, "Failed to listen on unix:%s: %s",
+					s->listen_unix, strerror(errno));
+			return -1;
+		}
+		n++;
+	}
+
+	if (s->cmd_unix) {
+		syslog(LOG_PROC, "binding external command listener on unix:%s", s->cmd_unix);
+		if ((fd = net_bind_unix(s->cmd_unix, 0)) < 0
+		 || net_listener(epfd, fd, IRIS_PROTO_CMD, 0) != 0) {
+			syslog(LOG_ERROR, "Failed to listen for external commands on unix:%s: %s",
+					s->cmd_unix, strerror(errno));
+			return -1;
+		}
+		n++;
+	}
+
+	if (s->admin_unix) {
+		syslog(LOG_PROC, "binding admin listener on unix:%s", s->admin_unix);
+		if ((fd = net_bind_unix(s->admin_unix, 0600)) < 0 /* it can kick clients, after all */
+		 || net_listener(epfd, fd, IRIS_PROTO_ADMIN, 0) != 0) {
+			syslog(LOG_ERROR, "Failed to listen for admin commands on unix:%s: %s",
+					s->admin_unix, strerror(errno));
+			return -1;
+		}
+		n++;
+	}
+
+	if (s->listen_shm) {
+		struct shmring *r;
+		syslog(LOG_PROC, "creating a %u-slot shared-memory ring at %s",
+				s->shm_slots, s->listen_shm);
+		if (!(r = shmring_create(s->listen_shm, s->shm_slots))
+		 || net_shmring(epfd, r) != 0) {
+			syslog(LOG_ERROR, "Failed to set up shared-memory ring %s: %s",
+					s->listen_shm, strerror(errno));
+			return -1;
+		}
+		n++;
+	}
+
+	return n;
+}
+
+static int net_connect_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
+
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+/* connect(), but giving up after timeout ms (if it's > 0) */
+static int connect_timeout(int fd, const struct sockaddr *addr, socklen_t len, int timeout)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+	socklen_t errlen = sizeof(int);
+	int flags, err = 0, rc;
+
+	if (timeout <= 0)
+		return connect(fd, addr, len);
+
+	if ((flags = fcntl(fd, F_GETFL)) < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return -1;
+	if ((rc = connect(fd, addr, len)) != 0 && errno == EINPROGRESS) {
+		while ((rc = poll(&pfd, 1, timeout)) < 0 && errno == EINTR)
+			;
+		if (rc == 0)
+			err = ETIMEDOUT;
+		else if (rc < 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+			err = errno;
+		rc = err ? -1 : 0;
+	} else if (rc != 0) {
+		err = errno;
+	}
+
+	fcntl(fd, F_SETFL, flags);
+	errno = err;
+	return rc;
+}
+
+static int _net_connect(const char *host, unsigned short port, int type, int timeout)
+{
+	struct addrinfo hints, *res, *ai;
+	char service[8], *copy, *h;
+	int fd = -1, err = 0, rc;
+
+	/* send_iris -H [::1] */
+	if (!(copy = strdup(host))) return -1;
+	h = copy;
+	if (*h == '[' && h[strlen(h)-1] == ']') {
+		h[strlen(h)-1] = '\0';
+		h++;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = type;
+	snprintf(service, sizeof(service), "%u", port);
+
+	rc = getaddrinfo(h, service, &hints, &res);
+	free(copy);
+	if (rc != 0) {
+		errno = rc == EAI_SYSTEM ? errno : EHOSTUNREACH;
+		return -1;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0) {
+			err = errno;
+			continue;
+		}
+		if (connect_timeout(fd, ai->ai_addr, ai->ai_addrlen, timeout) == 0)
+			break;
+
+		err = errno;
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+	if (fd < 0) errno = err;
+	return fd;
+}
+
+int net_connect(const char *host, unsigned short port)
+{
+	if (strncmp(host, IRIS_UNIX_PREFIX, strlen(IRIS_UNIX_PREFIX)) == 0)
+		return net_connect_unix(host + strlen(IRIS_UNIX_PREFIX));
+	return _net_connect(host, port, SOCK_STREAM, 0);
+}
+
+/* net_connect, but giving each address timeout seconds to answer
+   (unix sockets answer, or don't, straight away) */
+int net_connect_timeout(const char *host, unsigned short port, int timeout)
+{
+	if (strncmp(host, IRIS_UNIX_PREFIX, strlen(IRIS_UNIX_PREFIX)) == 0)
+		return net_connect_unix(host + strlen(IRIS_UNIX_PREFIX));
+	return _net_connect(host, port, SOCK_STREAM, timeout * 1000);
+}
+
+/* a connected UDP socket; send() at will, and any ICMP unreachables
+   come back as ECONNREFUSED on the next one */
+int net_connect_udp(const char *host, unsigned short port)
+{
+	return _net_connect(host, port, SOCK_DGRAM, 0);
+}
+
+int fd_sink(int fd)
+{
+	char buf[512];
+	size_t n = 0;
+	while ((n = read(fd, buf, 512)) > 0)
+		;
+	return n;
+}
+
+#define IRIS_CLI_MAX_LINE 5*1024
+int read_packets(FILE *io, struct pdu **result, const char *delim)
+{
+	if (!result) return -1;
+
+	struct pdu *pdu, *list = NULL;
+	int i, n = 0;
+	char buf[IRIS_CLI_MAX_LINE], *str, c;
+
+	while (!feof(io)) {
+		for (i = 0, c = getc(io);
+		     !feof(io) && c != '\x17' && i < IRIS_CLI_MAX_LINE;
+			 i++, c = getc(io)) {
+				buf[i] = c;
+		}
+		c = getc(io);
+		if (c > 0 && c != '\n') ungetc(c, io);
+
+		buf[i] = '\0';
+		strip(buf);
+		if (!*buf) continue;
+
+		// new packet!
+		struct pdu *re = realloc(list, (n+1) * sizeof(struct pdu));
+		if (!re) return -1;
+		pdu = (list = re)+n;
+		memset(pdu, 0, sizeof(struct pdu));
+
+		str = strtok(buf, delim);
+		if (!str) continue;
+		strncpy(pdu->host, str, IRIS_PDU_HOST_LEN-1);
+
+		str = strtok(NULL, delim);
+		if (!str) continue;
+		strncpy(pdu->service, str, IRIS_PDU_SERVICE_LEN-1);
+
+		str = strtok(NULL, delim);
+		if (!str || !str[0] || str[1])    continue; // too short or too long...
+		if (str[0] < '0' || str[0] > '3') continue; // not 0-3
+		pdu->rc = str[0] - '0';
+
+		str = strtok(NULL, "\0");
+		if (!str) continue;
+		strncpy(pdu->output, str, IRIS_PDU_OUTPUT_LEN-1);
+
+		n++;
+	}
+
+	*result = list;
+	return n;
+}
+
+/* Spool segments are nothing more than packed PDUs laid end to end,
+   exactly as they would go over the wire, so replaying one is just
+   a matter of shoveling bytes from the file to the socket (stamping
+   them with the time they actually go, see spool_restamp).  Segments
+   are written under a dot-file name and renamed into place once they
+   are complete, so that spool_replay never sees a partial segment. */
+
+static int spool_filter(const struct dirent *d)
+{
+	size_t len = strlen(d->d_name);
+	return d->d_name[0] != '.' && len > 4
+	    && strcmp(d->d_name + len - 4, ".seg") == 0;
+}
+
+static int spool_open(const char *dir, const char *base, char *path, char *tmp, size_t len)
+{
+	static unsigned int seq = 0;
+	char name[64];
+
+	if (!base) {
+		snprintf(name, sizeof(name), "%010lu.%05d.%04u.seg",
+				(unsigned long)time(NULL), (int)getpid(), seq++ % 10000);
+		base = name;
+	}
+	snprintf(path, len, "%s/%s",  dir, base);
+	snprintf(tmp,  len, "%s/.%s", dir, base);
+
+	return open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0640);
+}
+
+static int spool_close(int fd, const char *path, const char *tmp)
+{
+	int rc = fsync(fd);
+	if (close(fd) != 0 || rc != 0 || rename(tmp, path) != 0) {
+		syslog(LOG_WARN, "failed to commit spool segment %s: %s", path, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+size_t write_full(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t n;
+	size_t off = 0;
+
+	while (off < len && (n = write(fd, buf+off, len-off)) > 0)
+		off += n;
+	return off;
+}
+
+static size_t read_full(int fd, uint8_t *buf, size_t len)
+{
+	ssize_t n;
+	size_t off = 0;
+
+	while (off < len && (n = read(fd, buf+off, len-off)) > 0)
+		off += n;
+	return off;
+}
+
+static void spool_throttle(const struct timespec *start, int sent, unsigned int rate)
+{
+	struct timespec now, wait;
+	double due;
+
+	if (!rate) return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	due = (double)sent / rate
+	    - ((now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9);
+	if (due <= 0) return;
+
+	wait.tv_sec  = (time_t)due;
+	wait.tv_nsec = (long)((due - wait.tv_sec) * 1e9);
+	nanosleep(&wait, NULL);
+}
+
+/* rewrite whatever is left of a segment (from offset onwards) in place,
+   keeping its name so that it still sorts ahead of newer segments. */
+static int spool_requeue(const char *dir, const char *base, int seg, off_t offset)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	uint8_t buf[8192];
+	size_t len;
+	int fd;
+
+	if (lseek(seg, offset, SEEK_SET) != offset) return -1;
+	if ((fd = spool_open(dir, base, path, tmp, sizeof(path))) < 0) return -1;
+
+	while ((len = read_full(seg, buf, sizeof(buf))) > 0) {
+		if (write_full(fd, buf, len) != len) {
+			close(fd); unlink(tmp);
+			return -1;
+		}
+	}
+	return spool_close(fd, path, tmp);
+}
+
+int spool_write(const char *dir, struct pdu *packets, int n)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	size_t len = n * sizeof(struct pdu);
+	int fd;
+
+	if (!dir || !packets || n < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (n == 0) return 0;
+
+	if ((fd = spool_open(dir, NULL, path, tmp, sizeof(path))) < 0) {
+		syslog(LOG_WARN, "failed to create spool segment in %s: %s", dir, strerror(errno));
+		return -1;
+	}
+	if (write_full(fd, (uint8_t*)packets, len) != len) {
+		syslog(LOG_WARN, "failed to write spool segment %s: %s", tmp, strerror(errno));
+		close(fd); unlink(tmp);
+		return -1;
+	}
+	if (spool_close(fd, path, tmp) != 0)
+		return -1;
+
+	trace(IRIS_TRACE_SINK, "spooled %d results to %s", n, path);
+	return n;
+}
+
+/* Spooled PDUs still carry the timestamp they were first sent with,
+   and pdu_unpack won't take anything more than 900s off; so each one
+   is stamped afresh (and its CRC redone) on its way back out.  Any
+   that arrived in the spool with a bad CRC keep it. */
+static void spool_restamp(struct pdu *pdus, int n)
+{
+	uint32_t crc, ts = htonl((uint32_t)time(NULL));
+	int i;
+
+	for (i = 0; i < n; i++) {
+		crc = ntohl(pdus[i].crc32);
+		pdus[i].crc32 = 0;
+		if (crc32((uint8_t*)&pdus[i], sizeof(struct pdu)) != crc) {
+			pdus[i].crc32 = htonl(crc);
+			continue;
+		}
+		pdus[i].ts    = ts;
+		pdus[i].crc32 = htonl(crc32((uint8_t*)&pdus[i], sizeof(struct pdu)));
+	}
+}
+
+/* Replays the spool through send, which returns how many of the n
+   (packed) PDUs it got delivered, however it defines that; a segment
+   is only removed once all of it has been, and whatever wasn't goes
+   back in the spool.  Without a send, delivered means written. */
+int spool_replay_via(const char *dir, int fd, unsigned int rate,
+		int (*send)(int fd, struct pdu *pdus, int n))
+{
+	struct dirent **segs;
+	struct timespec start;
+	char path[PATH_MAX];
+	uint8_t *buf;
+	size_t want, len, sent;
+	off_t offset;
+	int i, k, n, seg, total = 0, failed = 0;
+
+	if (!dir) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	want = IRIS_SPOOL_BATCH;
+	if (rate && rate < want) want = rate;
+	want *= sizeof(struct pdu);
+
+	if ((n = scandir(dir, &segs, spool_filter, alphasort)) < 0)
+		return -1;
+	if (!(buf = malloc(want))) {
+		for (i = 0; i < n; i++) free(segs[i]);
+		free(segs);
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; i++) {
+		if (failed) {
+			free(segs[i]);
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "%s/%s", dir, segs[i]->d_name);
+		if ((seg = open(path, O_RDONLY)) < 0) {
+			syslog(LOG_WARN, "failed to open spool segment %s: %s", path, strerror(errno));
+			free(segs[i]);
+			continue;
+		}
+		posix_fadvise(seg, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+		for (offset = 0; ; offset += len) {
+			len = read_full(seg, buf, want);
+			len -= len % sizeof(struct pdu); /* drop a truncated trailer */
+			if (len == 0) break;
+
+			spool_restamp((struct pdu*)buf, len / sizeof(struct pdu));
+			spool_throttle(&start, total, rate);
+			if (send) {
+				k = send(fd, (struct pdu*)buf, len / sizeof(struct pdu));
+				sent = k > 0 ? k * sizeof(struct pdu) : 0;
+			} else {
+				sent = write_full(fd, buf, len);
+			}
+			total += sent / sizeof(struct pdu);
+
+			if (sent < len) {
+				/* a PDU cut short on the wire will be discarded by the
+				   other end, so resend it whole next time around */
+				offset += sent - sent % sizeof(struct pdu);
+				syslog(LOG_WARN, "replay of %s interrupted after %d results: %s",
+						path, total, strerror(errno));
+				if (spool_requeue(dir, segs[i]->d_name, seg, offset) != 0)
+					syslog(LOG_ERROR, "failed to requeue remainder of %s: %s",
+							path, strerror(errno));
+				failed = 1;
+				break;
+			}
+		}
+
+		close(seg);
+		if (!failed) unlink(path);
+		free(segs[i]);
+	}
+
+	free(segs);
+	free(buf);
+	return failed ? -1 : total;
+}
+
+int spool_replay(const char *dir, int fd, unsigned int rate)
+{
+	return spool_replay_via(dir, fd, rate, NULL);
+}
+
+/* A relay batches up validated results and forwards them, repacked,
+   to another iris over a long-lived connection.  The connection is
+   recycled every `lifetime' seconds (so that the upstream's own
+   max_lifetime never gets the chance to cut it off mid-batch), and
+   batches that can't be delivered go to the spool, if there is one,
+   to be replayed on the next successful connect.  After a failed
+   connect (or write), the relay leaves the upstream alone for a while
+   (see IRIS_RELAY_BACKOFF), and spools everything in the meantime. */
+
+int relay_init(struct relay *r, const char *upstream, int batch)
+{
+	char *host, *port;
+
+	if (!r || !upstream || batch <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(r, 0, sizeof(struct relay));
+	r->fd       = -1;
+	r->max      = batch;
+	r->lifetime = 15;
+	r->port     = IRIS_DEFAULT_PORT;
+
+	if (!(r->host = strdup(upstream))) return -1;
+	if (strncmp(r->host, IRIS_UNIX_PREFIX, strlen(IRIS_UNIX_PREFIX)) != 0) {
+		port = NULL;
+		net_split(r->host, &host, &port);
+		memmove(r->host, host, strlen(host) + 1);
+		if (port)
+			r->port = atoi(port);
+	}
+	if (!*r->host || r->port == 0) {
+		free(r->host);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!(r->batch = calloc(batch, sizeof(struct pdu)))) {
+		free(r->host);
+		return -1;
+	}
+	return 0;
+}
+
+/* puts off the next connect, for twice as long as last time */
+static void relay_backoff(struct relay *r)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	r->backoff = r->backoff ? r->backoff * 2 : 1;
+	if (r->backoff > IRIS_RELAY_BACKOFF)
+		r->backoff = IRIS_RELAY_BACKOFF;
+	r->retry = now.tv_sec + r->backoff;
+	trace(IRIS_TRACE_SINK, "not trying upstream %s:%u again for %lis",
+			r->host, r->port, (long)r->backoff);
+}
+
+static int relay_connect(struct relay *r)
+{
+	struct timespec now;
+	struct timeval tv;
+	char c;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (r->fd >= 0) {
+		/* the upstream never talks back, so a readable socket means EOF */
+		if (now.tv_sec < r->deadline.tv_sec
+		 && recv(r->fd, &c, 1, MSG_PEEK|MSG_DONTWAIT) < 0
+		 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+
+		trace(IRIS_TRACE_SINK, "recycling upstream connection to %s:%u, fd %d", r->host, r->port, r->fd);
+		close(r->fd);
+		r->fd = -1;
+	}
+
+	if (now.tv_sec < r->retry) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	if ((r->fd = net_connect_timeout(r->host, r->port, IRIS_RELAY_TIMEOUT)) < 0) {
+		syslog(LOG_WARN, "failed to connect to upstream %s:%u: %s",
+				r->host, r->port, strerror(errno));
+		relay_backoff(r);
+		return -1;
+	}
+	r->deadline.tv_sec  = now.tv_sec + r->lifetime;
+	r->deadline.tv_nsec = now.tv_nsec;
+
+	/* a stalled upstream mustn't hold up the sink thread for good */
+	tv.tv_sec  = IRIS_RELAY_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(r->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	if (r->spool && spool_replay(r->spool, r->fd, 0) < 0) {
+		close(r->fd);
+		r->fd = -1;
+		relay_backoff(r);
+		return -1;
+	}
+	r->backoff = 0;
+	return 0;
+}
+
+int relay_submit(struct relay *r, const struct pdu *pdu)
+{
+	if (!r || !pdu) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memcpy(&r->batch[r->n], pdu, sizeof(struct pdu));
+	pdu_pack(&r->batch[r->n]);
+
+	if (++r->n < r->max) return 0;
+	return relay_flush(r) < 0 ? -1 : 0;
+}
+
+int relay_flush(struct relay *r)
+{
+	size_t len, sent = 0;
+	int n, skip = 0;
+
+	if (!r) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!(n = r->n)) return 0;
+
+	len = n * sizeof(struct pdu);
+	if (relay_connect(r) == 0) {
+		if ((sent = write_full(r->fd, (uint8_t*)r->batch, len)) == len) {
+			trace(IRIS_TRACE_SINK, "relayed %d results to %s:%u", n, r->host, r->port);
+			r->n = 0;
+			return n;
+		}
+
+		syslog(LOG_WARN, "failed to relay results to %s:%u: %s",
+				r->host, r->port, strerror(errno));
+		close(r->fd);
+		r->fd = -1;
+		relay_backoff(r);
+		/* whatever made it out whole is the upstream's problem now */
+		skip = sent / sizeof(struct pdu);
+	}
+
+	r->n = 0;
+	if (r->spool && spool_write(r->spool, r->batch+skip, n-skip) == n-skip)
+		return 0;
+
+	syslog(LOG_ERROR, "dropping %d results bound for upstream %s:%u",
+			n-skip, r->host, r->port);
+	return -1;
+}
+
+void relay_deinit(struct relay *r)
+{
+	if (!r) return;
+
+	relay_flush(r);
+	if (r->fd >= 0) close(r->fd);
+	free(r->host);
+	free(r->batch);
+	memset(r, 0, sizeof(struct relay));
+	r->fd = -1;
+}
+
+static size_t shmring_size(unsigned int slots)
+{
+	return sizeof(struct shm_header) + (size_t)slots * sizeof(struct shm_slot);
+}
+
+static int shmring_map(struct shmring *r, int fd)
+{
+	void *p = mmap(NULL, r->size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		return -1;
+
+	r->hdr   = (struct shm_header*)p;
+	r->slots = (struct shm_slot*)(r->hdr + 1);
+	return 0;
+}
+
+static struct shmring* shmring_alloc(const char *path, char *wake, size_t len)
+{
+	struct shmring *r;
+
+	if (snprintf(wake, len, "%s" IRIS_SHM_WAKE, path) >= len) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	if (!(r = calloc(1, sizeof(struct shmring))))
+		return NULL;
+	if (!(r->path = strdup(path))) {
+		free(r);
+		return NULL;
+	}
+	r->wakefd = r->holdfd = -1;
+	return r;
+}
+
+/* Creates (replacing any stale one) the ring that iris consumes,
+   rounding the slot count up to a power of two. */
+struct shmring* shmring_create(const char *path, unsigned int slots)
+{
+	struct shmring *r;
+	char wake[PATH_MAX];
+	unsigned int i, n;
+	int fd, e;
+
+	for (n = 1; n < slots; n <<= 1)
+		;
+	if (!(r = shmring_alloc(path, wake, sizeof(wake))))
+		return NULL;
+	r->size = shmring_size(n);
+
+	unlink(path);
+	if ((fd = open(path, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0660)) < 0)
+		goto failed;
+	if (ftruncate(fd, r->size) != 0 || shmring_map(r, fd) != 0) {
+		e = errno; close(fd); errno = e;
+		goto failed;
+	}
+	close(fd);
+
+	for (i = 0; i < n; i++)
+		r->slots[i].seq = i;
+	r->hdr->version  = IRIS_SHM_VERSION;
+	r->hdr->slots    = n;
+	r->hdr->sleeping = 1;
+	r->hdr->head     = 0;
+	r->hdr->tail     = 0;
+	__atomic_store_n(&r->hdr->magic, IRIS_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	unlink(wake);
+	if (mkfifo(wake, 0660) != 0
+	 || (r->wakefd = open(wake, O_RDONLY|O_NONBLOCK|O_CLOEXEC)) < 0)
+		goto failed;
+
+	/* keep a writer of our own on the FIFO, so that producers coming
+	   and going never leave it hung up (and epoll spinning on HUP) */
+	if ((r->holdfd = open(wake, O_WRONLY|O_NONBLOCK|O_CLOEXEC)) < 0)
+		goto failed;
+
+	return r;
+
+failed:
+	e = errno;
+	shmring_close(r);
+	errno = e;
+	return NULL;
+}
+
+/* Attaches a producer to a ring that iris has already created. */
+struct shmring* shmring_open(const char *path)
+{
+	struct shmring *r;
+	struct stat st;
+	char wake[PATH_MAX];
+	int fd, e;
+
+	if (!(r = shmring_alloc(path, wake, sizeof(wake))))
+		return NULL;
+
+	if ((fd = open(path, O_RDWR|O_CLOEXEC)) < 0)
+		goto failed;
+	if (fstat(fd, &st) != 0) {
+		e = errno; close(fd); errno = e;
+		goto failed;
+	}
+	if (st.st_size < sizeof(struct shm_header)) {
+		close(fd); errno = EINVAL;
+		goto failed;
+	}
+	r->size = st.st_size;
+	if (shmring_map(r, fd) != 0) {
+		e = errno; close(fd); errno = e;
+		goto failed;
+	}
+	close(fd);
+
+	if (__atomic_load_n(&r->hdr->magic, __ATOMIC_ACQUIRE) != IRIS_SHM_MAGIC
+	 || r->hdr->version != IRIS_SHM_VERSION
+	 || r->hdr->slots == 0 || (r->hdr->slots & (r->hdr->slots - 1)) != 0
+	 || shmring_size(r->hdr->slots) != r->size) {
+		errno = EINVAL;
+		goto failed;
+	}
+
+	/* ENXIO here means nobody has the other end open; i.e. no iris */
+	if ((r->wakefd = open(wake, O_WRONLY|O_NONBLOCK|O_CLOEXEC)) < 0)
+		goto failed;
+
+	return r;
+
+failed:
+	e = errno;
+	shmring_close(r);
+	errno = e;
+	return NULL;
+}
+
+/* Copies an unpacked PDU into the next free slot, in network byte
+   order but without a CRC (the ring is local; there's no wire to
+   corrupt it).  Never blocks: returns -1 / EAGAIN if the ring is full. */
+int shmring_put(struct shmring *r, const struct pdu *pdu)
+{
+	struct shm_slot *slot;
+	uint64_t pos, seq;
+	uint32_t mask = r->hdr->slots - 1;
+
+	pos = __atomic_load_n(&r->hdr->head, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &r->slots[pos & mask];
+		seq  = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+		if ((int64_t)(seq - pos) == 0) {
+			if (__atomic_compare_exchange_n(&r->hdr->head, &pos, pos + 1, 1,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+
+		} else if ((int64_t)(seq - pos) < 0) {
+			errno = EAGAIN;
+			return -1;
+
+		} else {
+			pos = __atomic_load_n(&r->hdr->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	memcpy(&slot->pdu, pdu, sizeof(struct pdu));
+	slot->pdu.version = htons(IRIS_PROTOCOL_VERSION);
+	slot->pdu.ts      = htonl((uint32_t)pdu->ts);
+	slot->pdu.rc      = htons(pdu->rc);
+	slot->pdu.crc32   = 0;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+
+	/* only the producer that finds iris asleep pays for a syscall;
+	   EAGAIN on a full FIFO just means a wakeup is already pending */
+	if (__atomic_load_n(&r->hdr->sleeping, __ATOMIC_SEQ_CST)
+	 && __atomic_exchange_n(&r->hdr->sleeping, 0, __ATOMIC_SEQ_CST))
+		write(r->wakefd, "!", 1);
+
+	return 0;
+}
+
+/* Hands every published slot to iris_call_submit_result, straight
+   out of shared memory, and then goes back to sleep.  Processes at
+   most one ring's worth per call, so a busy producer can't starve
+   the sockets; if there's more, we poke our own FIFO to come back. */
+int shmring_consume(struct shmring *r)
+{
+	struct shm_slot *slot;
+	struct pdu pdu;
+	uint64_t pos;
+	uint32_t mask = r->hdr->slots - 1;
+	char buf[64];
+	int n = 0;
+
+	while (read(r->wakefd, buf, sizeof(buf)) > 0)
+		;
+
+	pos = r->hdr->tail;
+	for (;;) {
+		slot = &r->slots[pos & mask];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != pos + 1) {
+			/* nothing published; go to sleep, unless something
+			   was published before the producer could see us do so */
+			__atomic_store_n(&r->hdr->sleeping, 1, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != pos + 1)
+				break;
+			__atomic_store_n(&r->hdr->sleeping, 0, __ATOMIC_SEQ_CST);
+			continue;
+		}
+
+		if (n > mask) {
+			write(r->holdfd, "!", 1);
+			break;
+		}
+
+		/* the producer can scribble on the slot whenever it likes, so
+		   nothing is checked (or handed on) until it's ours alone */
+		memcpy(&pdu, &slot->pdu, sizeof(pdu));
+		pos++;
+		__atomic_store_n(&slot->seq, pos + mask, __ATOMIC_RELEASE);
+		__atomic_store_n(&r->hdr->tail, pos, __ATOMIC_RELAXED);
+		n++;
+
+		pdu.host[IRIS_PDU_HOST_LEN-1]       = '\0';
+		pdu.service[IRIS_PDU_SERVICE_LEN-1] = '\0';
+		pdu.output[IRIS_PDU_OUTPUT_LEN-1]   = '\0';
+		INGEST.bytes += sizeof(struct pdu);
+		if (pdu_unpack_trusted(&pdu) == 0) {
+			syslog(LOG_RESULT, "SERVICE RESULT %08x v%d [%d] %s/%s (rc:%d) '%s'",
+					pdu.crc32, pdu.version, (uint32_t)pdu.ts,
+					pdu.host, pdu.service, pdu.rc, pdu.output);
+			submit(-1, &pdu);
+		} else {
+			syslog(LOG_WARN, "discarding bogus packet from shared-memory ring %s", r->path);
+		}
+	}
+	return n;
+}
+
+/* Detaches from the ring; iris (the creator) also removes it. */
+void shmring_close(struct shmring *r)
+{
+	char wake[PATH_MAX];
+
+	if (!r) return;
+
+	if (r->hdr)
+		munmap(r->hdr, r->size);
+	if (r->wakefd >= 0)
+		close(r->wakefd);
+	if (r->holdfd >= 0) {
+		close(r->holdfd);
+		snprintf(wake, sizeof(wake), "%s" IRIS_SHM_WAKE, r->path);
+		unlink(wake);
+		unlink(r->path);
+	}
+	free(r->path);
+	free(r);
+}
+
+/* Parses an Icinga external command line, as written to the command
+   pipe, into a PDU (without packing it):
+
+     [<ts>] PROCESS_SERVICE_CHECK_RESULT;<host>;<service>;<rc>;<output>
+     [<ts>] PROCESS_HOST_CHECK_RESULT;<host>;<rc>;<output>
+
+   The timestamp is optional; the line is modified in place. */
+int cmd_parse(char *line, struct pdu *pdu)
+{
+	char *p, *host, *service, *rc, *end;
+	unsigned long ts;
+
+	if (!line || !pdu) return -1;
+	memset(pdu, 0, sizeof(struct pdu));
+
+	for (p = line; isspace(*p); p++)
+		;
+	ts = (unsigned long)time(NULL);
+	if (*p == '[') {
+		errno = 0;
+		ts = strtoul(p+1, &end, 10);
+		if (errno != 0 || end == p+1 || *end != ']') return -1;
+		for (p = end+1; isspace(*p); p++)
+			;
+	}
+
+	if (strncmp(p, "PROCESS_SERVICE_CHECK_RESULT;", 29) == 0) {
+		host    = p + 29;
+		if (!(service = strchr(host, ';'))) return -1;
+		*service++ = '\0';
+		if (!(rc = strchr(service, ';'))) return -1;
+		*rc++ = '\0';
+
+	} else if (strncmp(p, "PROCESS_HOST_CHECK_RESULT;", 26) == 0) {
+		host    = p + 26;
+		service = "HOST";
+		if (!(rc = strchr(host, ';'))) return -1;
+		*rc++ = '\0';
+
+	} else {
+		return -1;
+	}
+
+	/* rc is a single digit, 0-3, followed by the output */
+	if (rc[0] < '0' || rc[0] > '3' || rc[1] != ';') return -1;
+	if (!*host || strlen(host) >= IRIS_PDU_HOST_LEN)       return -1;
+	if (!*service || strlen(service) >= IRIS_PDU_SERVICE_LEN) return -1;
+
+	strcpy(pdu->host,    host);
+	strcpy(pdu->service, service);
+	strncpy(pdu->output, rc+2, IRIS_PDU_OUTPUT_LEN-1);
+	pdu->rc      = rc[0] - '0';
+	pdu->ts      = (uint32_t)ts;
+	pdu->version = IRIS_PROTOCOL_VERSION;
+	return 0;
+}
+
+static void recv_command(struct client *c, char *line)
+{
+	struct pdu pdu;
+	size_t len = strlen(line);
+
+	if (len > 0 && line[len-1] == '\r')
+		line[len-1] = '\0';
+	if (!*line) return;
+
+	if (cmd_parse(line, &pdu) != 0) {
+		syslog(LOG_WARN, "discarding bogus command from %s, fd %d", c->addr, c->fd);
+		INGEST.bogus_command++;
+		source_count(c, 0, 0, 1);
+		return;
+	}
+
+	syslog(LOG_RESULT, "SERVICE RESULT (cmd) [%d] %s/%s (rc:%d) '%s'",
+			(uint32_t)pdu.ts, pdu.host, pdu.service, pdu.rc, pdu.output);
+	source_count(c, 0, 1, 0);
+	submit(c->fd, &pdu);
+}
+
+/* The admin socket (admin_unix): a command per line, from irisctl or
+   socat, answered on the reactor thread between reads.  Answers are
+   queued on the client (up to IRIS_ADMIN_OUTPUT) and written as the
+   socket takes them, so a slow reader never holds anything up; each
+   one ends with a line holding just a "." */
+
+/* out is always allocated in powers of two, from 4k up */
+static size_t admin_room(size_t len)
+{
+	size_t room = 4096;
+	while (room < len)
+		room <<= 1;
+	return room;
+}
+
+static void admin_printf(struct client *c, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void admin_printf(struct client *c, const char *fmt, ...)
+{
+	va_list ap;
+	char *out;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (n < 0 || c->outlen + n + 1 > IRIS_ADMIN_OUTPUT)
+		return;
+	if (!c->out || c->outlen + n + 1 > admin_room(c->outlen + 1)) {
+		if (!(out = realloc(c->out, admin_room(c->outlen + n + 1))))
+			return;
+		c->out = out;
+	}
+
+	va_start(ap, fmt);
+	vsnprintf(c->out + c->outlen, n + 1, fmt, ap);
+	va_end(ap);
+	c->outlen += n;
+}
+
+/* Writes what it can of an admin client's answers; returns 0 once
+   they're all gone, 1 if the socket is full (the rest goes out on
+   EPOLLOUT), or -1 on error. */
+static int client_flush(struct client *c)
+{
+	struct epoll_event ev = {0};
+	ssize_t n;
+	size_t off = 0;
+
+	while (off < c->outlen) {
+		if ((n = write(c->fd, c->out + off, c->outlen - off)) > 0) {
+			off += n;
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		return -1;
+	}
+
+	if (off < c->outlen) {
+		memmove(c->out, c->out + off, c->outlen - off);
+		c->outlen -= off;
+		/* stays armed; with EPOLLET, a spare wakeup or two is harmless */
+		ev.data.fd = c->fd;
+		ev.events  = EPOLLIN | EPOLLOUT | EPOLLET;
+		if (epoll_ctl(OVERFLOW_EPFD, EPOLL_CTL_MOD, c->fd, &ev) != 0)
+			return -1;
+		return 1;
+	}
+	free(c->out);
+	c->out = NULL;
+	c->outlen = 0;
+	return 0;
+}
+
+/* the socket has room again */
+static void client_writable(struct client *c)
+{
+	int rc = client_flush(c);
+	if (rc < 0 || (rc == 0 && (c->flags & IRIS_CLIENT_HANGUP)))
+		client_close(c->fd);
+}
+
+static const char* proto_name(int proto)
+{
+	return proto == IRIS_PROTO_PDU   ? "pdu"
+	     : proto == IRIS_PROTO_CMD   ? "cmd"
+	     : proto == IRIS_PROTO_ADMIN ? "admin"
+	                                 : "?";
+}
+
+static void admin_clients(struct client *a)
+{
+	struct timespec now;
+	struct client *c;
+	unsigned int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	admin_printf(a, "%-5s %-39s %-5s %7s %7s %12s %8s %s\n",
+			"fd", "address", "proto", "age", "left", "bytes", "results", "flags");
+	for (i = 0; i < CLIENTS_ALLOCATED; i++) {
+		c = client_at(i);
+		if (c->fd < 0)
+			continue;
+		admin_printf(a, "%-5d %-39s %-5s %7li %7li %12zu %8u %s%s%s%s%s%s%s\n",
+				c->fd, c->addr, proto_name(c->proto),
+				(long)(now.tv_sec - c->since), (long)(c->deadline.tv_sec - now.tv_sec),
+				c->bytes, c->seq,
+				c->flags & IRIS_CLIENT_TRUSTED ? "trusted " : "",
+				c->flags & IRIS_CLIENT_READY   ? "ready "   : "",
+				c->flags & IRIS_CLIENT_ACK     ? "ack "     : "",
+				c->flags & IRIS_CLIENT_TLS     ? "tls "     : "",
+				c->flags & IRIS_CLIENT_KTLS    ? "ktls "    : "",
+				c->flags & IRIS_CLIENT_TRACED && NUM_TRACE_SCOPES ? "traced " : "",
+				c->pdu && c->proto == IRIS_PROTO_PDU ? "mid-pdu" : "");
+	}
+}
+
+/* see admin_stats_extra() */
+static void (*ADMIN_EXTRA)(void) = NULL;
+static struct client *ADMIN_ASKING = NULL;
+
+static void admin_stats(struct client *a)
+{
+	char buf[64];
+
+	admin_printf(a, "clients.active %u\n",    CLIENT_STATS.active);
+	admin_printf(a, "clients.max %u\n",       NUM_CLIENTS);
+	admin_printf(a, "clients.allocated %u\n", CLIENT_STATS.allocated);
+	admin_printf(a, "clients.peak %u\n",      CLIENT_STATS.peak);
+	admin_printf(a, "clients.waiting %u\n",   CLIENT_STATS.waiting);
+	admin_printf(a, "clients.ready %u\n",     READY_COUNT);
+	admin_printf(a, "clients.buffers %u\n",   CLIENT_STATS.buffers);
+	admin_printf(a, "clients.accepted %lu\n", CLIENT_STATS.accepted);
+	admin_printf(a, "clients.rejected %lu\n", CLIENT_STATS.rejected);
+	admin_printf(a, "clients.queued %lu\n",   CLIENT_STATS.queued);
+	admin_printf(a, "clients.evicted %lu\n",  CLIENT_STATS.evicted);
+	admin_printf(a, "clients.expired %lu\n",  CLIENT_STATS.expired);
+	admin_printf(a, "tls.handshakes %lu\n",   CLIENT_STATS.handshakes);
+	admin_printf(a, "tls.resumed %lu\n",      CLIENT_STATS.resumed);
+	admin_printf(a, "tls.ktls %lu\n",         CLIENT_STATS.ktls);
+	admin_printf(a, "tls.failed %lu\n",       CLIENT_STATS.tls_failed);
+	admin_printf(a, "ingest.results %lu\n",        INGEST.results);
+	admin_printf(a, "ingest.bytes %lu\n",          INGEST.bytes);
+	admin_printf(a, "ingest.bogus.crc %lu\n",      INGEST.bogus_crc);
+	admin_printf(a, "ingest.bogus.version %lu\n",  INGEST.bogus_version);
+	admin_printf(a, "ingest.bogus.age %lu\n",      INGEST.bogus_age);
+	admin_printf(a, "ingest.bogus.command %lu\n",  INGEST.bogus_command);
+	admin_printf(a, "ingest.bogus.size %lu\n",     INGEST.bogus_size);
+	admin_printf(a, "sources.tracked %u\n",        NUM_SOURCES);
+	admin_printf(a, "sources.evicted %lu\n",       SOURCES_EVICTED);
+	admin_printf(a, "trace.categories %s\n",  trace_names(TRACE_MASK, buf, sizeof(buf)));
+	admin_printf(a, "trace.dropped %lu\n",    trace_dropped());
+
+	if (ADMIN_EXTRA) {
+		ADMIN_ASKING = a;
+		ADMIN_EXTRA();
+		ADMIN_ASKING = NULL;
+	}
+}
+
+/* Lets the program iris is running in (the broker, irisd) add its own
+   counters to `stats': fn gets called, on the reactor thread, at the
+   end of each answer, and calls admin_stat() for every line. */
+void admin_stats_extra(void (*fn)(void))
+{
+	ADMIN_EXTRA = fn;
+}
+
+void admin_stat(const char *name, unsigned long value)
+{
+	if (ADMIN_ASKING)
+		admin_printf(ADMIN_ASKING, "%s %lu\n", name, value);
+}
+
+static int source_cmp(const void *a, const void *b)
+{
+	const struct source *x = *(const struct source**)a, *y = *(const struct source**)b;
+	return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : 0;
+}
+
+/* the source table, biggest senders first; `error' is how much of
+   their bytes might really have been somebody else's (see source_get) */
+static void admin_talkers(struct client *a, int top)
+{
+	struct source **all;
+	unsigned int i;
+	time_t now = time(NULL);
+
+	if (!(all = calloc(NUM_SOURCES + 1, sizeof(struct source*)))) {
+		admin_printf(a, "error: %s\n", strerror(errno));
+		return;
+	}
+	for (i = 0; i < NUM_SOURCES; i++)
+		all[i] = &SOURCES[i];
+	qsort(all, NUM_SOURCES, sizeof(struct source*), source_cmp);
+
+	admin_printf(a, "%-39s %7s %12s %8s %8s %8s %6s %s\n", "address", "clients",
+			"bytes", "results", "conns", "bogus", "idle", "error");
+	for (i = 0; i < NUM_SOURCES && i < top; i++)
+		admin_printf(a, "%-39s %7u %12lu %8lu %8lu %8lu %6li %lu\n",
+				all[i]->addr, all[i]->clients, all[i]->bytes, all[i]->results,
+				all[i]->connections, all[i]->bogus, (long)(now - all[i]->last), all[i]->error);
+	free(all);
+}
+
+static void hosts_count(const char *host)
+{
+	size_t len = strnlen(host, IRIS_PDU_HOST_LEN);
+	uintptr_t n;
+
+	if (time(NULL) > HOSTS_UNTIL) {
+		hash_free(HOSTS, NULL); /* nobody's looking any more */
+		HOSTS = NULL;
+		return;
+	}
+	n = (uintptr_t)hash_get(HOSTS, host, len);
+	if (n || HOSTS->count < IRIS_TOP_HOSTS)
+		hash_set(HOSTS, host, len, (void*)(n + 1));
+	else
+		HOSTS_OTHERS++;
+}
+
+struct top_host {
+	const char   *host;
+	size_t        len;
+	unsigned long results;
+};
+
+static void top_host_add(const char *key, size_t len, void *value, void *udata)
+{
+	struct top_host **next = udata;
+	(*next)->host    = key;
+	(*next)->len     = len;
+	(*next)->results = (uintptr_t)value;
+	(*next)++;
+}
+
+static int top_host_cmp(const void *a, const void *b)
+{
+	const struct top_host *x = a, *y = b;
+	return x->results < y->results ? 1 : x->results > y->results ? -1 : 0;
+}
+
+/* Results per host, most first, counted from the first time anyone
+   asked; counting stops IRIS_TOP_HOSTS_TIME seconds after the last. */
+static void admin_hosts(struct client *a, int top)
+{
+	struct top_host *all, *next;
+	unsigned int i;
+
+	if (!HOSTS) {
+		if (!(HOSTS = hash_new(1024))) {
+			admin_printf(a, "error: %s\n", strerror(errno));
+			return;
+		}
+		HOSTS_OTHERS = 0;
+	}
+	HOSTS_UNTIL = time(NULL) + IRIS_TOP_HOSTS_TIME;
+
+	if (!(all = calloc(HOSTS->count + 1, sizeof(struct top_host)))) {
+		admin_printf(a, "error: %s\n", strerror(errno));
+		return;
+	}
+	next = all;
+	hash_each(HOSTS, top_host_add, &next);
+	qsort(all, HOSTS->count, sizeof(struct top_host), top_host_cmp);
+
+	admin_printf(a, "%-39s %8s\n", "host", "results");
+	for (i = 0; i < HOSTS->count && i < top; i++)
+		admin_printf(a, "%-39.*s %8lu\n", (int)all[i].len, all[i].host, all[i].results);
+	if (HOSTS_OTHERS)
+		admin_printf(a, "%-39s %8lu\n", "<others>", HOSTS_OTHERS);
+	free(all);
+}
+
+static void admin_kick(struct client *a, const char *who)
+{
+	char addr[IRIS_ADDRSTRLEN];
+	struct client *c;
+	unsigned int i, n = 0;
+
+	if (!who || canon_addr(who, addr) != 0) {
+		admin_printf(a, "error: kick needs an IP address\n");
+		return;
+	}
+	for (i = 0; i < CLIENTS_ALLOCATED; i++) {
+		c = client_at(i);
+		if (c->fd < 0 || c->proto == IRIS_PROTO_ADMIN || strcmp(c->addr, addr) != 0)
+			continue;
+		client_close(c->fd);
+		n++;
+	}
+	syslog(LOG_PROC, "admin: kicked %u client%s from %s", n, n == 1 ? "" : "s", addr);
+	admin_printf(a, "kicked %u client%s from %s\n", n, n == 1 ? "" : "s", addr);
+}
+
+static const char *LOG_LEVELS[] = {
+	"emerg", "alert", "crit", "err", "warning", "notice", "info", "debug", NULL
+};
+int LOG_LEVEL = LOG_DEBUG;
+
+/* syslog priority, via setlogmask(); note that in the broker, this is
+   Icinga's process too, and its own syslog messages are affected */
+static void admin_loglevel(struct client *a, const char *level)
+{
+	int i;
+
+	if (level) {
+		for (i = 0; LOG_LEVELS[i] && strcasecmp(level, LOG_LEVELS[i]) != 0; i++)
+			;
+		if (!LOG_LEVELS[i]) {
+			admin_printf(a, "error: unknown log level '%s'\n", level);
+			return;
+		}
+		setlogmask(LOG_UPTO(i));
+		LOG_LEVEL = i;
+		syslog(LOG_PROC, "admin: log level is now %s", LOG_LEVELS[i]);
+	}
+	admin_printf(a, "loglevel %s\n", LOG_LEVELS[LOG_LEVEL]);
+}
+
+static void admin_trace(struct client *a, const char *list)
+{
+	char buf[64];
+	uint32_t mask;
+
+	if (list) {
+		if (trace_parse(list, &mask) != 0) {
+			admin_printf(a, "error: unknown trace category in '%s'\n", list);
+			return;
+		}
+		trace_set(mask);
+		syslog(LOG_PROC, "admin: tracing %s", trace_names(mask, buf, sizeof(buf)));
+	}
+	admin_printf(a, "trace %s\n", trace_names(TRACE_MASK, buf, sizeof(buf)));
+}
+
+static void admin_command(struct client *c, char *line)
+{
+	char *cmd, *arg, *save;
+
+	if (!(cmd = strtok_r(line, " \t\r", &save)))
+		return; /* blank lines get nothing back */
+	arg = strtok_r(NULL, " \t\r", &save);
+
+	if (strcmp(cmd, "clients") == 0) {
+		admin_clients(c);
+	} else if (strcmp(cmd, "stats") == 0) {
+		admin_stats(c);
+	} else if (strcmp(cmd, "top-talkers") == 0) {
+		admin_talkers(c, arg && atoi(arg) > 0 ? atoi(arg) : 10);
+	} else if (strcmp(cmd, "top-hosts") == 0) {
+		admin_hosts(c, arg && atoi(arg) > 0 ? atoi(arg) : 10);
+	} else if (strcmp(cmd, "kick") == 0) {
+		admin_kick(c, arg);
+	} else if (strcmp(cmd, "loglevel") == 0) {
+		admin_loglevel(c, arg);
+	} else if (strcmp(cmd, "trace") == 0) {
+		admin_trace(c, arg);
+	} else if (strcmp(cmd, "reload") == 0) {
+		if (config_reload() == 0)
+			admin_printf(c, "reloaded\n");
+		else
+			admin_printf(c, "error: reload failed (see syslog)\n");
+	} else if (strcmp(cmd, "help") == 0) {
+		admin_printf(c, "clients              every connected client\n"
+		                "stats                counters, as `name value'\n"
+		                "top-talkers [n]      source addresses, by bytes sent (top 10)\n"
+		                "top-hosts [n]        hosts, by results sent since first asked (top 10)\n"
+		                "kick <ip>            hang up on every client from <ip>\n"
+		                "loglevel [level]     show / set the syslog level (debug ... emerg)\n"
+		                "trace [categories]   show / set trace categories (see iris.conf)\n"
+		                "reload               re-read iris.conf now\n");
+	} else {
+		admin_printf(c, "error: unknown command '%s' (try help)\n", cmd);
+	}
+	admin_printf(c, ".\n");
+}
+
+/* The other end of admin_unix, for irisctl and iris-top: sends cmds
+   (one or more lines) and reads back n answers, "." lines and all,
+   into a string for the caller to free().  NULL (with errno) if it
+   couldn't. */
+char* admin_query(const char *sock, const char *cmds, int n)
+{
+	char path[PATH_MAX + sizeof(IRIS_UNIX_PREFIX)];
+	char *buf = NULL, *p;
+	size_t len = 0, room = 0, line = 0;
+	ssize_t r;
+	int fd, saved;
+
+	snprintf(path, sizeof(path), IRIS_UNIX_PREFIX "%s", sock);
+	if ((fd = net_connect(path, 0)) < 0)
+		return NULL;
+	if (write_full(fd, (const uint8_t*)cmds, strlen(cmds)) != strlen(cmds))
+		goto fail;
+
+	while (n > 0) {
+		if (len + 4096 > room) {
+			room = admin_room(len + 4096);
+			if (!(p = realloc(buf, room)))
+				goto fail;
+			buf = p;
+		}
+		if ((r = read(fd, buf + len, room - len - 1)) <= 0) {
+			if (r == 0)
+				errno = ECONNRESET;
+			if (r < 0 && errno == EINTR)
+				continue;
+			goto fail;
+		}
+		len += r;
+		for (; (p = memchr(buf + line, '\n', len - line)) != NULL; line = p - buf + 1) {
+			if (p - buf - line == 1 && buf[line] == '.')
+				n--;
+		}
+	}
+	buf[len] = '\0';
+	close(fd);
+	return buf;
+
+fail:
+	saved = errno;
+	close(fd);
+	free(buf);
+	errno = saved;
+	return NULL;
+}
+
+/* Puts a client that has used up its budget on the ready list; if
+   there's no room, it just keeps going (returns -1) */
+static int client_ready(struct client *c)
+{
+	if (c->flags & IRIS_CLIENT_READY)
+		return 0;
+	if (ready_push(c->fd) != 0)
+		return -1;
+	c->flags |= IRIS_CLIENT_READY;
+	return 0;
+}
+
+static int listener_ready(int l)
+{
+	if (LISTENERS[l].queued)
+		return 0;
+	if (ready_push(LISTENERS[l].fd) != 0)
+		return -1;
+	LISTENERS[l].queued = 1;
+	return 0;
+}
+
+/* Ack frames are tiny, and the sender is supposed to be reading them;
+   one that can't be written in one go means it isn't, and the client
+   is hung up on. */
+static int client_ack(struct client *c, int type, int reason)
+{
+	struct ack ack;
+
+	ack.type   = htons(type);
+	ack.reason = htons(reason);
+	ack.seq    = htonl(c->seq);
+	if (write(c->fd, &ack, sizeof(ack)) != sizeof(ack)) {
+		syslog(LOG_WARN, "failed to acknowledge result #%u from %s, fd %d; hanging up",
+				c->seq, c->addr, c->fd);
+		client_close(c->fd);
+		return -1;
+	}
+	if (type == IRIS_ACK_ACCEPTED)
+		c->acked = c->seq;
+	return 0;
+}
+
+/* sends ACCEPTED for everything received since the last one, if anything */
+static int client_acked(struct client *c)
+{
+	if (!(c->flags & IRIS_CLIENT_ACK) || c->seq == c->acked)
+		return 0;
+	return client_ack(c, IRIS_ACK_ACCEPTED, IRIS_ACK_OK);
+}
+
+/* Receive buffers are only needed between the first and the last
+   byte of a PDU; the rest of the time they sit in PDU_POOL. */
+static struct pdu* pdu_alloc(void)
+{
+	void *buf = PDU_POOL;
+
+	if (buf) {
+		PDU_POOL = *(void**)buf;
+		PDU_POOL_SIZE--;
+		return buf;
+	}
+	if ((buf = malloc(sizeof(struct pdu))) != NULL)
+		CLIENT_STATS.buffers++;
+	return buf;
+}
+
+static void pdu_free(struct pdu *pdu)
+{
+	if (PDU_POOL_SIZE >= IRIS_PDU_POOL) {
+		free(pdu);
+		CLIENT_STATS.buffers--;
+		return;
+	}
+	*(void**)pdu = PDU_POOL;
+	PDU_POOL = pdu;
+	PDU_POOL_SIZE++;
+}
+
+static int client_buffer(struct client *c)
+{
+	if (c->pdu)
+		return 0;
+	if (!(c->pdu = pdu_alloc())) {
+		syslog(LOG_ERROR, "failed to allocate a receive buffer for %s: %s",
+				c->addr, strerror(errno));
+		client_close(c->fd);
+		return -1;
+	}
+	return 0;
+}
+
+/* gives the buffer back, unless it's holding on to a partial read */
+static void client_unbuffer(struct client *c)
+{
+	if (c->pdu && c->offset == 0) {
+		pdu_free(c->pdu);
+		c->pdu = NULL;
+	}
+}
+
+/* Command clients send newline-terminated lines instead of PDUs;
+   the (otherwise unused) PDU buffer holds the partial line. */
+static int recv_commands(struct client *c)
+{
+	char *buf, *line, *nl;
+	size_t max = sizeof(struct pdu) - 1;
+	ssize_t len;
+	int n = 0;
+
+	if (client_buffer(c) != 0)
+		return 0;
+	buf = (char*)c->pdu;
+
+	ctrace(c, IRIS_TRACE_READ, "reading commands from %s, fd %d", c->addr, c->fd);
+	for (;;) {
+		len = read(c->fd, buf + c->offset, max - c->offset);
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			client_unbuffer(c);
+			if (c->out && client_flush(c) < 0)
+				client_close(c->fd);
+			return 0;
+		}
+		if (len <= 0) {
+			if (len < 0)
+				syslog(LOG_INFO, "failed to read from %s: %s",
+						c->addr, strerror(errno));
+			else if (c->offset > 0 && !(c->flags & IRIS_CLIENT_DISCARD)) {
+				buf[c->offset] = '\0';
+				(c->proto == IRIS_PROTO_ADMIN ? admin_command : recv_command)(c, buf);
+			}
+			/* answer the last of them before hanging up */
+			if (len == 0 && c->out && client_flush(c) > 0) {
+				c->flags |= IRIS_CLIENT_HANGUP;
+				client_unbuffer(c);
+				return 0;
+			}
+			client_close(c->fd);
+			return 0;
+		}
+
+		c->bytes  += len;
+		c->offset += len;
+		client_heard(c);
+		buf[c->offset] = '\0';
+		if (c->proto != IRIS_PROTO_ADMIN)
+			INGEST.bytes += len;
+		source_count(c, len, 0, 0);
+
+		for (line = buf; (nl = memchr(line, '\n', buf + c->offset - line)) != NULL; line = nl+1) {
+			*nl = '\0';
+			if (c->flags & IRIS_CLIENT_DISCARD)
+				c->flags &= ~IRIS_CLIENT_DISCARD;
+			else
+				(c->proto == IRIS_PROTO_ADMIN ? admin_command : recv_command)(c, line);
+			n++;
+		}
+
+		c->offset -= line - buf;
+		memmove(buf, line, c->offset);
+		if (c->offset == max) {
+			syslog(LOG_WARN, "discarding overlong command from %s, fd %d", c->addr, c->fd);
+			c->flags |= IRIS_CLIENT_DISCARD;
+			c->offset = 0;
+		}
+
+		if (n >= IRIS_PDU_BUDGET && client_ready(c) == 0) {
+			client_unbuffer(c);
+			if (c->out && client_flush(c) < 0)
+				client_close(c->fd);
+			return 0;
+		}
+	}
+}
+
+/* Finds addr's entry in the source table, making one if need be (see
+   IRIS_SOURCES).  Entries with clients still connected are the last
+   to be given up. */
+struct source* source_get(const char *addr)
+{
+	struct source *s;
+	unsigned long bytes;
+	unsigned int i, gen;
+	size_t len = strlen(addr);
+	uintptr_t n;
+
+	if (!SOURCES && !(SOURCES = calloc(IRIS_SOURCES, sizeof(struct source))))
+		return NULL;
+	if (!SOURCE_INDEX && !(SOURCE_INDEX = hash_new(IRIS_SOURCES)))
+		return NULL;
+	if ((n = (uintptr_t)hash_get(SOURCE_INDEX, addr, len)) != 0)
+		return &SOURCES[n - 1];
+
+	if (NUM_SOURCES < IRIS_SOURCES) {
+		s = &SOURCES[NUM_SOURCES++];
+		bytes = 0;
+	} else {
+		for (s = &SOURCES[0], i = 1; i < IRIS_SOURCES; i++) {
+			if ((!SOURCES[i].clients && s->clients)
+			 || (!SOURCES[i].clients == !s->clients && SOURCES[i].bytes < s->bytes))
+				s = &SOURCES[i];
+		}
+		hash_del(SOURCE_INDEX, s->addr, strlen(s->addr));
+		SOURCES_EVICTED++;
+		bytes = s->bytes;
+	}
+
+	gen = s->gen;
+	memset(s, 0, sizeof(struct source));
+	strncpy(s->addr, addr, IRIS_ADDRSTRLEN-1);
+	s->gen   = gen + 1;
+	s->bytes = s->error = bytes;
+	if (hash_set(SOURCE_INDEX, s->addr, len, (void*)(uintptr_t)(s - SOURCES + 1)) != 0)
+		return NULL; /* first in line to be reused */
+	return s;
+}
+
+/* c's entry in the source table.  If that has gone to somebody else
+   since c last looked, c moves in wherever its address lands now. */
+static struct source* client_source(struct client *c)
+{
+	struct source *s;
+
+	if (c->source >= 0 && SOURCES[c->source].gen == c->source_gen)
+		return &SOURCES[c->source];
+	if (!(s = source_get(c->addr)))
+		return NULL;
+	c->source     = s - SOURCES;
+	c->source_gen = s->gen;
+	s->clients++;
+	return s;
+}
+
+static void source_count(struct client *c, size_t bytes, int results, int bogus)
+{
+	struct source *s;
+
+	if (c->proto == IRIS_PROTO_ADMIN || !(s = client_source(c)))
+		return;
+	s->bytes   += bytes;
+	s->results += results;
+	s->bogus   += bogus;
+	s->last     = time(NULL);
+}
+
+/* Everyone in the source table who has sent a datagram (results and
+   bogus PDUs are in top-talkers, whichever way they came in). */
+void udp_stats(void)
+{
+	unsigned int i, n = 0;
+
+	for (i = 0; i < NUM_SOURCES; i++) {
+		if (!SOURCES[i].datagrams)
+			continue;
+		if (n++ == 0)
+			syslog(LOG_PROC, "udp: %u datagrams dropped by the kernel", UDP_DROPPED);
+		syslog(LOG_PROC, "udp: %s sent %lu datagrams", SOURCES[i].addr, SOURCES[i].datagrams);
+	}
+}
+
+static void recv_datagram(struct msghdr *msg, size_t len)
+{
+	struct pdu *pdu = (struct pdu*)msg->msg_iov[0].iov_base;
+	struct source *from;
+	struct cmsghdr *cm;
+	char addr[IRIS_ADDRSTRLEN];
+	int i;
+
+	for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+		if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL)
+			memcpy(&UDP_DROPPED, CMSG_DATA(cm), sizeof(UDP_DROPPED));
+	}
+
+	INGEST.bytes += len;
+	if ((from = source_get(net_ntop((struct sockaddr*)msg->msg_name, addr, sizeof(addr)))) != NULL) {
+		from->datagrams++;
+		from->bytes += len;
+		from->last   = time(NULL);
+	}
+
+	if (len == 0 || len % sizeof(struct pdu) != 0 || (msg->msg_flags & MSG_TRUNC)) {
+		syslog(LOG_WARN, "discarding truncated datagram (%lu bytes) from %s",
+				(unsigned long)len, addr);
+		INGEST.bogus_size++;
+		if (from)
+			from->bogus++;
+		return;
+	}
+
+	for (i = 0; i < len / sizeof(struct pdu); i++, pdu++) {
+		if (pdu_unpack(pdu) != 0) {
+			syslog(LOG_WARN, "discarding bogus packet from udp %s", addr);
+			if (from)
+				from->bogus++;
+			continue;
+		}
+
+		syslog(LOG_RESULT, "SERVICE RESULT %08x v%d [%d] %s/%s (rc:%d) '%s'",
+				pdu->crc32, pdu->version, (uint32_t)pdu->ts,
+				pdu->host, pdu->service, pdu->rc, pdu->output);
+		if (from)
+			from->results++;
+		submit(-1, pdu);
+	}
+}
+
+/* Reads every pending datagram off of a UDP listener, IRIS_UDP_BATCH
+   at a time.  The receive buffers are big (~4M), so they're only
+   allocated the first time through. */
+int recv_datagrams(int fd)
+{
+	static struct pdu *bufs = NULL;
+	struct mmsghdr msgs[IRIS_UDP_BATCH];
+	struct iovec iov[IRIS_UDP_BATCH];
+	struct sockaddr_storage from[IRIS_UDP_BATCH];
+	char control[IRIS_UDP_BATCH][CMSG_SPACE(sizeof(uint32_t))];
+	int i, n, l, total = 0, batches = 0;
+	time_t now;
+
+	if (!bufs && !(bufs = calloc(IRIS_UDP_BATCH * IRIS_UDP_MAX_PDUS, sizeof(struct pdu)))) {
+		syslog(LOG_ERROR, "failed to allocate UDP receive buffers: %s", strerror(errno));
+		return -1;
+	}
+
+	do {
+		memset(msgs, 0, sizeof(msgs));
+		for (i = 0; i < IRIS_UDP_BATCH; i++) {
+			iov[i].iov_base = bufs + i * IRIS_UDP_MAX_PDUS;
+			iov[i].iov_len  = IRIS_UDP_MAX_PDUS * sizeof(struct pdu);
+			msgs[i].msg_hdr.msg_name       = &from[i];
+			msgs[i].msg_hdr.msg_namelen    = sizeof(from[i]);
+			msgs[i].msg_hdr.msg_iov        = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen     = 1;
+			msgs[i].msg_hdr.msg_control    = control[i];
+			msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+		}
+
+		n = recvmmsg(fd, msgs, IRIS_UDP_BATCH, MSG_DONTWAIT, NULL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				n = IRIS_UDP_BATCH;
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				syslog(LOG_WARN, "recvmmsg failed: %s", strerror(errno));
+			break;
+		}
+
+		trace(IRIS_TRACE_READ, "read %d datagrams from fd %d", n, fd);
+		for (i = 0; i < n; i++)
+			recv_datagram(&msgs[i].msg_hdr, msgs[i].msg_len);
+		total += n;
+
+		if (n == IRIS_UDP_BATCH && ++batches >= IRIS_UDP_BUDGET
+		 && (l = listener_find(fd)) >= 0 && listener_ready(l) == 0)
+			break;
+
+	/* a short batch means the socket was drained */
+	} while (n == IRIS_UDP_BATCH);
+
+	time(&now);
+	if (now - UDP_STATS_AT >= IRIS_UDP_STATS) {
+		if (UDP_STATS_AT)
+			udp_stats();
+		UDP_STATS_AT = now;
+	}
+	return total;
+}
+
+int ready_push(int fd)
+{
+	if (READY_COUNT == READY_SIZE)
+		return -1;
+	READY[(READY_HEAD + READY_COUNT++) % READY_SIZE] = fd;
+	return 0;
+}
+
+int ready_pop(void)
+{
+	int fd;
+
+	if (READY_COUNT == 0)
+		return -1;
+	fd = READY[READY_HEAD];
+	READY_HEAD = (READY_HEAD + 1) % READY_SIZE;
+	READY_COUNT--;
+	return fd;
+}
+
+/* Does (at most) one budget's worth of work on fd, be it a listener
+   or a client.  Returns non-zero if the event loop should stop. */
+static int mainloop_service(int fd, uint32_t events, int sockfd, int epfd)
+{
+	struct client *c;
+	int l, n, connfd;
+	uint64_t v;
+
+	// CONTROL event (STOP is already set)
+	if (fd == CONTROL_FD) {
+		while (read(fd, &v, sizeof(v)) > 0)
+			;
+		return 0;
+	}
+
+	// RING event
+	l = listener_find(fd);
+	if (l >= 0 && LISTENERS[l].proto == IRIS_PROTO_SHM) {
+		trace(IRIS_TRACE_LOOP, "draining shared-memory ring %s", LISTENERS[l].ring->path);
+		shmring_consume(LISTENERS[l].ring);
+		return 0;
+	}
+
+	// CONFIG event
+	if (l >= 0 && LISTENERS[l].proto == IRIS_PROTO_CONF) {
+		config_changed(fd);
+		return 0;
+	}
+
+	// DATAGRAM event
+	if (l >= 0 && LISTENERS[l].proto == IRIS_PROTO_UDP) {
+		trace(IRIS_TRACE_LOOP, "processing datagrams on %d", fd);
+		recv_datagrams(fd);
+		return 0;
+	}
+
+	// CONNECT event
+	if (fd == sockfd || l >= 0) {
+		trace(IRIS_TRACE_LOOP, "processing inbound connection on %d", fd);
+		/* thanks to TCP_DEFER_ACCEPT, the PDU is usually already
+		   here, so there's no sense waiting on epoll to say so.  A
+		   connection that doesn't make it, or a client whose first
+		   read fails, is that one's problem; the listener is edge-
+		   triggered, so it's accept until EAGAIN, or come back later */
+		for (n = 0; n < IRIS_ACCEPT_BUDGET || l < 0; n++) {
+			if ((connfd = net_accept(fd, epfd)) < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					return 0;
+				continue;
+			}
+			iris_call_recv_data(connfd);
+		}
+		listener_ready(l);
+		return 0;
+	}
+
+	// WRITABLE event (admin clients with answers waiting)
+	if ((events & EPOLLOUT) && (c = client_find(fd)) != NULL && c->out) {
+		client_writable(c);
+		if (c->fd != fd)
+			return 0; /* all said, and hung up */
+	}
+	if ((events & (EPOLLOUT|EPOLLIN|EPOLLERR|EPOLLHUP)) == EPOLLOUT)
+		return 0;
+
+	// DATA event
+	if (events & EPOLLIN) {
+		trace(IRIS_TRACE_LOOP, "processing readable filehandle");
+		return iris_call_recv_data(fd);
+	}
+
+	syslog(LOG_INFO, "unhandled activity on %d: %04x =%s%s%s%s",
+			fd, events,
+			(events & EPOLLERR   ? " EPOLLERR"   : ""),
+			(events & EPOLLHUP   ? " EPOLLHUP"   : ""),
+			(events & EPOLLRDHUP ? " EPOLLRDHUP" : ""),
+			(events & EPOLLIN    ? " EPOLLIN"    : ""));
+	client_close(fd);
+	return 0;
+}
+
+/* stops taking new connections (and turns away anyone queued for a
+   slot), then puts every client on the ready list, so that each gets
+   read at least once more */
+static void drain_start(void)
+{
+	struct overflow *o;
+	struct client *c;
+	int i;
+
+	listeners_close(1);
+	while ((o = overflow_shift()) != NULL)
+		close(o->fd);
+
+	for (i = 0; i < CLIENTS_ALLOCATED; i++) {
+		c = client_at(i);
+		if (c->fd >= 0 && !(c->flags & IRIS_CLIENT_READY) && ready_push(c->fd) == 0)
+			c->flags |= IRIS_CLIENT_READY;
+	}
+	syslog(LOG_PROC, "draining %d clients (for up to %ds)", CLIENT_STATS.active, IRIS_DRAIN_GRACE);
+}
+
+/* hangs up on clients that have been read dry, between PDUs */
+static void drain_idle(void)
+{
+	struct client *c;
+	int i;
+
+	for (i = 0; i < CLIENTS_ALLOCATED; i++) {
+		c = client_at(i);
+		if (c->fd >= 0 && c->offset == 0 && !(c->flags & IRIS_CLIENT_READY))
+			client_close(c->fd);
+	}
+}
 
-	head = res;
-	do { // FIXME: test on multi-homed hosts
-		fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-		if (fd < 0) {
-			syslog(LOG_ERROR, "socket() call failed: %s", strerror(errno));
-			continue;
+void mainloop(int sockfd, int epfd)
+{
+	int i, l, n, fd, pending, timeout;
+	struct epoll_event events[IRIS_EPOLL_MAXFD];
+	struct client *c;
+	struct timespec now, until = { 0, 0 };
+
+	for (;;) {
+		if (STOP_ERRNO) {
+			syslog(LOG_WARN, "failed to wake the event loop: %s", strerror(STOP_ERRNO));
+			STOP_ERRNO = 0;
 		}
 
-		int on = 1;
-		if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
-			syslog(LOG_ERROR, "failed to set SO_REUSEADDR on socket: %s", strerror(errno));
-			close(fd);
-			fd = -1;
-			continue;
+		/* stopping only ever happens here, between trips around the
+		   loop, so that no edge-triggered event gets half-handled */
+		if (STOP == IRIS_STOP_DRAIN && !until.tv_sec) {
+			STOP = 0;
+			drain_start();
+			clock_gettime(CLOCK_MONOTONIC, &until);
+			until.tv_sec += IRIS_DRAIN_GRACE;
+
+		} else if (STOP) {
+			syslog(LOG_PROC, "event loop stopping (%d clients, %u on the ready list)",
+					CLIENT_STATS.active, READY_COUNT);
+			STOP = 0;
+			return;
 		}
 
-		if (bind(fd, res->ai_addr, res->ai_addrlen) == 0) {
-			// bound; stop trying addrinfo results!
-			break;
+		timeout = -1;
+		if (until.tv_sec) {
+			drain_idle();
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			timeout = (until.tv_sec - now.tv_sec) * 1000 + (until.tv_nsec - now.tv_nsec) / 1000000;
+			if (CLIENT_STATS.active == 0 || timeout <= 0) {
+				syslog(LOG_PROC, "event loop drained (%d clients still mid-PDU)",
+						CLIENT_STATS.active);
+				return;
+			}
 		}
 
-		close(fd);
-	} while ((res = res->ai_next) != NULL);
+		trace(IRIS_TRACE_LOOP, "going into epoll_wait loop");
+		/* don't sleep if anyone is still waiting on the ready list */
+		n = epoll_wait(epfd, events, IRIS_EPOLL_MAXFD, READY_COUNT ? 0 : timeout);
+		trace(IRIS_TRACE_LOOP, "epoll gave us %d fds to work with", n);
+		pending = READY_COUNT;
 
-	freeaddrinfo(head);
+		for (i = 0; i < n; i++) {
+			trace(IRIS_TRACE_LOOP, "activity on %d: %04x =%s%s%s%s",
+					events[i].data.fd, events[i].events,
+					(events[i].events & EPOLLERR   ? " EPOLLERR"   : ""),
+					(events[i].events & EPOLLHUP   ? " EPOLLHUP"   : ""),
+					(events[i].events & EPOLLRDHUP ? " EPOLLRDHUP" : ""),
+					(events[i].events & EPOLLIN    ? " EPOLLIN"    : ""));
+			if (mainloop_service(events[i].data.fd, events[i].events, sockfd, epfd) != 0) {
+				syslog(LOG_PROC, "event loop terminating (recv_data signalled an error)");
+				return;
+			}
+		}
 
-	if (nonblocking(fd) != 0) {
-		syslog(LOG_ERROR, "failed to set socket non-blocking: %s", strerror(errno));
-		close(fd);
-		return -1;
-	}
-	if (close_on_exec(fd) != 0) {
-		syslog(LOG_ERROR, "failed to set socket close-on-exec: %s", strerror(errno));
-		close(fd);
-		return -1;
-	}
-	if (listen(fd, SOMAXCONN) < 0) {
-		syslog(LOG_ERROR, "listen() call failed: %s", strerror(errno));
-		close(fd);
-		return -1;
-	}
+		/* then give everyone who used up their budget last time
+		   around another go, in the order they ran out */
+		for (; pending > 0; pending--) {
+			fd = ready_pop();
+			if ((l = listener_find(fd)) >= 0)
+				LISTENERS[l].queued = 0;
+			else if ((c = client_find(fd)) != NULL)
+				c->flags &= ~IRIS_CLIENT_READY;
+			else
+				continue; /* closed in the meantime */
 
-	iris_call_register_fd(fd);
-	return fd;
+			trace(IRIS_TRACE_LOOP, "revisiting fd %d from the ready list", fd);
+			if (mainloop_service(fd, EPOLLIN, sockfd, epfd) != 0) {
+				syslog(LOG_PROC, "event loop terminating (recv_data signalled an error)");
+				return;
+			}
+		}
+	}
 }
 
-int net_poller(int sockfd)
+/* Asks mainloop (on whichever thread it's running) to return, once
+   it's done with what epoll last gave it.  Safe to call before it has
+   even started, and from a signal handler: it only sets STOP and
+   writes to CONTROL_FD, and leaves any complaining to mainloop. */
+void mainloop_stop(int how)
 {
-	int epfd;
-	struct epoll_event ev;
-	memset(&ev, 0, sizeof(ev));
+	uint64_t one = 1;
+	int err = errno;
 
-	if ((epfd = epoll_create(42)) < 0) return -1;
+	STOP = how;
+	__sync_synchronize();
+	if (CONTROL_FD >= 0 && write(CONTROL_FD, &one, sizeof(one)) < 0)
+		STOP_ERRNO = errno;
+	errno = err;
+}
 
-	ev.data.fd = sockfd;
-	ev.events = EPOLLIN | EPOLLET;
-	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev) != 0) return -1;
-	return epfd;
+/* Everything the reactor needs to pick up where it left off, passed
+   from one copy of the module to the next over an Icinga reload.  It
+   all lives on the heap (or in the kernel) already, so it is just a
+   matter of pointers; the globals that held them go to the new copy.
+
+   The first few fields stay put from version to version, so that a
+   successor that can't use the rest can at least close the fds. */
+struct handoff {
+	uint32_t         magic;
+	uint32_t         size;
+	char             version[16];
+	int             *fds;
+	unsigned int     nfds;
+
+	int              sockfd;
+	int              epfd;
+	int              control;
+
+	struct client  **clients;
+	unsigned int     num_clients;
+	unsigned int     allocated;
+	void            *pdu_pool;
+	unsigned int     pdu_pool_size;
+	struct client_stats stats;
+
+	struct overflow *overflow;
+	unsigned int     overflow_head;
+	unsigned int     overflow_max;
+
+	struct listener  listeners[IRIS_MAX_LISTENERS];
+	unsigned int     num_listeners;
+
+	int             *ready;
+	unsigned int     ready_size;
+	unsigned int     ready_head;
+	unsigned int     ready_count;
+
+	uint32_t         udp_dropped;
+	time_t           udp_stats_at;
+
+	struct source   *sources;
+	unsigned int     num_sources;
+	unsigned long    sources_evicted;
+	struct hash     *source_index;
+	struct ingest_stats ingest;
+};
+
+static void handoff_fd(struct handoff *h, int fd)
+{
+	if (fd >= 0)
+		h->fds[h->nfds++] = fd;
 }
 
-int net_accept(int sockfd, int epfd)
+/* Packs up the (stopped) reactor and leaves it in the environment for
+   iris_adopt().  TLS sessions don't survive the trip (libssl may well
+   be unloaded along with us), so those clients are closed. */
+int iris_handoff(int sockfd, int epfd)
 {
-	struct sockaddr_in in_addr;
-	socklen_t in_len = sizeof(in_addr);
-	struct epoll_event ev = {0};
-	struct client *client;
-	int connfd;
-
-	clients_purge();
-	vdebug("accepting inbound connection");
-	if ((connfd = accept(sockfd, (struct sockaddr*)&in_addr, &in_len)) < 0) {
-		// EAGAIN / EWOULDBLOCK == no more pending connections
-		if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
-			vdebug("accept bailed with an EAGAIN, done accepting inbound connections");
-			return -1;
-		}
+	struct handoff *h;
+	struct client *c;
+	char addr[32];
+	int i, tls = 0;
 
-		syslog(LOG_WARN, "accept failed: %s", strerror(errno));
-		return -1;
+	for (i = 0; i < CLIENTS_ALLOCATED; i++) {
+		c = client_at(i);
+		if (c->fd >= 0 && c->tls) {
+			client_close(c->fd);
+			tls++;
+		}
 	}
+	if (tls)
+		syslog(LOG_PROC, "closed %d TLS clients for the handoff", tls);
 
-	if (nonblocking(connfd) < 0) {
-		syslog(LOG_ERROR, "failed to make new socket non-blocking: %s", strerror(errno));
-		vdebug("closing fd %d", connfd);
-		close(connfd);
-		return -1;
+	/* the next copy watches the config for itself; apply() is ours */
+	for (i = 0; i < NUM_LISTENERS; ) {
+		if (LISTENERS[i].proto != IRIS_PROTO_CONF) {
+			i++;
+			continue;
+		}
+		close(LISTENERS[i].fd);
+		memmove(&LISTENERS[i], &LISTENERS[i+1], (NUM_LISTENERS - i - 1) * sizeof(struct listener));
+		NUM_LISTENERS--;
 	}
+	config_unwatch();
+#ifdef HAVE_TLS
+	SSL_CTX_free(TLS_CTX);
+	TLS_CTX = NULL;
+#endif
 
-	ev.data.fd = connfd;
-	ev.events = EPOLLIN | EPOLLET;
-	if (epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev) != 0) {
-		syslog(LOG_ERROR, "failed to inform epoll about new socket fd: %s", strerror(errno));
-		vdebug("closing fd %d", connfd);
-		close(connfd);
+	if (!(h = calloc(1, sizeof(struct handoff)))
+	 || !(h->fds = calloc(CLIENTS_ALLOCATED + CLIENT_STATS.waiting + IRIS_MAX_LISTENERS + 2, sizeof(int)))) {
+		free(h);
 		return -1;
 	}
+	h->magic = IRIS_HANDOFF_MAGIC;
+	h->size  = sizeof(struct handoff);
+	strncpy(h->version, VERSION, sizeof(h->version) - 1);
 
-	if ((client = client_new(connfd, &(in_addr.sin_addr))) != NULL) {
-		vdebug("accepted inbound connection from %s, fd %d", client->addr, connfd);
-	}
-	return connfd;
-}
+	handoff_fd(h, epfd);
+	handoff_fd(h, CONTROL_FD);
+	for (i = 0; i < NUM_LISTENERS; i++)
+		handoff_fd(h, LISTENERS[i].fd);
+	for (i = 0; i < CLIENTS_ALLOCATED; i++)
+		handoff_fd(h, client_at(i)->fd);
+	for (i = 0; i < CLIENT_STATS.waiting; i++)
+		handoff_fd(h, OVERFLOW[(OVERFLOW_HEAD + i) % OVERFLOW_MAX].fd);
 
-int net_connect(const char *host, unsigned short port)
-{
-	struct sockaddr_in addr;
-	int fd;
+	h->sockfd  = sockfd;
+	h->epfd    = epfd;
+	h->control = CONTROL_FD;
 
-	memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_port   = htons(port); // LCOV_EXCL_LINE
+	h->clients       = CLIENTS;
+	h->num_clients   = NUM_CLIENTS;
+	h->allocated     = CLIENTS_ALLOCATED;
+	h->pdu_pool      = PDU_POOL;
+	h->pdu_pool_size = PDU_POOL_SIZE;
+	h->stats         = CLIENT_STATS;
+
+	h->overflow      = OVERFLOW;
+	h->overflow_head = OVERFLOW_HEAD;
+	h->overflow_max  = OVERFLOW_MAX;
+
+	memcpy(h->listeners, LISTENERS, sizeof(LISTENERS));
+	h->num_listeners = NUM_LISTENERS;
+
+	h->ready       = READY;
+	h->ready_size  = READY_SIZE;
+	h->ready_head  = READY_HEAD;
+	h->ready_count = READY_COUNT;
 
-	if (!inet_aton(host, &addr.sin_addr)) {
-		struct hostent *he;
-		if (!(he = gethostbyname(host))) return -1;
-		memcpy(&addr.sin_addr, he->h_addr, he->h_length);
+	h->udp_dropped     = UDP_DROPPED;
+	h->udp_stats_at    = UDP_STATS_AT;
+
+	h->sources         = SOURCES;
+	h->num_sources     = NUM_SOURCES;
+	h->sources_evicted = SOURCES_EVICTED;
+	h->source_index    = SOURCE_INDEX;
+	h->ingest          = INGEST;
+
+	snprintf(addr, sizeof(addr), "%p", (void*)h);
+	if (setenv(IRIS_HANDOFF_ENV, addr, 1) != 0) {
+		free(h->fds);
+		free(h);
+		return -1;
 	}
 
-	fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (fd < 0) return -1;
+	/* none of it is ours any more */
+	CLIENTS = NULL;
+	NUM_CLIENTS = CLIENTS_ALLOCATED = 0;
+	PDU_POOL = NULL;
+	PDU_POOL_SIZE = 0;
+	memset(&CLIENT_STATS, 0, sizeof(CLIENT_STATS));
+	OVERFLOW = NULL;
+	OVERFLOW_HEAD = 0;
+	OVERFLOW_EPFD = -1;
+	NUM_LISTENERS = NUM_PENDING = 0;
+	SOURCES = NULL;
+	SOURCE_INDEX = NULL;
+	NUM_SOURCES = 0;
+	READY = NULL;
+	READY_SIZE = READY_HEAD = READY_COUNT = 0;
+	CONTROL_FD = -1;
 
-	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) return -1;
-	return fd;
+	syslog(LOG_PROC, "handing off %u listeners, %d clients (%d waiting) and %u ready fds",
+			h->num_listeners, h->stats.active, h->stats.waiting, h->ready_count);
+	return 0;
 }
 
-int fd_sink(int fd)
+/* Takes over whatever iris_handoff() left behind, if anything: returns
+   0 if there was a reactor to adopt, 1 if there wasn't (bind afresh),
+   and -1 if there was but it was unusable. */
+int iris_adopt(const struct server *s, int *sockfd, int *epfd)
 {
-	char buf[512];
-	size_t n = 0;
-	while ((n = read(fd, buf, 512)) > 0)
-		;
-	return n;
-}
+	struct handoff *h = NULL;
+	const char *env;
+	unsigned int i;
 
-#define IRIS_CLI_MAX_LINE 5*1024
-int read_packets(FILE *io, struct pdu **result, const char *delim)
-{
-	if (!result) return -1;
+	if (!(env = getenv(IRIS_HANDOFF_ENV)))
+		return 1;
+	sscanf(env, "%p", (void**)&h);
+	unsetenv(IRIS_HANDOFF_ENV);
+	if (!h || h->magic != IRIS_HANDOFF_MAGIC)
+		return 1;
 
-	struct pdu *pdu, *list = NULL;
-	int i, n = 0;
-	char buf[IRIS_CLI_MAX_LINE], *str, c;
+	if (h->size != sizeof(struct handoff) || strcmp(h->version, VERSION) != 0) {
+		syslog(LOG_ERROR, "can't take over from iris v%.15s; closing its %u fds",
+				h->version, h->nfds);
+		for (i = 0; i < h->nfds; i++)
+			close(h->fds[i]);
+		free(h->fds);
+		free(h);
+		return -1;
+	}
 
-	while (!feof(io)) {
-		for (i = 0, c = getc(io);
-		     !feof(io) && c != '\x17' && i < IRIS_CLI_MAX_LINE;
-			 i++, c = getc(io)) {
-				buf[i] = c;
-		}
-		c = getc(io);
-		if (c > 0 && c != '\n') ungetc(c, io);
+	/* whatever client_init() set up for us, we have better */
+	free(CLIENTS);
+	free(OVERFLOW);
+	free(READY);
 
-		buf[i] = '\0';
-		strip(buf);
-		if (!*buf) continue;
+	CLIENTS           = h->clients;
+	NUM_CLIENTS       = h->num_clients;
+	CLIENTS_ALLOCATED = h->allocated;
+	PDU_POOL          = h->pdu_pool;
+	PDU_POOL_SIZE     = h->pdu_pool_size;
+	CLIENT_STATS      = h->stats;
 
-		// new packet!
-		struct pdu *re = realloc(list, (n+1) * sizeof(struct pdu));
-		if (!re) return -1;
-		pdu = (list = re)+n;
-		memset(pdu, 0, sizeof(struct pdu));
+	OVERFLOW      = h->overflow;
+	OVERFLOW_HEAD = h->overflow_head;
+	OVERFLOW_MAX  = h->overflow_max;
+	OVERFLOW_EPFD = h->epfd;
 
-		str = strtok(buf, delim);
-		if (!str) continue;
-		strncpy(pdu->host, str, IRIS_PDU_HOST_LEN-1);
+	memcpy(LISTENERS, h->listeners, sizeof(LISTENERS));
+	NUM_LISTENERS = h->num_listeners;
+	NUM_PENDING   = 0;
 
-		str = strtok(NULL, delim);
-		if (!str) continue;
-		strncpy(pdu->service, str, IRIS_PDU_SERVICE_LEN-1);
+	READY       = h->ready;
+	READY_SIZE  = h->ready_size;
+	READY_HEAD  = h->ready_head;
+	READY_COUNT = h->ready_count;
 
-		str = strtok(NULL, delim);
-		if (!str || !str[0] || str[1])    continue; // too short or too long...
-		if (str[0] < '0' || str[0] > '3') continue; // not 0-3
-		pdu->rc = str[0] - '0';
+	UDP_DROPPED     = h->udp_dropped;
+	UDP_STATS_AT    = h->udp_stats_at;
 
-		str = strtok(NULL, "\0");
-		if (!str) continue;
-		strncpy(pdu->output, str, IRIS_PDU_OUTPUT_LEN-1);
+	free(SOURCES);
+	hash_free(SOURCE_INDEX, NULL);
+	SOURCES         = h->sources;
+	NUM_SOURCES     = h->num_sources;
+	SOURCES_EVICTED = h->sources_evicted;
+	SOURCE_INDEX    = h->source_index;
+	INGEST          = h->ingest;
 
-		n++;
+	CONTROL_FD = h->control;
+	*sockfd    = h->sockfd;
+	*epfd      = h->epfd;
+
+	for (i = 0; i < NUM_LISTENERS; i++) {
+		if ((LISTENERS[i].flags & IRIS_CLIENT_TLS) && tls_init(s) != 0)
+			syslog(LOG_ERROR, "TLS listener fd %d will turn everyone away", LISTENERS[i].fd);
 	}
 
-	*result = list;
-	return n;
+	/* nothing was read in the meantime, so epoll is still holding on
+	   to every edge since; and the ready list came over with the rest */
+	syslog(LOG_PROC, "took over %u listeners, %d clients (%d waiting) and %u ready fds",
+			NUM_LISTENERS, CLIENT_STATS.active, CLIENT_STATS.waiting, READY_COUNT);
+	free(h->fds);
+	free(h);
+	return 0;
 }
 
-void mainloop(int sockfd, int epfd)
+/* for telling a bogus packet from a buffer that's all padding */
+static int first_nonzero(const void *buf, size_t len)
 {
-	int i, n;
-	struct epoll_event events[IRIS_EPOLL_MAXFD];
-
-	for (;;) {
-		vdebug("going into epoll_wait loop");
-		n = epoll_wait(epfd, events, IRIS_EPOLL_MAXFD, -1);
-		vdebug("epoll gave us %d fds to work with", n);
-
-		for (i = 0; i < n; i++) {
-#ifdef DEBUG
-			vdebug("activity on %d: %04x =%s%s%s%s",
-					events[i].data.fd, events[i].events,
-					(events[i].events & EPOLLERR   ? " EPOLLERR"   : ""),
-					(events[i].events & EPOLLHUP   ? " EPOLLHUP"   : ""),
-					(events[i].events & EPOLLRDHUP ? " EPOLLRDHUP" : ""),
-					(events[i].events & EPOLLIN    ? " EPOLLIN"    : ""));
-#endif
-
-			// CONNECT event
-			if (events[i].data.fd == sockfd) {
-				vdebug("processing inbound connection on %d", sockfd);
-				while (net_accept(sockfd, epfd) >= 0)
-					;
-				continue;
-			}
-
-			// DATA event
-			if (events[i].events & EPOLLIN) {
-				vdebug("processing readable filehandle");
-				if (iris_call_recv_data(events[i].data.fd) != 0) {
-					syslog(LOG_PROC, "event loop terminating (recv_data signalled an error)");
-					return;
-				}
-				continue;
-			}
+	const uint8_t *byte = buf;
+	size_t off;
 
-			syslog(LOG_INFO, "unhandled activity on %d: %04x =%s%s%s%s",
-					events[i].data.fd, events[i].events,
-					(events[i].events & EPOLLERR   ? " EPOLLERR"   : ""),
-					(events[i].events & EPOLLHUP   ? " EPOLLHUP"   : ""),
-					(events[i].events & EPOLLRDHUP ? " EPOLLRDHUP" : ""),
-					(events[i].events & EPOLLIN    ? " EPOLLIN"    : ""));
-			client_close(events[i].data.fd);
-		}
-	}
+	for (off = 0; off < len && byte[off] == '\0'; off++)
+		;
+	return off;
 }
 
 int recv_data(int fd)
 {
 	struct client *c;
 	ssize_t len;
+	int n = 0, rc;
 
 	c = client_find(fd);
 	if (!c) {
-#ifdef DEBUG
-		syslog(LOG_WARN, "could not find a client session for fd %d", fd);
-		int i;
-		for (i = 0; i < NUM_CLIENTS; i++) {
-			if (CLIENTS[i].fd == -1) continue;
-			syslog(LOG_WARN, " client[%d] fd = %d // %s", i,
-					CLIENTS[i].fd, CLIENTS[i].addr);
+		if (tracing(IRIS_TRACE_CLIENT)) {
+			trace_emit("could not find a client session for fd %d", fd);
+			for (n = 0; n < CLIENTS_ALLOCATED; n++) {
+				if (client_at(n)->fd == -1) continue;
+				trace_emit(" client[%d] fd = %d // %s", n,
+						client_at(n)->fd, client_at(n)->addr);
+			}
 		}
-#endif
 		return 0;
 	}
 
-	vdebug("reading from %s, fd %d", c->addr, fd);
+	if (c->proto == IRIS_PROTO_CMD || c->proto == IRIS_PROTO_ADMIN)
+		return recv_commands(c);
+	if (c->tls && !tls_established(c) && tls_handshake(c) != 0)
+		return 0;
+	if (client_buffer(c) != 0)
+		return 0;
+
+	ctrace(c, IRIS_TRACE_READ, "reading from %s, fd %d", c->addr, fd);
 	for (;;) {
-		vdebug("IRIS >> fd(%d): have %d bytes, want %lu total for %s",
-				fd, c->offset, sizeof(c->pdu), c->addr);
+		ctrace(c, IRIS_TRACE_READ, "IRIS >> fd(%d): have %d bytes, want %lu total for %s",
+				fd, c->offset, sizeof(struct pdu), c->addr);
 
-		len = pdu_read(fd, (uint8_t*)(&c->pdu), c->offset);
+		len = client_read(c);
 		if (len <= 0) {
-			if (errno == EAGAIN) return 0;
-			if (len == 0)
-				vdebug("EOF from %s, fd %d", c->addr, fd);
-			else
+			if (errno == EAGAIN) {
+				client_unbuffer(c);
+				client_acked(c);
+				return 0;
+			}
+			if (len == 0) {
+				ctrace(c, IRIS_TRACE_READ, "EOF from %s, fd %d", c->addr, fd);
+				if (client_acked(c) != 0)
+					break;
+			} else
 				syslog(LOG_INFO, "failed to read from %s: %s",
 						c->addr, strerror(errno));
 
@@ -613,98 +4435,298 @@ int recv_data(int fd)
 
 		c->offset += len;
 		c->bytes += len;
-		vdebug("IRIS >> fd(%d): read %lu (for %d total) from %s",
+		client_heard(c);
+		INGEST.bytes += len;
+		source_count(c, len, 0, 0);
+		ctrace(c, IRIS_TRACE_READ, "IRIS >> fd(%d): read %lu (for %d total) from %s",
 				fd, len, c->offset, c->addr);
 
-		if (c->offset < sizeof(c->pdu)) {
-			vdebug("Read a partial PDU (%d/%lu bytes) from %s, fd %d",
-					c->offset, sizeof(c->pdu), c->addr, fd);
+		if (c->offset < sizeof(struct pdu)) {
+			ctrace(c, IRIS_TRACE_READ, "Read a partial PDU (%d/%lu bytes) from %s, fd %d",
+					c->offset, sizeof(struct pdu), c->addr, fd);
 			continue;
 		}
 
 		c->offset = 0;
-		if (pdu_unpack(&c->pdu) != 0) {
+		c->seq++;
+		if ((c->flags & IRIS_CLIENT_TRUSTED ? pdu_unpack_trusted(c->pdu)
+		                                    : pdu_unpack(c->pdu)) != 0) {
 			syslog(LOG_WARN, "discarding bogus packet from %s, fd %d", c->addr, fd);
-#ifdef DEBUG
-			uint8_t *byte = ((uint8_t*)(&c->pdu));
-			int off = 0;
-			for (off = 0; off < sizeof(c->pdu) && *(byte+off) == '\0'; off++)
-				;
-			vdebug("first non-null byte in %s recv buffer is at position %d\n", c->addr, off);
-#endif
-			memset(&c->pdu, 0, sizeof(c->pdu));
+			source_count(c, 0, 0, 1);
+			if ((c->flags & IRIS_CLIENT_ACK)
+			 && client_ack(c, IRIS_ACK_REJECTED, IRIS_ACK_BOGUS) != 0)
+				return 0;
+			ctrace(c, IRIS_TRACE_PDU, "first non-null byte in %s recv buffer is at position %d",
+					c->addr, first_nonzero(c->pdu, sizeof(struct pdu)));
+			memset(c->pdu, 0, sizeof(struct pdu));
 			continue;
 		}
 
 		syslog(LOG_RESULT, "SERVICE RESULT %08x v%d [%d] %s/%s (rc:%d) '%s'",
-				c->pdu.crc32, c->pdu.version, (uint32_t)c->pdu.ts,
-				c->pdu.host, c->pdu.service, c->pdu.rc, c->pdu.output);
+				c->pdu->crc32, c->pdu->version, (uint32_t)c->pdu->ts,
+				c->pdu->host, c->pdu->service, c->pdu->rc, c->pdu->output);
 
-		iris_call_submit_result(&c->pdu);
-		memset(&c->pdu, 0, sizeof(c->pdu));
+		source_count(c, 0, 1, 0);
+		rc = submit(c->fd, c->pdu);
+		memset(c->pdu, 0, sizeof(struct pdu));
+		if (rc != IRIS_ACK_OK && (c->flags & IRIS_CLIENT_ACK)
+		 && client_ack(c, IRIS_ACK_REJECTED, rc) != 0)
+			return 0;
+
+		if (++n >= IRIS_PDU_BUDGET && client_ready(c) == 0) {
+			client_unbuffer(c);
+			client_acked(c);
+			return 0;
+		}
 	}
 	return 0;
 }
 
 int client_init(int n)
 {
-	CLIENTS = calloc(n, sizeof(struct client));
+	CLIENTS = calloc((n + IRIS_CLIENT_CHUNK - 1) / IRIS_CLIENT_CHUNK, sizeof(struct client*));
 	if (!CLIENTS) {
-		vdebug("client_init() malloc(%d * client) failed: %s", n, strerror(errno));
+		trace(IRIS_TRACE_CLIENT, "client_init() malloc(%d * client) failed: %s", n, strerror(errno));
 		return -1;
 	}
 	NUM_CLIENTS = n;
-	for (n = 0; n < NUM_CLIENTS; n++) {
-		CLIENTS[n].fd = -1;
-	}
+	CLIENTS_ALLOCATED = 0;
+
+	CLIENT_STATS.active = CLIENT_STATS.waiting = CLIENT_STATS.allocated = 0;
+	free(OVERFLOW);
+	OVERFLOW_HEAD = 0;
+	OVERFLOW = OVERFLOW_MAX ? calloc(OVERFLOW_MAX, sizeof(struct overflow)) : NULL;
+
+	free(READY);
+	READY_HEAD = READY_COUNT = 0;
+	READY_SIZE = NUM_CLIENTS + IRIS_MAX_LISTENERS;
+	if (!(READY = calloc(READY_SIZE, sizeof(int))))
+		READY_SIZE = 0; /* no budgets, then; everyone reads to EAGAIN */
 	return NUM_CLIENTS;
 }
 
 void client_deinit(void)
 {
+	struct overflow *o;
+	struct client *c;
+	void *buf;
 	int n;
-	for (n = 0; n < NUM_CLIENTS; n++) {
-		if (CLIENTS[n].fd >= 0) {
-			vdebug("closing connected client fd %d", CLIENTS[n].fd);
-			close(CLIENTS[n].fd);
+
+	/* nobody waiting gets a slot as the others are closed */
+	while ((o = overflow_shift()) != NULL)
+		close(o->fd);
+	for (n = 0; n < CLIENTS_ALLOCATED; n++) {
+		c = client_at(n);
+		if (c->fd >= 0) {
+			ctrace(c, IRIS_TRACE_CLIENT, "closing connected client fd %d", c->fd);
+			client_close(c->fd);
 		}
 	}
-	// FIXME: don't free CLIENTS yet, we need ITM-2357
-	//free(CLIENTS);
+
+	for (n = 0; n * IRIS_CLIENT_CHUNK < CLIENTS_ALLOCATED; n++)
+		free(CLIENTS[n]);
+	free(CLIENTS);
+	CLIENTS = NULL;
+	NUM_CLIENTS = CLIENTS_ALLOCATED = 0;
+
+	while ((buf = PDU_POOL) != NULL) {
+		PDU_POOL = *(void**)buf;
+		free(buf);
+	}
+	PDU_POOL_SIZE = 0;
+
+	free(OVERFLOW);
+	OVERFLOW = NULL;
+	OVERFLOW_HEAD = 0;
+	free(READY);
+	READY = NULL;
+	READY_SIZE = READY_HEAD = READY_COUNT = 0;
+	CLIENT_STATS.allocated = CLIENT_STATS.buffers = 0;
+
+	free(SOURCES);
+	SOURCES = NULL;
+	NUM_SOURCES = 0;
+	hash_free(SOURCE_INDEX, NULL);
+	SOURCE_INDEX = NULL;
 }
 
-struct client* client_find(int fd)
+/* max_clients, at runtime: the chunk table (and the ready list) only
+   ever grow; going down just means fewer slots get handed out, and
+   nobody already connected gets dropped */
+static int clients_resize(unsigned int n)
+{
+	struct client **table;
+	unsigned int have = (CLIENTS_ALLOCATED + IRIS_CLIENT_CHUNK - 1) / IRIS_CLIENT_CHUNK,
+	             want = (n + IRIS_CLIENT_CHUNK - 1) / IRIS_CLIENT_CHUNK, i;
+	int *ready;
+
+	if (want < have)
+		want = have;
+	if (!(table = realloc(CLIENTS, (want ? want : 1) * sizeof(struct client*))))
+		return -1;
+	memset(table + have, 0, (want - have) * sizeof(struct client*));
+	CLIENTS = table;
+
+	if (n + IRIS_MAX_LISTENERS > READY_SIZE) {
+		if (!(ready = calloc(n + IRIS_MAX_LISTENERS, sizeof(int))))
+			return -1;
+		for (i = 0; i < READY_COUNT; i++)
+			ready[i] = READY[(READY_HEAD + i) % READY_SIZE];
+		free(READY);
+		READY = ready;
+		READY_SIZE = n + IRIS_MAX_LISTENERS;
+		READY_HEAD = 0;
+	}
+
+	NUM_CLIENTS = n;
+	return 0;
+}
+
+/* overflow_queue, at runtime: whoever has waited longest keeps their
+   place; anyone who no longer fits is hung up on */
+static int overflow_resize(unsigned int n)
+{
+	struct overflow *queue = NULL, *o;
+	unsigned int i = 0;
+
+	if (n && !(queue = calloc(n, sizeof(struct overflow))))
+		return -1;
+	while ((o = overflow_shift()) != NULL) {
+		if (i < n)
+			memcpy(&queue[i++], o, sizeof(struct overflow));
+		else
+			close(o->fd);
+	}
+	free(OVERFLOW);
+	OVERFLOW = queue;
+	OVERFLOW_HEAD = 0;
+	OVERFLOW_MAX = n;
+	CLIENT_STATS.waiting = i;
+	return 0;
+}
+
+/* Puts the settings that can change at runtime into effect: once at
+   startup (before client_init), and again whenever the config is
+   reloaded, on the reactor thread, between events */
+void server_apply(const struct server *s)
 {
 	int i;
-	for (i = 0; i < NUM_CLIENTS; i++) {
-		if (CLIENTS[i].fd == fd)
-			return &CLIENTS[i];
+
+	MAX_LIFETIME    = s->max_lifetime;
+	OVERFLOW_POLICY = s->overflow_policy;
+
+	if (trace_scope(s->trace_from, s->num_trace_from) != 0)
+		syslog(LOG_ERROR, "bad trace_from address; keeping the old trace scope");
+	trace_set(s->trace);
+
+	if (LISTEN_BACKLOG != s->listen_backlog) {
+		LISTEN_BACKLOG = s->listen_backlog;
+		for (i = 0; i < NUM_LISTENERS; i++) {
+			if (LISTENERS[i].proto != IRIS_PROTO_PDU && LISTENERS[i].proto != IRIS_PROTO_CMD)
+				continue;
+			if (listen(LISTENERS[i].fd, LISTEN_BACKLOG) != 0)
+				syslog(LOG_WARN, "failed to change the backlog on fd %d: %s",
+						LISTENERS[i].fd, strerror(errno));
+		}
+	}
+
+	if (!CLIENTS) {
+		OVERFLOW_MAX = s->overflow_queue;
+		return;
+	}
+	if (s->overflow_queue != OVERFLOW_MAX && overflow_resize(s->overflow_queue) != 0)
+		syslog(LOG_ERROR, "failed to resize the overflow queue to %u: %s",
+				s->overflow_queue, strerror(errno));
+	if (s->max_clients != NUM_CLIENTS && clients_resize(s->max_clients) != 0)
+		syslog(LOG_ERROR, "failed to resize the client table to %u: %s",
+				s->max_clients, strerror(errno));
+}
+
+struct client* client_at(unsigned int i)
+{
+	if (i >= CLIENTS_ALLOCATED)
+		return NULL;
+	return &CLIENTS[i / IRIS_CLIENT_CHUNK][i % IRIS_CLIENT_CHUNK];
+}
+
+struct client* client_find(int fd)
+{
+	struct client *chunk;
+	int i, j, n;
+	for (i = 0; i * IRIS_CLIENT_CHUNK < CLIENTS_ALLOCATED; i++) {
+		chunk = CLIENTS[i];
+		n = CLIENTS_ALLOCATED - i * IRIS_CLIENT_CHUNK;
+		if (n > IRIS_CLIENT_CHUNK)
+			n = IRIS_CLIENT_CHUNK;
+		for (j = 0; j < n; j++) {
+			if (chunk[j].fd == fd)
+				return &chunk[j];
+		}
 	}
 	return NULL;
 }
 
-struct client* client_new(int fd, void *ip)
+/* Adds free slots to the table, up to a chunk's worth at a time; the
+   last chunk may only be partly in use (so as not to go over
+   max_clients), and is filled up first if max_clients goes up */
+static struct client* clients_grow(void)
+{
+	struct client *chunk;
+	unsigned int i, n, at = CLIENTS_ALLOCATED % IRIS_CLIENT_CHUNK;
+
+	if (NUM_CLIENTS <= CLIENTS_ALLOCATED)
+		return NULL;
+	n = NUM_CLIENTS - CLIENTS_ALLOCATED;
+	if (n > IRIS_CLIENT_CHUNK - at)
+		n = IRIS_CLIENT_CHUNK - at;
+
+	if (at) {
+		chunk = CLIENTS[CLIENTS_ALLOCATED / IRIS_CLIENT_CHUNK];
+	} else if (!(chunk = calloc(IRIS_CLIENT_CHUNK, sizeof(struct client)))) {
+		syslog(LOG_ERROR, "failed to grow the client table: %s", strerror(errno));
+		return NULL;
+	}
+	for (i = at; i < at + n; i++)
+		chunk[i].fd = -1;
+
+	CLIENTS[CLIENTS_ALLOCATED / IRIS_CLIENT_CHUNK] = chunk;
+	CLIENTS_ALLOCATED += n;
+	CLIENT_STATS.allocated = CLIENTS_ALLOCATED;
+	trace(IRIS_TRACE_CLIENT, "client table grown to %u/%u slots", CLIENTS_ALLOCATED, NUM_CLIENTS);
+	return &chunk[at];
+}
+
+struct client* client_new(int fd, const struct sockaddr *peer)
 {
 	struct client *c = client_find(-1);
+	if (!c)
+		c = clients_grow();
 	if (!c) {
-		vdebug("client_new() failed to find a free slot.  Perhaps you need to adjust max_clients");
+		trace(IRIS_TRACE_CLIENT, "client_new() failed to find a free slot.  Perhaps you need to adjust max_clients");
 		return NULL;
 	}
 
-	if (ip)
-		inet_ntop(AF_INET, ip, c->addr, sizeof(c->addr));
-	else
-		strcpy(c->addr, "<unknown-peer>");
+	net_ntop(peer, c->addr, sizeof(c->addr));
+	if (++CLIENT_STATS.active > CLIENT_STATS.peak)
+		CLIENT_STATS.peak = CLIENT_STATS.active;
 
 	c->fd = fd;
+	c->proto = IRIS_PROTO_PDU;
+	c->flags = trace_match(c->addr) ? IRIS_CLIENT_TRACED : 0;
 	c->offset = 0;
 	c->bytes = 0;
-	memset(&c->pdu, 0, sizeof(struct pdu));
+	c->seq = c->acked = 0;
+	c->pdu = NULL;
+	c->tls = NULL;
+	c->out = NULL;
+	c->outlen = 0;
+	c->source = -1;
 	clock_gettime(CLOCK_MONOTONIC, &c->deadline);
+	c->since = c->last = c->deadline.tv_sec;
 	c->deadline.tv_sec += MAX_LIFETIME;
 
-	vdebug("client %d // %s session starting", fd, c->addr);
-	vdebug("client %d {fd: '%d', offset: '%d', addr: '%s', pdu: <ignored>'}",
+	ctrace(c, IRIS_TRACE_CLIENT, "client %d // %s session starting", fd, c->addr);
+	ctrace(c, IRIS_TRACE_CLIENT, "client %d {fd: '%d', offset: '%d', addr: '%s', pdu: <ignored>'}",
 			fd, c->fd, c->offset, c->addr);
 
 	return c;
@@ -713,11 +4735,29 @@ struct client* client_new(int fd, void *ip)
 void client_close(int fd)
 {
 	struct client *c = client_find(fd);
+	struct overflow *o;
 	if (c) {
-		vdebug("client %d // %s session ending (sent %lu bytes)", fd, c->addr, c->bytes);
-		vdebug("closing connection from %s, fd %d", c->addr, fd);
+		ctrace(c, IRIS_TRACE_CLIENT, "client %d // %s session ending (sent %lu bytes)", fd, c->addr, c->bytes);
+		ctrace(c, IRIS_TRACE_CLIENT, "closing connection from %s, fd %d", c->addr, fd);
+		IRIS_PROBE3(close, fd, c->bytes, c->seq);
+		if (c->tls)
+			tls_close(c);
 		c->fd = -1;
 		close(fd);
+		CLIENT_STATS.active--;
+		if (c->source >= 0 && SOURCES[c->source].gen == c->source_gen)
+			SOURCES[c->source].clients--;
+		if (c->pdu) {
+			pdu_free(c->pdu);
+			c->pdu = NULL;
+		}
+		free(c->out);
+		c->out = NULL;
+		c->outlen = 0;
+
+		/* hand the slot to whoever has been waiting longest */
+		if ((o = overflow_shift()) != NULL)
+			client_admit(o->fd, o->listener, &o->peer, OVERFLOW_EPFD);
 	}
 }
 
@@ -735,16 +4775,42 @@ const char *client_addr(int fd)
 void clients_purge(void)
 {
 	struct timespec now;
+	struct client *c;
 	int i;
 
 	clock_gettime(CLOCK_MONOTONIC, &now);
-	for (i = 0; i < NUM_CLIENTS; i++) {
-		if (CLIENTS[i].fd >= 0 && past_deadline(now, CLIENTS[i].deadline)) {
-			vdebug("client %d // %s is past deadline of %i.%i (now = %i.%i)",
-					CLIENTS[i].fd, CLIENTS[i].addr,
-					(int)CLIENTS[i].deadline.tv_sec, (int)CLIENTS[i].deadline.tv_nsec,
+	for (i = 0; i < CLIENTS_ALLOCATED; i++) {
+		c = client_at(i);
+		if (c->fd >= 0 && past_deadline(now, c->deadline)) {
+			ctrace(c, IRIS_TRACE_CLIENT, "client %d // %s is past deadline of %i.%i (now = %i.%i)",
+					c->fd, c->addr,
+					(int)c->deadline.tv_sec, (int)c->deadline.tv_nsec,
 					(int)now.tv_sec, (int)now.tv_nsec);
-			client_close(CLIENTS[i].fd);
+			IRIS_PROBE2(purge, c->fd, (now.tv_sec - c->deadline.tv_sec) * 1000
+			                        + (now.tv_nsec - c->deadline.tv_nsec) / 1000000);
+			client_close(c->fd);
 		}
 	}
+
+	/* connections can't wait for a slot forever, either */
+	while (CLIENT_STATS.waiting > 0
+	    && OVERFLOW[OVERFLOW_HEAD].since + MAX_LIFETIME < now.tv_sec) {
+		trace(IRIS_TRACE_CLIENT, "giving up on queued connection, fd %d", OVERFLOW[OVERFLOW_HEAD].fd);
+		close(overflow_shift()->fd);
+		CLIENT_STATS.expired++;
+	}
+}
+
+void clients_stats(void)
+{
+	syslog(LOG_PROC, "clients: %u/%u slots in use (%u allocated, peak %u), %u waiting,"
+			" %u receive buffers; %lu accepted, %lu rejected, %lu queued, %lu evicted, %lu expired",
+			CLIENT_STATS.active, NUM_CLIENTS, CLIENT_STATS.allocated, CLIENT_STATS.peak,
+			CLIENT_STATS.waiting, CLIENT_STATS.buffers,
+			CLIENT_STATS.accepted, CLIENT_STATS.rejected, CLIENT_STATS.queued,
+			CLIENT_STATS.evicted, CLIENT_STATS.expired);
+	if (CLIENT_STATS.handshakes || CLIENT_STATS.tls_failed)
+		syslog(LOG_PROC, "clients: %lu TLS handshakes (%lu resumed, %lu kTLS), %lu failed",
+				CLIENT_STATS.handshakes, CLIENT_STATS.resumed, CLIENT_STATS.ktls,
+				CLIENT_STATS.tls_failed);
 }
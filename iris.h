@@ -1,4 +1,5 @@
 #ifndef IRIS_H
+#define IRIS_H
 
 #define VERSION "1.1.8"
 #define _GNU_SOURCE
@@ -10,6 +11,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <limits.h>
 #include <stdarg.h>
 
 #include <syslog.h>
@@ -24,12 +26,26 @@
 
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
 
+#include <poll.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
 
 #include <time.h>
 
+#ifdef HAVE_TLS
+#  include <openssl/ssl.h>
+#  include <openssl/err.h>
+#  include <openssl/pem.h>
+#endif
+
 /* Define EPOLLRDHUP ourselves, if the kernel didn't do it already.
    see http://sourceware.org/bugzilla/show_bug.cgi?id=5040 */
 #ifndef EPOLLRDHUP
@@ -37,6 +53,7 @@
 #endif
 
 #define IRIS_DEFAULT_CONFIG_FILE  "/etc/icinga/iris.conf"
+#define IRIS_DEFAULT_PORT         5668
 
 #define IRIS_PROTOCOL_VERSION         1
 
@@ -50,6 +67,148 @@
 
 #define IRIS_PDU_V1  1
 
+/* What a listener (and every client accepted from it) speaks */
+#define IRIS_PROTO_PDU  0  /* packed, CRC'd 4300-byte PDUs */
+#define IRIS_PROTO_CMD  1  /* PROCESS_*_CHECK_RESULT external command lines */
+#define IRIS_PROTO_SHM  2  /* not a listener at all; a shared-memory ring's wakeup FIFO */
+#define IRIS_PROTO_UDP  3  /* datagrams of one or more packed PDUs; no clients */
+#define IRIS_PROTO_CONF 4  /* not a listener either; inotify, watching iris.conf */
+#define IRIS_PROTO_ADMIN 5 /* admin_unix: one command per line, answers end with "." */
+
+#define IRIS_MAX_LISTENERS  16
+
+/* trace categories (see trace, below) */
+#define IRIS_TRACE_LOOP    0x01  /* mainloop, epoll, the ready list */
+#define IRIS_TRACE_NET     0x02  /* accepting, binding, connecting */
+#define IRIS_TRACE_CLIENT  0x04  /* client sessions, slots, overflow */
+#define IRIS_TRACE_READ    0x08  /* reads, partial PDUs, commands */
+#define IRIS_TRACE_PDU     0x10  /* bad CRCs, bogus packets */
+#define IRIS_TRACE_TLS     0x20  /* handshakes and records */
+#define IRIS_TRACE_SINK    0x40  /* sinks, relay, spool */
+#define IRIS_TRACE_ICINGA  0x80  /* the broker's side of things */
+#define IRIS_TRACE_ALL     0xff
+
+#define IRIS_TRACE_RING    1024  /* lines waiting for syslog */
+#define IRIS_TRACE_LINE     256  /* bytes per line, NUL included */
+#define IRIS_TRACE_SCOPES     8  /* trace_from addresses */
+
+/* Seconds the kernel may sit on a new connection that hasn't sent
+   anything yet, before waking us up for it (TCP_DEFER_ACCEPT) */
+#define IRIS_DEFER_ACCEPT  5
+
+/* Room for any peer address we print: IPv6, IPv4, or <unknown-peer> */
+#define IRIS_ADDRSTRLEN  INET6_ADDRSTRLEN
+
+#define IRIS_CLIENT_DISCARD  0x01  /* skipping the rest of an overlong line */
+#define IRIS_CLIENT_TRUSTED  0x02  /* local peer; don't bother checking CRCs */
+#define IRIS_CLIENT_READY    0x04  /* on the ready list; more to read */
+#define IRIS_CLIENT_ACK      0x08  /* wants ack frames back (see ack_port) */
+#define IRIS_CLIENT_TLS      0x10  /* talks TLS (see tls_port) */
+#define IRIS_CLIENT_KTLS     0x20  /* ... but the kernel is decrypting it */
+#define IRIS_CLIENT_TRACED   0x40  /* in trace scope (see trace_from) */
+#define IRIS_CLIENT_HANGUP   0x80  /* gone quiet; close once out is written */
+
+/* the most an admin client can have waiting to be written to it */
+#define IRIS_ADMIN_OUTPUT  (4 * 1024 * 1024)
+
+/* `top-hosts' counts results per host (a hash lookup each) only for
+   IRIS_TOP_HOSTS_TIME seconds after someone last asked, and only for
+   the first IRIS_TOP_HOSTS hosts it sees. */
+#define IRIS_TOP_HOSTS       4096
+#define IRIS_TOP_HOSTS_TIME    60
+
+/* What to do with a new connection when every client slot is taken */
+#define IRIS_OVERFLOW_REJECT  0  /* close it straight away */
+#define IRIS_OVERFLOW_QUEUE   1  /* park it (unread) until a slot frees up */
+#define IRIS_OVERFLOW_EVICT   2  /* close the oldest idle client to make room */
+
+/* Seconds between client table / slot pressure reports */
+#define IRIS_STATS_INTERVAL  60
+
+/* How much one fd gets to do per trip around mainloop, before it is
+   put on the ready list to wait its turn behind everyone else: */
+#define IRIS_ACCEPT_BUDGET  64  /* connections accepted, per listener */
+#define IRIS_PDU_BUDGET     32  /* PDUs (or commands) read, per client */
+#define IRIS_UDP_BUDGET      4  /* recvmmsg batches, per UDP listener */
+
+/* mainloop_stop() reasons; IRIS_STOP_PAUSE leaves everything (fds,
+   clients, half-read PDUs) in place, for iris_handoff() to pass on.
+   IRIS_STOP_DRAIN closes the listeners, reads what clients have
+   already sent, and gives anyone caught mid-PDU IRIS_DRAIN_GRACE
+   seconds to finish it, before returning. */
+#define IRIS_STOP_PAUSE   1
+#define IRIS_STOP_DRAIN   2
+#define IRIS_DRAIN_GRACE  5
+
+/* Across an Icinga reload, the outgoing copy of the module leaves the
+   address of a struct handoff in the environment for the incoming one */
+#define IRIS_HANDOFF_ENV    "IRIS_HANDOFF"
+#define IRIS_HANDOFF_MAGIC  0x49524948  /* "IRIH" */
+
+/* send_iris / relay hosts of the form unix:/path are Unix sockets */
+#define IRIS_UNIX_PREFIX  "unix:"
+
+/* Shared-memory rings are a header page followed by a power-of-two
+   number of slots; the wakeup FIFO lives next to the ring file. */
+#define IRIS_SHM_MAGIC    0x49524953  /* "IRIS" */
+#define IRIS_SHM_VERSION  1
+#define IRIS_SHM_SLOTS    4096
+#define IRIS_SHM_WAKE     ".wake"
+
+/* UDP datagrams are read IRIS_UDP_BATCH at a time (via recvmmsg), and
+   can each carry up to IRIS_UDP_MAX_PDUS (15 * 4300 fits in 64k).
+   Senders are counted in the source table (see struct source), and
+   logged every IRIS_UDP_STATS s. */
+#define IRIS_UDP_BATCH      64
+#define IRIS_UDP_MAX_PDUS   15
+#define IRIS_UDP_STATS     300
+
+/* Enough receive buffer for a whole batch of full datagrams */
+#define IRIS_UDP_RCVBUF  (IRIS_UDP_BATCH * IRIS_UDP_MAX_PDUS * 4300)
+
+/* Clients on the ack_port listener get ack frames written back to
+   them.  PDUs are numbered from 1 in the order they arrive on the
+   connection; after each read, iris sends ACCEPTED <seq> for the last
+   PDU it got, meaning "everything through <seq> has been dealt with",
+   preceded by a REJECTED <seq> frame for each one that was thrown out.
+   send_iris keeps up to IRIS_ACK_WINDOW results unacknowledged.
+
+   iris_call_submit_result() returns one of the reasons too: OK, or why
+   the result it was handed went no further. */
+#define IRIS_ACK_ACCEPTED  1
+#define IRIS_ACK_REJECTED  2
+
+#define IRIS_ACK_OK          0
+#define IRIS_ACK_BOGUS       1  /* bad CRC, or unknown protocol version */
+#define IRIS_ACK_QUEUE_FULL  2  /* no room for it (the sink's queue is full) */
+#define IRIS_ACK_UNKNOWN     3  /* a host / service Icinga doesn't know */
+
+#define IRIS_ACK_WINDOW   64
+
+struct ack {
+	uint16_t type;
+	uint16_t reason;
+	uint32_t seq;
+};
+
+/* Results for hosts / services Icinga doesn't know about (see
+   reject_unknown) are counted per host/service, for up to
+   IRIS_UNKNOWN_KEYS of them; the IRIS_UNKNOWN_TOP most frequent are
+   logged every IRIS_UNKNOWN_STATS seconds. */
+#define IRIS_UNKNOWN_KEYS   1024
+#define IRIS_UNKNOWN_TOP      10
+#define IRIS_UNKNOWN_STATS   300
+
+/* How many PDUs to move per read() / write() when replaying
+   a spool segment. */
+#define IRIS_SPOOL_BATCH  64
+
+/* A relay gives the upstream IRIS_RELAY_TIMEOUT seconds to accept a
+   connection (and as long for each write), and after a failure spools
+   for 1, 2, 4... up to IRIS_RELAY_BACKOFF seconds before trying again. */
+#define IRIS_RELAY_TIMEOUT   5
+#define IRIS_RELAY_BACKOFF  60
+
 #define LOG_ERROR  LOG_ERR
 #define LOG_WARN   LOG_WARNING
 #define LOG_PROC   LOG_INFO
@@ -67,64 +226,321 @@ struct pdu {
 
 struct server {
 	char     *port;
+	char     *listen[IRIS_MAX_LISTENERS];
+	int       num_listen;
+	char     *cmd_port;
+	char     *listen_unix;
+	char     *cmd_unix;
+	char     *admin_unix;
+	int       unix_skip_crc;
+	int       reject_unknown;
+	char     *udp_port;
+	char     *ack_port;
+	char     *tls_port;
+	char     *tls_cert;
+	char     *tls_key;
+	char     *listen_shm;
+	uint32_t  shm_slots;
 	uint8_t   timeout;
 	uint32_t  max_clients;
 	time_t    max_lifetime;
+	int       listen_backlog;
+	int       overflow_policy;
+	uint32_t  overflow_queue;
 
 	char     *syslog_ident;
 	char     *syslog_facility;
+
+	char     *sink;
+	char     *sink_path;
+	uint32_t  sink_queue;
+	uint32_t  sink_batch;
+	time_t    sink_flush;
+
+	char     *upstream;
+	time_t    upstream_lifetime;
+	char     *spool_dir;
+
+	uint32_t  trace;
+	char     *trace_from[IRIS_TRACE_SCOPES];
+	int       num_trace_from;
 };
 
+/* The client table grows IRIS_CLIENT_CHUNK slots at a time (up to
+   max_clients), and a client only holds on to a receive buffer while
+   it has part of a PDU (or command line) in it; at most IRIS_PDU_POOL
+   spare buffers are kept around for reuse. */
+#define IRIS_CLIENT_CHUNK  256
+#define IRIS_PDU_POOL       64
+
 struct client {
+	/* looked at on every scan / read */
 	int             fd;
 	int             offset;
-	char            addr[INET_ADDRSTRLEN];
-	struct pdu      pdu;
+	int             proto;
+	int             flags;
+	struct timespec deadline;
+
+	/* everything else */
+	struct pdu     *pdu;
 	size_t          bytes;
+	uint32_t        seq;
+	uint32_t        acked;
+	void           *tls;      /* SSL*, on tls_port */
+	time_t          since;    /* connected (CLOCK_MONOTONIC) */
+	time_t          last;     /* last read anything (CLOCK_MONOTONIC) */
+	int             source;   /* in the source table (see client_source) */
+	unsigned int    source_gen;
+	char           *out;      /* admin answers not yet written */
+	size_t          outlen;
+	char            addr[IRIS_ADDRSTRLEN];
+};
+
+/* A string-keyed (well, byte-string-keyed) hash table: open
+   addressing, linear probing, doubling once it's 3/4 full.  Keys are
+   copied in; values are the caller's business. */
+struct hash_entry {
+	char     *key;
+	size_t    len;
+	uint32_t  hash;
+	void     *value;
+};
+
+struct hash {
+	unsigned int       size;  /* slots, always a power of two */
+	unsigned int       count;
+	struct hash_entry *slots;
+};
+
+struct client_stats {
+	unsigned int  active;
+	unsigned int  peak;
+	unsigned int  waiting;
+	unsigned int  allocated; /* slots */
+	unsigned int  buffers;   /* receive buffers, in use or pooled */
+
+	unsigned long accepted;
+	unsigned long rejected;
+	unsigned long queued;
+	unsigned long evicted;
+	unsigned long expired;
+
+	unsigned long handshakes; /* TLS, completed */
+	unsigned long resumed;    /* ... of which were resumed sessions */
+	unsigned long ktls;       /* ... handed to the kernel to decrypt */
+	unsigned long tls_failed;
+};
+
+/* everything that came in, whichever way it came */
+struct ingest_stats {
+	unsigned long results;       /* handed on (to Icinga, or a sink) */
+	unsigned long bytes;
+	unsigned long bogus_crc;
+	unsigned long bogus_version;
+	unsigned long bogus_age;
+	unsigned long bogus_command; /* unparseable command lines */
+	unsigned long bogus_size;    /* UDP datagrams, short or truncated */
+};
+
+struct relay {
+	char           *host;
+	unsigned short  port;
+	int             fd;
+	time_t          lifetime;
 	struct timespec deadline;
+	time_t          retry;    /* no connecting again until then (monotonic) */
+	time_t          backoff;  /* how long the last wait was */
+
+	char           *spool;
+
+	int             n;
+	int             max;
+	struct pdu     *batch;
 };
 
-#ifdef DEBUG
-#define vdebug(...) syslog(LOG_DEBUG, __VA_ARGS__)
-#define vdump(pdu)  pdu_dump(pdu)
-#else
-#define vdebug(...)
-#define vdump(pdu)
-#endif
+/* The on-disk (well, in-tmpfs) layout of a shared-memory ring.
+
+   Producers claim a slot by bumping `head`, fill it in, and then
+   publish it by setting its `seq` to one past its position; iris
+   (the only consumer) waits for that, copies the PDU out, and hands
+   the slot back by advancing `seq` a full lap.  When iris
+   runs out of work it sets `sleeping`, and the next producer to
+   publish something clears it and writes a byte to the FIFO. */
+struct shm_slot {
+	uint64_t   seq;
+	struct pdu pdu;
+};
+
+struct shm_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	uint32_t sleeping;
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+/* Who's been sending what, by address, whichever way it came in (but
+   for shm, which has no address).  IRIS_SOURCES of them are kept; past
+   that, it's the space-saving algorithm (Metwally, Agrawal and El
+   Abbadi): a newcomer takes over the entry with the fewest bytes, and
+   inherits its byte count (as error, too, since it's an overestimate).
+   Anyone who has sent more than 1/IRIS_SOURCES of all the bytes is
+   guaranteed to be in there. */
+#define IRIS_SOURCES  1024
+
+struct source {
+	char          addr[IRIS_ADDRSTRLEN];
+	unsigned int  gen;        /* bumped every time the slot changes hands */
+	unsigned int  clients;    /* connected right now */
+	unsigned long connections;
+	unsigned long datagrams;  /* over UDP */
+	unsigned long results;
+	unsigned long bogus;
+	unsigned long bytes;      /* too high by up to error */
+	unsigned long error;
+	time_t        last;       /* last heard from */
+};
+
+struct shmring {
+	char              *path;
+	struct shm_header *hdr;
+	struct shm_slot   *slots;
+	size_t             size;
+	int                wakefd;
+	int                holdfd;
+};
+
+/* Trace points are always compiled in, and cost a load and a (well
+   predicted) branch each until their category is switched on, with
+   `trace' in iris.conf (it reloads) or trace_set().  Lines go into a
+   fixed-size ring that trace_emit never waits on, and a thread of
+   their own takes them from there to syslog (LOG_DEBUG); if the ring
+   is full, or busy, the line is dropped and counted instead.
+
+   With `trace_from' set, only ctrace points for clients from those
+   addresses fire; everything else stays quiet. */
+extern volatile uint32_t TRACE_MASK;   /* on for clients in scope */
+extern volatile uint32_t TRACE_GLOBAL; /* on for everything else */
+
+#define tracing(cat) __builtin_expect((TRACE_GLOBAL & (cat)) != 0, 0)
+#define trace(cat, ...) do { \
+	if (tracing(cat)) trace_emit(__VA_ARGS__); \
+} while (0)
+#define ctrace(c, cat, ...) do { \
+	if (__builtin_expect((TRACE_MASK & (cat)) != 0, 0) \
+	 && ((c)->flags & IRIS_CLIENT_TRACED)) trace_emit(__VA_ARGS__); \
+} while (0)
 
 void strip(char *s);
 unsigned long crc32(void *buf, int len);
+
+struct hash *hash_new(unsigned int n);
+void hash_free(struct hash *h, void (*destroy)(void *value));
+void *hash_get(const struct hash *h, const char *key, size_t len);
+int hash_set(struct hash *h, const char *key, size_t len, void *value);
+void *hash_del(struct hash *h, const char *key, size_t len);
+void hash_each(const struct hash *h,
+		void (*fn)(const char *key, size_t len, void *value, void *udata), void *udata);
+const char *intern(struct hash *h, const char *s, size_t len);
 int nonblocking(int fd);
+int log_facility(const char *name);
+size_t write_full(int fd, const uint8_t *buf, size_t len);
 
 int server_init(struct server *s);
+void server_free(struct server *s);
+int server_check(const struct server *s);
+void server_apply(const struct server *s);
 int parse_config_file(const char *file, struct server *s);
 int parse_config(FILE *io, struct server *s);
 
 ssize_t pdu_read(int fd, uint8_t *buf, size_t start);
 ssize_t pdu_write(int fd, const uint8_t *buf);
+int ack_read(int fd, struct ack *ack);
+const char *ack_reason(int reason);
 void pdu_dump(const struct pdu *pdu);
 
 int pdu_pack(struct pdu *pdu);
 int pdu_unpack(struct pdu *pdu);
+int pdu_unpack_trusted(struct pdu *pdu);
 
+const char *net_ntop(const struct sockaddr *sa, char *buf, size_t len);
 int net_bind(const char *host, const char *port);
+int net_bind_all(const char *spec, const char *port, int *fds, int max);
+int net_bind_server(const struct server *s);
+int net_bind_unix(const char *path, mode_t mode);
+int net_bind_udp(const char *host, const char *port);
 int net_poller(int sockfd);
+void net_close(int epfd);
+int config_watch(int epfd, const char *file, void (*apply)(const struct server *s));
+int config_reload(void);
 int net_accept(int sockfd, int epfd);
+int net_listener(int epfd, int fd, int proto, int flags);
+int net_listeners(const struct server *s, int epfd);
 
 int net_connect(const char *host, unsigned short port);
+int net_connect_timeout(const char *host, unsigned short port, int timeout);
+int net_connect_udp(const char *host, unsigned short port);
 int fd_sink(int fd);
 int read_packets(FILE *io, struct pdu **packets, const char *delim);
 
+int spool_write(const char *dir, struct pdu *packets, int n);
+int spool_replay(const char *dir, int fd, unsigned int rate);
+int spool_replay_via(const char *dir, int fd, unsigned int rate,
+		int (*send)(int fd, struct pdu *pdus, int n));
+
+int relay_init(struct relay *r, const char *upstream, int batch);
+int relay_submit(struct relay *r, const struct pdu *pdu);
+int relay_flush(struct relay *r);
+void relay_deinit(struct relay *r);
+
+struct shmring *shmring_create(const char *path, unsigned int slots);
+struct shmring *shmring_open(const char *path);
+int shmring_put(struct shmring *r, const struct pdu *pdu);
+int shmring_consume(struct shmring *r);
+void shmring_close(struct shmring *r);
+int net_shmring(int epfd, struct shmring *r);
+
+int cmd_parse(char *line, struct pdu *pdu);
+
+void trace_emit(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+int trace_parse(const char *list, uint32_t *mask);
+const char *trace_names(uint32_t mask, char *buf, size_t len);
+void trace_set(uint32_t mask);
+int trace_scope(char *const *addrs, int n);
+int trace_read(char *buf, size_t len);
+unsigned long trace_dropped(void);
+int trace_start(void);
+void trace_stop(void);
+
+void admin_stats_extra(void (*fn)(void));
+void admin_stat(const char *name, unsigned long value);
+char *admin_query(const char *sock, const char *cmds, int n);
+
 void mainloop(int sockfd, int epfd);
+void mainloop_stop(int how);
+int iris_handoff(int sockfd, int epfd);
+int iris_adopt(const struct server *s, int *sockfd, int *epfd);
 int recv_data(int fd);
+int recv_datagrams(int fd);
+
+struct source *source_get(const char *addr);
+void udp_stats(void);
+
+int ready_push(int fd);
+int ready_pop(void);
 
 int client_init(int n);
 void client_deinit(void);
 struct client *client_find(int fd);
-struct client *client_new(int fd, void *ip);
+struct client *client_at(unsigned int i);
+struct client *client_new(int fd, const struct sockaddr *peer);
 void client_close(int fd);
 const char *client_addr(int fd);
 
 void clients_purge(void);
+void clients_stats(void);
+
+int tls_init(const struct server *s);
 
 #endif
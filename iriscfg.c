@@ -1,7 +1,7 @@
 #include "iris.h"
 #include <getopt.h>
 // make iris.o happy
-void iris_call_submit_result(struct pdu *pdu) { }
+int iris_call_submit_result(struct pdu *pdu) { return 0; }
 int iris_call_recv_data(int fd) { return 0; }
 int iris_call_register_fd(int fd) { return 0; }
 
@@ -19,8 +19,9 @@ int main(int argc, char **argv)
 		{ 0, 0, 0, 0 }
 	};
 
-	int opt, idx = 0;
+	int opt, idx = 0, i;
 	char *conf = strdup("/etc/icinga/iris.conf");
+	char buf[64];
 
 	while ( (opt = getopt_long(argc, argv, short_opts, long_opts, &idx)) != -1 ) {
 		switch (opt) {
@@ -56,16 +57,47 @@ int main(int argc, char **argv)
 		return 2;
 	}
 
-	if (parse_config_file(conf, &s) != 0) {
+	/* the same checks a running iris makes before reloading */
+	if (parse_config_file(conf, &s) != 0 || server_check(&s) != 0) {
 		fprintf(stderr, "%s: errors were encountered.\n", conf);
 		return 4;
 	}
 
-	printf("port            = %s\n", s.port);
-	printf("timeout         = %i\n", s.timeout);
-	printf("max_clients     = %i\n", s.max_clients);
-	printf("max_lifetime    = %i\n", (int)s.max_lifetime);
-	printf("syslog_ident    = %s\n", s.syslog_ident);
-	printf("syslog_facility = %s\n", s.syslog_facility);
+	printf("port              = %s\n", s.port);
+	for (i = 0; i < s.num_listen; i++)
+		printf("listen            = %s\n", s.listen[i]);
+	printf("cmd_port          = %s\n", s.cmd_port ? s.cmd_port : "(none)");
+	printf("listen_unix       = %s\n", s.listen_unix ? s.listen_unix : "(none)");
+	printf("cmd_unix          = %s\n", s.cmd_unix ? s.cmd_unix : "(none)");
+	printf("admin_unix        = %s\n", s.admin_unix ? s.admin_unix : "(none)");
+	printf("unix_skip_crc     = %s\n", s.unix_skip_crc ? "yes" : "no");
+	printf("reject_unknown    = %s\n", s.reject_unknown ? "yes" : "no");
+	printf("ack_port          = %s\n", s.ack_port ? s.ack_port : "(none)");
+	printf("tls_port          = %s\n", s.tls_port ? s.tls_port : "(none)");
+	printf("tls_cert          = %s\n", s.tls_cert ? s.tls_cert : "(none)");
+	printf("tls_key           = %s\n", s.tls_key  ? s.tls_key  : "(none)");
+	printf("udp_port          = %s\n", s.udp_port ? s.udp_port : "(none)");
+	printf("listen_shm        = %s\n", s.listen_shm ? s.listen_shm : "(none)");
+	printf("shm_slots         = %u\n", s.shm_slots);
+	printf("timeout           = %i\n", s.timeout);
+	printf("max_clients       = %i\n", s.max_clients);
+	printf("max_lifetime      = %i\n", (int)s.max_lifetime);
+	printf("listen_backlog    = %i\n", s.listen_backlog);
+	printf("overflow_policy   = %s\n", s.overflow_policy == IRIS_OVERFLOW_QUEUE ? "queue"
+	                                : s.overflow_policy == IRIS_OVERFLOW_EVICT ? "evict" : "reject");
+	printf("overflow_queue    = %u\n", s.overflow_queue);
+	printf("syslog_ident      = %s\n", s.syslog_ident);
+	printf("syslog_facility   = %s\n", s.syslog_facility);
+	printf("sink              = %s\n", s.sink ? s.sink : "(none)");
+	printf("sink_path         = %s\n", s.sink_path ? s.sink_path : "(none)");
+	printf("sink_queue        = %i\n", s.sink_queue);
+	printf("sink_batch        = %i\n", s.sink_batch);
+	printf("sink_flush        = %i\n", (int)s.sink_flush);
+	printf("upstream          = %s\n", s.upstream ? s.upstream : "(none)");
+	printf("upstream_lifetime = %i\n", (int)s.upstream_lifetime);
+	printf("spool_dir         = %s\n", s.spool_dir ? s.spool_dir : "(none)");
+	printf("trace             = %s\n", trace_names(s.trace, buf, sizeof(buf)));
+	for (i = 0; i < s.num_trace_from; i++)
+		printf("trace_from        = %s\n", s.trace_from[i]);
 	return 0;
 }
@@ -0,0 +1,103 @@
+#include "iris.h"
+#include <getopt.h>
+// make iris.o happy
+int iris_call_submit_result(struct pdu *pdu) { return 0; }
+int iris_call_recv_data(int fd) { return 0; }
+int iris_call_register_fd(int fd) { return 0; }
+
+/* irisctl - ask a running iris (or irisd) things, over admin_unix
+
+     irisctl clients
+     irisctl top-talkers 20
+     irisctl kick 10.1.2.3
+     irisctl loglevel notice
+
+   The socket comes from -s, or else from admin_unix in the config
+   file (-c).  Exits 1 if iris answered with an error. */
+
+void usage(const char *prog)
+{
+	fprintf(stderr, "USAGE: %s [-c /path/to/iris.conf | -s /path/to/admin.sock] command [args]\n"
+	                "       %s help\n", prog, prog);
+}
+
+int main(int argc, char **argv)
+{
+	const char *short_opts = "h?c:s:";
+	struct option long_opts[] = {
+		{ "help",         no_argument, NULL, 'h' },
+		{ "config", required_argument, NULL, 'c' },
+		{ "socket", required_argument, NULL, 's' },
+		{ 0, 0, 0, 0 }
+	};
+
+	int opt, idx = 0, i, rc = 0;
+	char *conf = strdup(IRIS_DEFAULT_CONFIG_FILE);
+	char *sock = NULL, *answer;
+	char cmd[1024];
+	size_t len = 0;
+
+	while ( (opt = getopt_long(argc, argv, short_opts, long_opts, &idx)) != -1 ) {
+		switch (opt) {
+			case 'c':
+				free(conf);
+				conf = strdup(optarg);
+				break;
+
+			case 's':
+				free(sock);
+				sock = strdup(optarg);
+				break;
+
+			case 'h':
+			case '?':
+			default:
+				usage(argv[0]);
+				return 1;
+				break;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	for (i = optind; i < argc; i++) {
+		if (len + strlen(argv[i]) + 2 > sizeof(cmd)) {
+			fprintf(stderr, "command too long\n");
+			return 1;
+		}
+		len += snprintf(cmd + len, sizeof(cmd) - len, "%s%s", argv[i], i + 1 < argc ? " " : "\n");
+	}
+
+	if (!sock) {
+		struct server s;
+		server_init(&s);
+		if ((rc = parse_config_file(conf, &s)) != 0) {
+			fprintf(stderr, "%s: %s\n", conf, rc < 0 ? strerror(errno) : "errors were encountered");
+			return 2;
+		}
+		if (!s.admin_unix) {
+			fprintf(stderr, "%s: no admin_unix socket configured (or use -s)\n", conf);
+			return 2;
+		}
+		sock = strdup(s.admin_unix);
+		server_free(&s);
+	}
+
+	if (!(answer = admin_query(sock, cmd, 1))) {
+		fprintf(stderr, "%s: %s\n", sock, strerror(errno));
+		return 2;
+	}
+
+	/* everything up to the lone "." it ends with */
+	if (strncmp(answer, "error:", 6) == 0)
+		rc = 1;
+	answer[strlen(answer) - 2] = '\0';
+	fputs(answer, rc ? stderr : stdout);
+	free(answer);
+
+	free(conf);
+	free(sock);
+	return rc;
+}
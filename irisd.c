@@ -0,0 +1,153 @@
+#include "iris.h"
+#include "sink.h"
+#include <getopt.h>
+
+/* irisd - standalone iris daemon
+
+   Runs the same ingest engine as the broker module, but instead of
+   handing results to Icinga it pushes them into a sink (see sink.c),
+   which does its writing on its own thread:
+
+     relay        batch results up and forward them over a single
+                  persistent connection to another iris
+     checkresult  drop them into Icinga's check_result_path
+     file         append them, packed, to a file
+     null         throw them away (for benchmarking) */
+
+static struct sink *SINK = NULL;
+
+int iris_call_submit_result(struct pdu *pdu)
+{
+	return sink_submit(SINK, pdu) == 0 ? IRIS_ACK_OK : IRIS_ACK_QUEUE_FULL;
+}
+
+int iris_call_recv_data(int fd)
+{
+	return recv_data(fd);
+}
+
+int iris_call_register_fd(int fd) { return 0; }
+
+/* TERM / INT: finish reading what's already on its way, flush the
+   sink, and go (mainloop_stop is async-signal-safe; the reactor does
+   the talking about it) */
+static void drain(int sig)
+{
+	mainloop_stop(IRIS_STOP_DRAIN);
+}
+
+/* the settings that can change without a restart (see config_watch) */
+static void apply(const struct server *s)
+{
+	server_apply(s);
+	closelog();
+	openlog(s->syslog_ident, LOG_PID|LOG_CONS|LOG_PERROR, log_facility(s->syslog_facility));
+}
+
+static void stats(void)
+{
+	sink_stats(SINK);
+}
+
+void usage(const char *prog)
+{
+	fprintf(stderr, "USAGE: %s [-c /path/to/iris.conf]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	const char *short_opts = "h?c:";
+	struct option long_opts[] = {
+		{ "help",         no_argument, NULL, 'h' },
+		{ "config", required_argument, NULL, 'c' },
+		{ 0, 0, 0, 0 }
+	};
+
+	int opt, idx = 0;
+	char *conf = strdup(IRIS_DEFAULT_CONFIG_FILE);
+
+	while ( (opt = getopt_long(argc, argv, short_opts, long_opts, &idx)) != -1 ) {
+		switch (opt) {
+			case 'c':
+				free(conf);
+				conf = strdup(optarg);
+				break;
+
+			case 'h':
+			case '?':
+			default:
+				usage(argv[0]);
+				return 1;
+				break;
+		}
+	}
+
+	struct server s;
+	if (server_init(&s) != 0) {
+		perror("Failed to initialize Iris defaults");
+		return 2;
+	}
+
+	struct stat st;
+	if (stat(conf, &st) != 0) {
+		perror(conf);
+		return 2;
+	}
+	if (parse_config_file(conf, &s) != 0 || server_check(&s) != 0) {
+		fprintf(stderr, "%s: errors were encountered.\n", conf);
+		return 2;
+	}
+	if (!s.sink && s.upstream)
+		s.sink = strdup("relay");
+	if (!s.sink) {
+		fprintf(stderr, "%s: no sink (or upstream) configured\n", conf);
+		return 2;
+	}
+
+	apply(&s);
+	syslog(LOG_PROC, "irisd v" VERSION " starting up");
+	if (trace_start() != 0)
+		syslog(LOG_WARN, "failed to start the trace thread: %s", strerror(errno));
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGTERM, drain);
+	signal(SIGINT,  drain);
+
+	if (!(SINK = sink_new(&s))) {
+		syslog(LOG_ERROR, "Failed to set up the %s sink: %s", s.sink, strerror(errno));
+		return 2;
+	}
+	if (sink_start(SINK) != 0) {
+		syslog(LOG_ERROR, "Failed to start the %s sink thread: %s", s.sink, strerror(errno));
+		return 2;
+	}
+	admin_stats_extra(stats);
+	syslog(LOG_PROC, "writing to the %s sink in batches of %d (flushing every %lis)",
+			s.sink, SINK->batch, (long)s.sink_flush);
+
+	syslog(LOG_PROC, "maximum concurrent clients is %d",
+			client_init(s.max_clients));
+
+	int sockfd, epfd;
+	if ((sockfd = net_bind_server(&s)) < 0) {
+		syslog(LOG_ERROR, "Failed to bind the result listener(s): %s", strerror(errno));
+		return 2;
+	}
+	if ((epfd = net_poller(sockfd)) < 0) {
+		syslog(LOG_ERROR, "Initialization of IO/polling (via epoll) failed: %s", strerror(errno));
+		return 2;
+	}
+	if (net_listeners(&s, epfd) < 0)
+		return 2;
+	if (config_watch(epfd, conf, apply) != 0)
+		syslog(LOG_WARN, "not watching %s for changes: %s", conf, strerror(errno));
+
+	mainloop(sockfd, epfd);
+
+	sink_stop(SINK);
+	client_deinit();
+	net_close(epfd);
+	free(conf);
+	trace_stop();
+	syslog(LOG_PROC, "irisd v" VERSION " shutting down");
+	return 0;
+}
@@ -0,0 +1,76 @@
+#include "../iris.h"
+#include <sys/wait.h>
+
+/* connrate - how many connect / send one PDU / close cycles per second
+   can iris keep up with?  This is what most agents look like.
+
+   USAGE: perf/connrate <host> <port> [<procs> [<seconds>]] */
+
+int iris_call_submit_result(struct pdu *pdu) { return 0; }
+int iris_call_recv_data(int fd) { return 0; }
+int iris_call_register_fd(int fd) { return 0; }
+
+static unsigned long spam(const char *host, int port, int seconds)
+{
+	struct pdu pdu;
+	unsigned long n = 0;
+	time_t end = time(NULL) + seconds;
+	int fd;
+
+	memset(&pdu, 0, sizeof(pdu));
+	strcpy(pdu.host, "connrate");
+	strcpy(pdu.service, "accept");
+	strcpy(pdu.output, "OK");
+
+	while (time(NULL) < end) {
+		struct pdu packed = pdu;
+		packed.ts = (uint32_t)time(NULL);
+		pdu_pack(&packed);
+
+		if ((fd = net_connect(host, port)) < 0) {
+			perror("connect");
+			continue;
+		}
+		if (pdu_write(fd, (uint8_t*)&packed) < 0)
+			perror("write");
+		shutdown(fd, SHUT_WR);
+		fd_sink(fd);
+		close(fd);
+		n++;
+	}
+	return n;
+}
+
+int main(int argc, char **argv)
+{
+	int procs, seconds, pfd[2], i;
+	unsigned long n, total = 0;
+
+	if (argc < 3) {
+		fprintf(stderr, "USAGE: %s <host> <port> [<procs> [<seconds>]]\n", argv[0]);
+		return 1;
+	}
+	procs   = argc > 3 ? atoi(argv[3]) : 8;
+	seconds = argc > 4 ? atoi(argv[4]) : 10;
+
+	if (pipe(pfd) != 0) {
+		perror("pipe");
+		return 2;
+	}
+	for (i = 0; i < procs; i++) {
+		if (fork() == 0) {
+			n = spam(argv[1], atoi(argv[2]), seconds);
+			write(pfd[1], &n, sizeof(n));
+			_exit(0);
+		}
+	}
+	close(pfd[1]);
+	while (read(pfd[0], &n, sizeof(n)) == sizeof(n))
+		total += n;
+	while (wait(NULL) > 0)
+		;
+
+	printf("%d procs x %ds: %lu connections, %.0f/s\n",
+			procs, seconds, total, (double)total / seconds);
+	return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef IRIS_PROBES_H
+#define IRIS_PROBES_H
+
+/* USDT (statically defined tracing) probes, provider `iris', along
+   the ingest path, for bpftrace / perf / SystemTap against a normal
+   production build (see the .bt scripts in perf/).  Build with
+   `make SDT=1' (needs sys/sdt.h, from systemtap-sdt-dev[el]) and each
+   one is a single nop until something attaches to it; otherwise they
+   aren't there at all.  Either way, arguments should be cheap: locals,
+   not function calls.
+
+     accept        listener fd, client fd
+     read          fd, offset read from, bytes read (or -1)
+     crc_fail      their CRC, our CRC
+     too_old       age (seconds), PDU timestamp
+     submit_start  fd (-1 for shm / udp), struct pdu *
+     submit_done   fd
+     close         fd, bytes received, PDUs received
+     purge         fd, milliseconds past its deadline
+
+   bpftrace -l 'usdt:./irisd:iris:*' lists them. */
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define IRIS_PROBE1(name, a)          DTRACE_PROBE1(iris, name, a)
+#define IRIS_PROBE2(name, a, b)       DTRACE_PROBE2(iris, name, a, b)
+#define IRIS_PROBE3(name, a, b, c)    DTRACE_PROBE3(iris, name, a, b, c)
+#else
+#define IRIS_PROBE1(name, a)          do { } while (0)
+#define IRIS_PROBE2(name, a, b)       do { } while (0)
+#define IRIS_PROBE3(name, a, b, c)    do { } while (0)
+#endif
+
+#endif
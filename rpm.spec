@@ -40,6 +40,21 @@ document for more information.
 
 This package provides the send_iris utility that runs on the client.
 
+%package relay
+Group: Application/System
+Summary: Provides the irisd aggregator daemon.
+
+%description relay
+IRIS is an event broker module for Icinga that starts up a daemon thread,
+listening on TCP/5667 for passive service check results submitted by the
+send_iris utility.  These results are injected directly into Icinga's
+processing queues.
+
+This package provides irisd, a standalone daemon that accepts results
+from send_iris clients and hands them to a pluggable sink: relayed in
+batches to an upstream iris, written to Icinga's check result spool,
+appended to a file, or discarded for benchmarking.
+
 %prep
 %setup -q
 
@@ -50,6 +65,13 @@ make
 [ "$RPM_BUILD_ROOT" != "/" ] && rm -rf $RPM_BUILD_ROOT
 install -D -m 0755 iris.so ${RPM_BUILD_ROOT}%{_libdir}/icinga/iris.so
 install -D -m 0755 send_iris ${RPM_BUILD_ROOT}%{_bindir}/send_iris
+install -D -m 0755 irisctl   ${RPM_BUILD_ROOT}%{_sbindir}/irisctl
+install -D -m 0755 iris-top  ${RPM_BUILD_ROOT}%{_sbindir}/iris-top
+
+%files relay
+%defattr(755,root,root)
+%{_sbindir}/irisd
+install -D -m 0755 irisd     ${RPM_BUILD_ROOT}%{_sbindir}/irisd
 
 %clean
 rm -rf $RPM_BUILD_ROOT
@@ -57,6 +79,8 @@ rm -rf $RPM_BUILD_ROOT
 %files
 %defattr(755,root,root)
 %{_libdir}/icinga/iris.so
+%{_sbindir}/irisctl
+%{_sbindir}/iris-top
 
 %files send
 %defattr(755,root,root)
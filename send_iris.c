@@ -1,7 +1,8 @@
 #include "iris.h"
+#include <getopt.h>
 
 // make iris.o happy
-void iris_call_submit_result(struct pdu *pdu) { }
+int iris_call_submit_result(struct pdu *pdu) { return 0; }
 int iris_call_recv_data(int fd) { return 0; }
 int iris_call_register_fd(int fd) { return 0; }
 struct {
@@ -10,25 +11,98 @@ struct {
 	int   timeout;
 	int   quiet;
 	char  delim[2];
+
+	char         *spool;
+	unsigned int  rate;
+	int           replay;
+
+	char         *shm;
+	int           udp;
+
+	int           ack;
+	unsigned int  window;
+
+	int           tls;
+	char         *tls_ca;
+	char         *tls_session;
 } OPTS = {
 	.host    = NULL,
 	.port    = 0,
 	.timeout = 10,
 	.quiet   = 0,
-	.delim   = "\t"
+	.delim   = "\t",
+
+	.spool   = NULL,
+	.rate    = 0,
+	.replay  = 0,
+
+	.shm     = NULL,
+	.udp     = 0,
+
+	.ack     = 0,
+	.window  = IRIS_ACK_WINDOW,
+
+	.tls         = 0,
+	.tls_ca      = NULL,
+	.tls_session = NULL
 };
 
+char PEER[PATH_MAX];
+
+/* with --ack, how many spooled results have been replayed (and
+   confirmed), and how many of those iris threw out */
+uint32_t REPLAYED = 0;
+int REPLAY_REJECTED = 0;
+
 void alarm_handler(int sig)
 {
 	printf("Timed out after %d seconds\n", OPTS.timeout);
+	if (OPTS.spool)
+		return; /* let connect() fail with EINTR, so we can spool */
 	alarm(0); exit(3);
 }
 
+void spool_and_exit(struct pdu *packets, int n)
+{
+	if (!OPTS.spool || n <= 0)
+		exit(3);
+
+	if (spool_write(OPTS.spool, packets, n) != n) {
+		fprintf(stderr, "error spooling %d results to %s: %s\n",
+				n, OPTS.spool, strerror(errno));
+		exit(3);
+	}
+	if (!OPTS.quiet) {
+		printf("Spooled %d results to %s\n", n, OPTS.spool);
+	}
+	exit(2);
+}
+
 int process_args(int argc, char **argv)
 {
-	int c;
+	const char *short_opts = "qvH:p:t:s:r:Rh?";
+	struct option long_opts[] = {
+		{ "quiet",         no_argument, NULL, 'q' },
+		{ "verbose",       no_argument, NULL, 'v' },
+		{ "host",    required_argument, NULL, 'H' },
+		{ "port",    required_argument, NULL, 'p' },
+		{ "timeout", required_argument, NULL, 't' },
+		{ "spool",   required_argument, NULL, 's' },
+		{ "rate",    required_argument, NULL, 'r' },
+		{ "replay",        no_argument, NULL, 'R' },
+		{ "shm",     required_argument, NULL, 'S' },
+		{ "udp",           no_argument, NULL, 'U' },
+		{ "ack",           no_argument, NULL, 'A' },
+		{ "window",  required_argument, NULL, 'W' },
+		{ "tls",           no_argument, NULL, 'T' },
+		{ "tls-ca",      required_argument, NULL, 'C' },
+		{ "tls-session", required_argument, NULL, 'E' },
+		{ "help",          no_argument, NULL, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+	int c, idx = 0;
 
-	while ((c = getopt(argc, argv, "qvH:p:t:h?")) != -1) {
+	while ((c = getopt_long(argc, argv, short_opts, long_opts, &idx)) != -1) {
 		switch (c) {
 		case 'q':
 			OPTS.quiet = 1;
@@ -51,15 +125,64 @@ int process_args(int argc, char **argv)
 			OPTS.timeout = atoi(optarg);
 			break;
 
+		case 's':
+			free(OPTS.spool);
+			OPTS.spool = strdup(optarg);
+			break;
+
+		case 'r':
+			OPTS.rate = atoi(optarg);
+			break;
+
+		case 'R':
+			OPTS.replay = 1;
+			break;
+
+		case 'S':
+			free(OPTS.shm);
+			OPTS.shm = strdup(optarg);
+			break;
+
+		case 'U':
+			OPTS.udp = 1;
+			break;
+
+		case 'A':
+			OPTS.ack = 1;
+			break;
+
+		case 'W':
+			OPTS.window = atoi(optarg);
+			break;
+
+		case 'T':
+			OPTS.tls = 1;
+			break;
+
+		case 'C':
+			free(OPTS.tls_ca);
+			OPTS.tls_ca = strdup(optarg);
+			break;
+
+		case 'E':
+			free(OPTS.tls_session);
+			OPTS.tls_session = strdup(optarg);
+			break;
+
 		case 'h':
 		case '?':
-			printf("USAGE: send_iris -H <host> [-p <port>] [-t <timeout>]\n");
+			printf("USAGE: send_iris -H <host> [-p <port>] [-t <timeout>] [-s <spooldir> [-r <rate>] [-R]]\n");
+			printf("       send_iris --ack -H <host> [-p <port>] [--window <n>] [-t <timeout>] [-s <spooldir>]\n");
+			printf("       send_iris --tls -H <host> [-p <port>] [-t <timeout>] [--tls-ca <file>] [--tls-session <file>]\n");
+			printf("       send_iris --udp -H <host> [-p <port>]\n");
+			printf("       send_iris --shm <path> [-t <timeout>] [-s <spooldir>]\n");
 			printf("\n");
 			printf("  -h\n");
 			printf("      Show this informative help screen.\n");
 			printf("\n");
 			printf("  -H <hostname>\n");
-			printf("      IP or hostname of who we should submit results to.\n");
+			printf("      IP or hostname of who we should submit results to,\n");
+			printf("      or unix:/path/to/socket for a local iris.\n");
 			printf("      (this option is required)\n");
 			printf("\n");
 			printf("  -p <port>\n");
@@ -70,49 +193,448 @@ int process_args(int argc, char **argv)
 			printf("      Connection timeout, in seconds.\n");
 			printf("      Defaults to %d\n", 10);
 			printf("\n");
+			printf("  -s <spooldir>\n");
+			printf("      Spool results that could not be delivered to this\n");
+			printf("      directory (exiting 2 instead of 3), and replay any\n");
+			printf("      previously spooled results before sending new ones.\n");
+			printf("      Replayed results are re-stamped with the current time,\n");
+			printf("      since iris discards anything over 15 minutes old.\n");
+			printf("\n");
+			printf("  -r <rate>\n");
+			printf("      Replay at most this many spooled results per second.\n");
+			printf("      Defaults to 0 (unlimited)\n");
+			printf("\n");
+			printf("  -R\n");
+			printf("      Only replay the spool; don't read results from stdin.\n");
+			printf("\n");
+			printf("  --ack\n");
+			printf("      Talk to an acknowledging listener (see ack_port), and\n");
+			printf("      only count results as sent once iris confirms them.\n");
+			printf("      Anything unconfirmed when the connection fails is\n");
+			printf("      spooled (with -s).  Rejected results are reported.\n");
+			printf("      Spooled results are replayed the same way, and stay in\n");
+			printf("      the spool until iris has confirmed them.\n");
+			printf("\n");
+			printf("  --window <n>\n");
+			printf("      With --ack, how many results may be in flight before\n");
+			printf("      waiting for iris to catch up.  Defaults to %d\n", IRIS_ACK_WINDOW);
+			printf("\n");
+			printf("  --tls\n");
+			printf("      Talk TLS to <host>:<port> (see tls_port), checking\n");
+			printf("      its certificate against <host>.\n");
+			printf("\n");
+			printf("  --tls-ca <file>\n");
+			printf("      Trust the CA certificate(s) in <file>, instead of\n");
+			printf("      the system's.\n");
+			printf("\n");
+			printf("  --tls-session <file>\n");
+			printf("      Keep the TLS session in <file>, so that the next run\n");
+			printf("      can resume it instead of doing a full handshake.\n");
+			printf("\n");
+			printf("  --udp\n");
+			printf("      Fire results at <host>:<port> over UDP (see udp_port),\n");
+			printf("      up to %d per datagram.  Nothing is retried, or spooled.\n",
+					IRIS_UDP_MAX_PDUS);
+			printf("\n");
+			printf("  --shm <path>\n");
+			printf("      Write results straight into the shared-memory ring\n");
+			printf("      of an iris on this host (see listen_shm), instead\n");
+			printf("      of connecting to one.  Waits up to <timeout> for\n");
+			printf("      room in the ring, if it is full.\n");
+			printf("\n");
 			exit(0);
 			break;
 		}
 	}
 
+	if (OPTS.shm) {
+		if (OPTS.host || OPTS.replay) {
+			fprintf(stderr, "The --shm option can't be used with -H or -R\n");
+			return 1;
+		}
+		snprintf(PEER, sizeof(PEER), "%s", OPTS.shm);
+		return 0;
+	}
+
 	if (!OPTS.host) {
 		fprintf(stderr, "Missing required -H option\n");
 		return 1;
 	}
 
+	if (OPTS.tls) {
+#ifndef HAVE_TLS
+		fprintf(stderr, "send_iris was built without TLS support (make TLS=1)\n");
+		return 1;
+#endif
+		if (OPTS.ack || OPTS.udp || OPTS.spool
+		 || strncmp(OPTS.host, IRIS_UNIX_PREFIX, strlen(IRIS_UNIX_PREFIX)) == 0) {
+			fprintf(stderr, "The --tls option can't be used with --ack, --udp, -s or unix: hosts\n");
+			return 1;
+		}
+	}
+
+	if (OPTS.ack && (OPTS.udp || OPTS.replay)) {
+		fprintf(stderr, "The --ack option can't be used with --udp or -R\n");
+		return 1;
+	}
+	if (OPTS.ack && OPTS.window < 1) {
+		fprintf(stderr, "The --window must be at least 1\n");
+		return 1;
+	}
+
+	if (OPTS.udp && (OPTS.spool || OPTS.replay)) {
+		fprintf(stderr, "The --udp option can't be used with -s or -R\n");
+		return 1;
+	}
+
+	if (OPTS.replay && !OPTS.spool) {
+		fprintf(stderr, "The -R option requires a spool directory (-s)\n");
+		return 1;
+	}
+
 	if (OPTS.port == 0)
 		OPTS.port = 5668;
+
+	if (strncmp(OPTS.host, IRIS_UNIX_PREFIX, strlen(IRIS_UNIX_PREFIX)) == 0)
+		snprintf(PEER, sizeof(PEER), "%s", OPTS.host);
+	else
+		snprintf(PEER, sizeof(PEER), "%s:%d", OPTS.host, OPTS.port);
 	return 0;
 }
 
+/* returns how many of the (unpacked) packets made it into the ring */
+int send_shm(struct pdu *packets, int n)
+{
+	struct shmring *ring;
+	struct timespec nap = { .tv_sec = 0, .tv_nsec = 100 * 1000 };
+	time_t give_up;
+	int i;
+
+	if (!(ring = shmring_open(OPTS.shm))) {
+		fprintf(stderr, "error attaching to %s: %s\n", PEER,
+				errno == ENXIO ? "iris is not running" : strerror(errno));
+		return 0;
+	}
+
+	give_up = time(NULL) + OPTS.timeout;
+	for (i = 0; i < n; i++) {
+		while (shmring_put(ring, &packets[i]) != 0) {
+			if (time(NULL) >= give_up) {
+				fprintf(stderr, "Timed out after %d seconds waiting for room in %s\n",
+						OPTS.timeout, PEER);
+				shmring_close(ring);
+				return i;
+			}
+			nanosleep(&nap, NULL);
+		}
+	}
+	shmring_close(ring);
+	return n;
+}
+
+/* returns how many of the (packed) packets were handed to the kernel */
+int send_udp(struct pdu *packets, int n)
+{
+	int sock, i, k;
+
+	alarm(OPTS.timeout);
+	if ((sock = net_connect_udp(OPTS.host, OPTS.port)) < 0) {
+		fprintf(stderr, "error connecting to %s: %s\n", PEER, strerror(errno));
+		alarm(0);
+		return 0;
+	}
+
+	for (i = 0; i < n; i += k) {
+		k = n - i > IRIS_UDP_MAX_PDUS ? IRIS_UDP_MAX_PDUS : n - i;
+		if (send(sock, &packets[i], k * sizeof(struct pdu), 0) < 0) {
+			fprintf(stderr, "error sending data to %s: %s\n", PEER, strerror(errno));
+			break;
+		}
+	}
+	close(sock);
+	alarm(0);
+	return i;
+}
+
+#ifdef HAVE_TLS
+static int tls_save_session(SSL *ssl, SSL_SESSION *sess)
+{
+	char tmp[PATH_MAX];
+	FILE *io;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", OPTS.tls_session);
+	if (!(io = fopen(tmp, "w")))
+		return 0;
+	if (PEM_write_SSL_SESSION(io, sess) != 1) {
+		fclose(io);
+		unlink(tmp);
+		return 0;
+	}
+	fclose(io);
+	rename(tmp, OPTS.tls_session);
+	return 0; /* we don't hang on to it */
+}
+
+static SSL* tls_connect(int sock)
+{
+	SSL_CTX *ctx;
+	SSL_SESSION *sess;
+	SSL *ssl;
+	FILE *io;
+	struct in6_addr ip;
+
+	if (!(ctx = SSL_CTX_new(TLS_client_method())))
+		goto fail;
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	if ((OPTS.tls_ca ? SSL_CTX_load_verify_locations(ctx, OPTS.tls_ca, NULL)
+	                 : SSL_CTX_set_default_verify_paths(ctx)) != 1)
+		goto fail;
+	if (OPTS.tls_session) {
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT
+		                                  | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(ctx, tls_save_session);
+	}
+
+	if (!(ssl = SSL_new(ctx)))
+		goto fail;
+	SSL_CTX_free(ctx); /* ssl holds a reference */
+	SSL_set_fd(ssl, sock);
+
+	if (inet_pton(AF_INET, OPTS.host, &ip) == 1 || inet_pton(AF_INET6, OPTS.host, &ip) == 1) {
+		X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), OPTS.host);
+	} else {
+		SSL_set_tlsext_host_name(ssl, OPTS.host);
+		SSL_set1_host(ssl, OPTS.host);
+	}
+
+	if (OPTS.tls_session && (io = fopen(OPTS.tls_session, "r")) != NULL) {
+		if ((sess = PEM_read_SSL_SESSION(io, NULL, NULL, NULL)) != NULL) {
+			SSL_set_session(ssl, sess);
+			SSL_SESSION_free(sess);
+		}
+		fclose(io);
+	}
+
+	if (SSL_connect(ssl) != 1) {
+		fprintf(stderr, "TLS handshake with %s failed: %s\n", PEER,
+				ERR_reason_error_string(ERR_get_error()));
+		SSL_free(ssl);
+		return NULL;
+	}
+	return ssl;
+
+fail:
+	fprintf(stderr, "failed to set up TLS: %s\n", ERR_reason_error_string(ERR_get_error()));
+	return NULL;
+}
+
+/* returns how many of the (packed) packets were written */
+int send_tls(int sock, struct pdu *packets, int n)
+{
+	char buf[256];
+	SSL *ssl;
+	int i;
+
+	if (!(ssl = tls_connect(sock)))
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		if (SSL_write(ssl, &packets[i], sizeof(struct pdu)) != sizeof(struct pdu)) {
+			fprintf(stderr, "error sending data to %s\n", PEER);
+			break;
+		}
+	}
+
+	/* let iris hang up first; reading until it does also picks up
+	   the session ticket(s) it sent after the handshake */
+	SSL_shutdown(ssl);
+	while (SSL_read(ssl, buf, sizeof(buf)) > 0)
+		;
+	SSL_free(ssl);
+	return i;
+}
+#endif
+
+/* Pipelines the (packed) packets, never letting more than --window
+   of them go unacknowledged.  Returns how many iris has confirmed;
+   *rejected is how many of those it threw out.  <base> is how many
+   results went down the connection before these (replayed from the
+   spool, also through here), since iris numbers them all. */
+int send_acked(int sock, struct pdu *packets, int n, uint32_t base, int *rejected)
+{
+	struct ack ack;
+	int sent = 0, acked = 0;
+
+	*rejected = 0;
+	while (acked < n) {
+		while (sent < n && sent - acked < OPTS.window) {
+			if (pdu_write(sock, (uint8_t*)&packets[sent]) < 0) {
+				fprintf(stderr, "error sending data to %s\n", PEER);
+				return acked;
+			}
+			sent++;
+		}
+
+		if (ack_read(sock, &ack) != 0) {
+			fprintf(stderr, "error reading acknowledgements from %s: %s\n",
+					PEER, strerror(errno));
+			return acked;
+		}
+		if (ack.seq > base + sent) {
+			fprintf(stderr, "bogus acknowledgement (#%u of %u) from %s\n",
+					ack.seq, base + sent, PEER);
+			return acked;
+		}
+		if (ack.seq <= base)
+			continue; /* already counted */
+		ack.seq -= base;
+
+		if (ack.type == IRIS_ACK_REJECTED) {
+			fprintf(stderr, "result #%u (%s/%s) was rejected: %s\n", ack.seq,
+					packets[ack.seq-1].host, packets[ack.seq-1].service,
+					ack_reason(ack.reason));
+			(*rejected)++;
+		} else if (ack.seq > acked) {
+			acked = ack.seq;
+		}
+	}
+	return acked;
+}
+
+/* spool_replay_via(), for --ack: a spooled batch only counts as
+   delivered (and leaves the spool) once iris has confirmed it */
+int send_replayed(int sock, struct pdu *packets, int n)
+{
+	int rejected, acked;
+
+	acked = send_acked(sock, packets, n, REPLAYED, &rejected);
+	REPLAYED += acked;
+	REPLAY_REJECTED += rejected;
+	return acked;
+}
+
 int main(int argc, char **argv)
 {
 	struct pdu *packets = NULL;
-	int npackets = 0, nsent = 0;
+	int npackets = 0, nsent = 0, nreplayed = 0;
 	int sock, i;
 	time_t now;
 
 	if (process_args(argc, argv) != 0)
 		exit(3);
 
-	npackets = read_packets(stdin, &packets, OPTS.delim);
+	if (!OPTS.replay)
+		npackets = read_packets(stdin, &packets, OPTS.delim);
+
+	time(&now);
+	for (i = 0; i < npackets; i++)
+		packets[i].ts = (uint32_t)now;
+
+	if (OPTS.shm) {
+		nsent = send_shm(packets, npackets);
+		if (nsent < npackets) {
+			for (i = nsent; i < npackets; i++)
+				pdu_pack(&packets[i]);
+			spool_and_exit(packets+nsent, npackets-nsent);
+		}
+		if (!OPTS.quiet)
+			printf("Sent %d results to %s\n", nsent, PEER);
+		free(packets);
+		return 0;
+	}
+
+	for (i = 0; i < npackets; i++)
+		pdu_pack(&packets[i]);
+
+	if (OPTS.udp) {
+		signal(SIGALRM, alarm_handler);
+		nsent = send_udp(packets, npackets);
+		if (!OPTS.quiet)
+			printf("Sent %d results to udp %s\n", nsent, PEER);
+		free(packets);
+		return nsent == npackets ? 0 : 3;
+	}
+
+	if (OPTS.spool) {
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = alarm_handler; /* no SA_RESTART */
+		sigaction(SIGALRM, &sa, NULL);
+		signal(SIGPIPE, SIG_IGN);
+	} else {
+		signal(SIGALRM, alarm_handler);
+	}
 
-	signal(SIGALRM, alarm_handler);
 	alarm(OPTS.timeout);
 	if ((sock = net_connect(OPTS.host, OPTS.port)) < 0) {
-		fprintf(stderr, "error connecting to %s:%d: %s\n",
-				OPTS.host, OPTS.port, strerror(errno));
-		alarm(0); exit(3);
+		fprintf(stderr, "error connecting to %s: %s\n",
+				PEER, strerror(errno));
+		alarm(0); spool_and_exit(packets, npackets);
 	}
 
-	for (i = 0; i < npackets; i++) {
-		time(&now); packets[i].ts = (uint32_t)now;
-		pdu_pack(&packets[i]);
+	if (OPTS.spool) {
+		/* a rate-limited replay can legitimately outlast the alarm,
+		   so time out individual writes instead */
+		struct timeval tv = { .tv_sec = OPTS.timeout, .tv_usec = 0 };
+		alarm(0);
+		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if (OPTS.ack)
+			setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+		nreplayed = OPTS.ack ? spool_replay_via(OPTS.spool, sock, OPTS.rate, send_replayed)
+		                     : spool_replay(OPTS.spool, sock, OPTS.rate);
+		if (nreplayed < 0) {
+			fprintf(stderr, "error replaying spooled results to %s\n",
+					PEER);
+			close(sock);
+			spool_and_exit(packets, npackets);
+		}
+	}
 
+#ifdef HAVE_TLS
+	if (OPTS.tls) {
+		nsent = send_tls(sock, packets, npackets);
+		close(sock);
+		alarm(0);
+		if (nsent < npackets)
+			exit(3);
+		if (!OPTS.quiet)
+			printf("Sent %d results to %s over TLS\n", nsent, PEER);
+		free(packets);
+		return 0;
+	}
+#endif
+
+	if (OPTS.ack) {
+		struct timeval tv = { .tv_sec = OPTS.timeout, .tv_usec = 0 };
+		int rejected;
+
+		alarm(0);
+		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+		nsent = send_acked(sock, packets, npackets, REPLAYED, &rejected);
+		close(sock);
+		if (nsent < npackets)
+			spool_and_exit(packets+nsent, npackets-nsent);
+
+		if (!OPTS.quiet) {
+			if (nreplayed > 0)
+				printf("Replayed %d spooled results to %s (%d accepted, %d rejected)\n",
+						nreplayed, PEER, nreplayed - REPLAY_REJECTED, REPLAY_REJECTED);
+			printf("Sent %d results to %s (%d accepted, %d rejected)\n",
+					nsent, PEER, nsent - rejected, rejected);
+		}
+		free(packets);
+		return rejected || REPLAY_REJECTED ? 1 : 0;
+	}
+
+	for (i = 0; i < npackets; i++) {
 		if (pdu_write(sock, (uint8_t*)&packets[i]) < 0) {
-			fprintf(stderr, "error sending data to %s:%d\n", OPTS.host, OPTS.port);
+			fprintf(stderr, "error sending data to %s\n", PEER);
 			close(sock);
-			alarm(0); exit(3);
+			alarm(0); spool_and_exit(packets+i, npackets-i);
 		}
 		nsent++;
 	}
@@ -122,7 +644,9 @@ int main(int argc, char **argv)
 	alarm(0);
 
 	if (!OPTS.quiet) {
-		printf("Sent %d results to %s:%d\n", nsent, OPTS.host, OPTS.port);
+		if (nreplayed > 0)
+			printf("Replayed %d spooled results to %s\n", nreplayed, PEER);
+		printf("Sent %d results to %s\n", nsent, PEER);
 	}
 
 	free(packets);
@@ -0,0 +1,389 @@
+#include "sink.h"
+
+/*************************************************************/
+
+static int null_write(struct sink *sink, struct pdu *batch, int n)
+{
+	return n;
+}
+
+/*************************************************************/
+
+static int file_open(struct sink *sink, const struct server *s)
+{
+	if (!sink->path) {
+		syslog(LOG_ERROR, "file sink needs a sink_path to write to");
+		errno = EINVAL;
+		return -1;
+	}
+
+	sink->fd = open(sink->path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0640);
+	if (sink->fd < 0) {
+		syslog(LOG_ERROR, "failed to open %s: %s", sink->path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int file_write(struct sink *sink, struct pdu *batch, int n)
+{
+	size_t len = n * sizeof(struct pdu);
+	int i;
+
+	/* same format as the spool, so it can be replayed */
+	for (i = 0; i < n; i++)
+		pdu_pack(&batch[i]);
+
+	if (write_full(sink->fd, (uint8_t*)batch, len) != len) {
+		syslog(LOG_ERROR, "failed to write %d results to %s: %s",
+				n, sink->path, strerror(errno));
+		return -1;
+	}
+	return n;
+}
+
+static void file_close(struct sink *sink)
+{
+	if (sink->fd >= 0) close(sink->fd);
+	sink->fd = -1;
+}
+
+/*************************************************************/
+
+static int checkresult_open(struct sink *sink, const struct server *s)
+{
+	struct stat st;
+
+	if (!sink->path) {
+		syslog(LOG_ERROR, "checkresult sink needs a sink_path (Icinga's check_result_path)");
+		errno = EINVAL;
+		return -1;
+	}
+	if (stat(sink->path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		syslog(LOG_ERROR, "check result path %s is not a directory", sink->path);
+		errno = ENOTDIR;
+		return -1;
+	}
+	return 0;
+}
+
+/* Icinga reads one value per line, so newlines (and the backslashes
+   used to escape them) have to be escaped the way its own check
+   workers do it. */
+static void checkresult_put(FILE *io, const char *key, const char *val, size_t max)
+{
+	size_t i;
+
+	fprintf(io, "%s=", key);
+	for (i = 0; i < max && val[i]; i++) {
+		if (val[i] == '\\')      fputs("\\\\", io);
+		else if (val[i] == '\n') fputs("\\n", io);
+		else                     fputc(val[i], io);
+	}
+	fputc('\n', io);
+}
+
+static int checkresult_write(struct sink *sink, struct pdu *batch, int n)
+{
+	char file[PATH_MAX], ok[PATH_MAX+4];
+	FILE *io;
+	int fd, i;
+
+	snprintf(file, sizeof(file), "%s/cXXXXXX", sink->path);
+	if ((fd = mkstemp(file)) < 0 || !(io = fdopen(fd, "w"))) {
+		syslog(LOG_ERROR, "failed to create check result file in %s: %s",
+				sink->path, strerror(errno));
+		if (fd >= 0) { close(fd); unlink(file); }
+		return -1;
+	}
+
+	fprintf(io, "### Active Check Result File ###\n");
+	fprintf(io, "file_time=%lu\n\n", (unsigned long)time(NULL));
+	for (i = 0; i < n; i++) {
+		int host = strncmp(batch[i].service, "HOST", IRIS_PDU_SERVICE_LEN) == 0;
+
+		fprintf(io, "### Iris %s Check Result ###\n", host ? "Host" : "Service");
+		checkresult_put(io, "host_name", batch[i].host, IRIS_PDU_HOST_LEN-1);
+		if (!host)
+			checkresult_put(io, "service_description", batch[i].service, IRIS_PDU_SERVICE_LEN-1);
+		fprintf(io, "check_type=1\n"); /* passive */
+		fprintf(io, "check_options=0\n");
+		fprintf(io, "scheduled_check=0\n");
+		fprintf(io, "reschedule_check=0\n");
+		fprintf(io, "latency=0.000000\n");
+		fprintf(io, "start_time=%u.0\n",  batch[i].ts);
+		fprintf(io, "finish_time=%u.0\n", batch[i].ts);
+		fprintf(io, "early_timeout=0\n");
+		fprintf(io, "exited_ok=1\n");
+		fprintf(io, "return_code=%u\n", batch[i].rc);
+		checkresult_put(io, "output", batch[i].output, IRIS_PDU_OUTPUT_LEN-1);
+		fputc('\n', io);
+	}
+	if (fclose(io) != 0) {
+		syslog(LOG_ERROR, "failed to write check result file %s: %s", file, strerror(errno));
+		unlink(file);
+		return -1;
+	}
+
+	/* the reaper won't touch the file until the .ok marker shows up */
+	snprintf(ok, sizeof(ok), "%s.ok", file);
+	if ((fd = open(ok, O_WRONLY|O_CREAT|O_EXCL, 0644)) < 0) {
+		syslog(LOG_ERROR, "failed to create %s: %s", ok, strerror(errno));
+		unlink(file);
+		return -1;
+	}
+	close(fd);
+
+	trace(IRIS_TRACE_SINK, "wrote %d results to %s", n, file);
+	return n;
+}
+
+/*************************************************************/
+
+static int relay_open(struct sink *sink, const struct server *s)
+{
+	struct relay *r;
+
+	if (!s->upstream) {
+		syslog(LOG_ERROR, "relay sink needs an upstream to relay to");
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!(r = calloc(1, sizeof(struct relay))))
+		return -1;
+	if (relay_init(r, s->upstream, s->sink_batch) != 0) {
+		syslog(LOG_ERROR, "invalid upstream '%s': %s", s->upstream, strerror(errno));
+		free(r);
+		return -1;
+	}
+	r->lifetime = s->upstream_lifetime;
+	if (s->spool_dir && !(r->spool = strdup(s->spool_dir))) {
+		relay_deinit(r);
+		free(r);
+		return -1;
+	}
+
+	sink->data = r;
+	return 0;
+}
+
+static int relay_write(struct sink *sink, struct pdu *batch, int n)
+{
+	struct relay *r = sink->data;
+	int i;
+
+	for (i = 0; i < n; i++)
+		relay_submit(r, &batch[i]);
+	return relay_flush(r) < 0 ? -1 : n;
+}
+
+static void relay_close(struct sink *sink)
+{
+	struct relay *r = sink->data;
+	char *spool = r->spool;
+
+	relay_deinit(r);
+	free(spool);
+	free(r);
+	sink->data = NULL;
+}
+
+/*************************************************************/
+
+static const struct sink_ops SINKS[] = {
+	{ "null",        NULL,             null_write,        NULL        },
+	{ "file",        file_open,        file_write,        file_close  },
+	{ "checkresult", checkresult_open, checkresult_write, NULL        },
+	{ "relay",       relay_open,       relay_write,       relay_close },
+	{ NULL }
+};
+
+static void *sink_thread(void *udata)
+{
+	struct sink *sink = (struct sink*)udata;
+	struct timespec until;
+	unsigned int n;
+	int rc;
+
+	pthread_mutex_lock(&sink->lock);
+	for (;;) {
+		/* hold off until we have a full batch, or until the oldest
+		   queued result has been waiting for `linger' seconds */
+		while (sink->running && sink->count < sink->batch) {
+			if (sink->count == 0) {
+				pthread_cond_wait(&sink->ready, &sink->lock);
+				continue;
+			}
+			until = sink->since;
+			until.tv_sec += sink->linger;
+			if (pthread_cond_timedwait(&sink->ready, &sink->lock, &until) == ETIMEDOUT)
+				break;
+		}
+		if (sink->count == 0) {
+			if (!sink->running) break;
+			continue;
+		}
+
+		/* the producer never touches queued slots, so we can work
+		   on them in place without holding the lock */
+		n = sink->count;
+		if (n > sink->batch) n = sink->batch;
+		if (n > sink->size - sink->head) n = sink->size - sink->head;
+		pthread_mutex_unlock(&sink->lock);
+
+		rc = sink->ops->write(sink, sink->queue + sink->head, n);
+
+		pthread_mutex_lock(&sink->lock);
+		if (rc < 0) sink->failed  += n;
+		else        sink->written += n;
+		sink->head   = (sink->head + n) % sink->size;
+		sink->count -= n;
+		clock_gettime(CLOCK_MONOTONIC, &sink->since);
+	}
+	pthread_mutex_unlock(&sink->lock);
+	return NULL;
+}
+
+struct sink *sink_new(const struct server *s)
+{
+	const struct sink_ops *ops;
+	struct sink *sink;
+	pthread_condattr_t attr;
+
+	if (!s || !s->sink) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	for (ops = SINKS; ops->name; ops++)
+		if (strcmp(ops->name, s->sink) == 0)
+			break;
+	if (!ops->name) {
+		syslog(LOG_ERROR, "unknown sink type '%s'", s->sink);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (!(sink = calloc(1, sizeof(struct sink))))
+		return NULL;
+	if (!(sink->queue = calloc(s->sink_queue, sizeof(struct pdu)))) {
+		free(sink);
+		return NULL;
+	}
+
+	sink->ops    = ops;
+	sink->fd     = -1;
+	sink->path   = s->sink_path ? strdup(s->sink_path) : NULL;
+	sink->size   = s->sink_queue;
+	sink->batch  = s->sink_batch < s->sink_queue ? s->sink_batch : s->sink_queue;
+	sink->linger = s->sink_flush;
+
+	pthread_mutex_init(&sink->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sink->ready, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (ops->open && ops->open(sink, s) != 0) {
+		pthread_cond_destroy(&sink->ready);
+		pthread_mutex_destroy(&sink->lock);
+		free(sink->path);
+		free(sink->queue);
+		free(sink);
+		return NULL;
+	}
+	return sink;
+}
+
+int sink_start(struct sink *sink)
+{
+	int rc;
+
+	if (!sink) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	sink->running = 1;
+	if ((rc = pthread_create(&sink->tid, NULL, sink_thread, sink)) != 0) {
+		sink->running = 0;
+		errno = rc;
+		return -1;
+	}
+	return 0;
+}
+
+int sink_submit(struct sink *sink, const struct pdu *pdu)
+{
+	unsigned long dropped;
+	unsigned int tail;
+
+	pthread_mutex_lock(&sink->lock);
+	if (sink->count == sink->size) {
+		dropped = ++sink->dropped;
+		pthread_mutex_unlock(&sink->lock);
+
+		if ((dropped & (dropped - 1)) == 0) /* 1, 2, 4, 8 ... */
+			syslog(LOG_WARN, "%s sink queue is full; %lu results dropped so far",
+					sink->ops->name, dropped);
+		return -1;
+	}
+
+	tail = (sink->head + sink->count) % sink->size;
+	memcpy(&sink->queue[tail], pdu, sizeof(struct pdu));
+
+	/* only wake the sink thread when it has something new to do */
+	if (sink->count++ == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &sink->since);
+		pthread_cond_signal(&sink->ready);
+	} else if (sink->count == sink->batch) {
+		pthread_cond_signal(&sink->ready);
+	}
+	pthread_mutex_unlock(&sink->lock);
+	return 0;
+}
+
+/* sink.* lines for the admin `stats' command (see admin_stat) */
+void sink_stats(struct sink *sink)
+{
+	unsigned int queued;
+	unsigned long written, failed, dropped;
+
+	pthread_mutex_lock(&sink->lock);
+	queued  = sink->count;
+	written = sink->written;
+	failed  = sink->failed;
+	dropped = sink->dropped;
+	pthread_mutex_unlock(&sink->lock);
+
+	admin_stat("sink.queued",  queued);
+	admin_stat("sink.size",    sink->size);
+	admin_stat("sink.written", written);
+	admin_stat("sink.failed",  failed);
+	admin_stat("sink.dropped", dropped);
+}
+
+void sink_stop(struct sink *sink)
+{
+	if (!sink) return;
+
+	if (sink->running) {
+		pthread_mutex_lock(&sink->lock);
+		sink->running = 0;
+		pthread_cond_signal(&sink->ready);
+		pthread_mutex_unlock(&sink->lock);
+		pthread_join(sink->tid, NULL);
+	}
+
+	syslog(LOG_PROC, "%s sink wrote %lu results (%lu failed, %lu dropped)",
+			sink->ops->name, sink->written, sink->failed, sink->dropped);
+
+	if (sink->ops->close)
+		sink->ops->close(sink);
+	pthread_cond_destroy(&sink->ready);
+	pthread_mutex_destroy(&sink->lock);
+	free(sink->path);
+	free(sink->queue);
+	free(sink);
+}
@@ -0,0 +1,52 @@
+#ifndef IRIS_SINK_H
+#define IRIS_SINK_H
+
+#include "iris.h"
+#include <pthread.h>
+
+/* A sink is where validated results go when iris isn't handing them
+   straight to Icinga.  Every sink runs on its own thread, fed by a
+   fixed-size ring that the reactor thread pushes into without ever
+   blocking; if the sink falls behind far enough to fill the ring,
+   new results are dropped (and counted) rather than stalling reads. */
+
+struct sink;
+struct sink_ops {
+	const char *name;
+	int  (*open)(struct sink *sink, const struct server *s);
+	int  (*write)(struct sink *sink, struct pdu *batch, int n);
+	void (*close)(struct sink *sink);
+};
+
+struct sink {
+	const struct sink_ops *ops;
+	char                  *path;
+	int                    fd;
+	void                  *data;
+
+	pthread_t       tid;
+	pthread_mutex_t lock;
+	pthread_cond_t  ready;
+	int             running;
+
+	struct pdu     *queue;
+	unsigned int    size;
+	unsigned int    head;
+	unsigned int    count;
+
+	unsigned int    batch;
+	time_t          linger;
+	struct timespec since;
+
+	unsigned long   written;
+	unsigned long   failed;
+	unsigned long   dropped;
+};
+
+struct sink *sink_new(const struct server *s);
+int sink_start(struct sink *sink);
+int sink_submit(struct sink *sink, const struct pdu *pdu);
+void sink_stop(struct sink *sink);
+void sink_stats(struct sink *sink);
+
+#endif
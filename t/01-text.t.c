@@ -21,7 +21,7 @@ int main(int argc, char **argv)
 {
 	plan_tests(2);
 	freopen("/dev/null", "w", stderr);
-	vdebug("%s: starting", __FILE__);
+	trace(IRIS_TRACE_ALL, "%s: starting", __FILE__);
 
 	char *got;
 
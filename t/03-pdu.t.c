@@ -6,7 +6,7 @@ int main(int argc, char **argv)
 {
 	plan_no_plan();
 	freopen("/dev/null", "w", stderr);
-	vdebug("%s: starting", __FILE__);
+	trace(IRIS_TRACE_ALL, "%s: starting", __FILE__);
 
 	struct pdu pdu, copy;
 	time_t now;
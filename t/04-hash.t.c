@@ -0,0 +1,106 @@
+#include "tap.c"
+#include "../iris.h"
+#include "dummy-calls.c"
+
+static void count(const char *key, size_t len, void *value, void *udata)
+{
+	(*(int*)udata)++;
+}
+
+int main(int argc, char **argv)
+{
+	plan_no_plan();
+
+	struct hash *h;
+	char key[32];
+	int i, n, found;
+
+	h = hash_new(0);
+	ok(h != NULL, "created an empty hash");
+	ok(h->size == 16, "with 16 slots to start with");
+	ok(hash_get(h, "web01", 5) == NULL, "nothing is found in an empty hash");
+
+	ok(hash_set(h, "web01", 5, "host") == 0, "set web01");
+	ok(hash_set(h, "web01\0http", 10, "service") == 0, "set web01/http");
+	ok(h->count == 2, "hash has 2 keys");
+	ok(hash_get(h, "web01", 5) && strcmp(hash_get(h, "web01", 5), "host") == 0,
+			"found web01");
+	ok(hash_get(h, "web01\0http", 10) && strcmp(hash_get(h, "web01\0http", 10), "service") == 0,
+			"found web01/http, with the NUL in its key");
+	ok(hash_get(h, "web01\0ssh", 9) == NULL, "web01/ssh is unknown");
+	ok(hash_get(h, "web0", 4) == NULL, "prefixes of keys don't match");
+
+	ok(hash_set(h, "web01", 5, "replaced") == 0, "set web01 again");
+	ok(h->count == 2, "hash still has 2 keys");
+	ok(strcmp(hash_get(h, "web01", 5), "replaced") == 0, "web01's value was replaced");
+
+	for (i = 0; i < 10000; i++) {
+		n = snprintf(key, sizeof(key), "host%d", i);
+		if (hash_set(h, key, n, (void*)(uintptr_t)(i + 1)) != 0)
+			break;
+	}
+	ok(i == 10000, "added 10000 more keys");
+	ok(h->count == 10002, "hash has 10002 keys");
+	ok(h->size >= 10002 / 3 * 4, "and grew to %u slots", h->size);
+
+	for (found = 0, i = 0; i < 10000; i++) {
+		n = snprintf(key, sizeof(key), "host%d", i);
+		if ((uintptr_t)hash_get(h, key, n) == i + 1)
+			found++;
+	}
+	ok(found == 10000, "all 10000 keys were found after growing");
+	ok(strcmp(hash_get(h, "web01\0http", 10), "service") == 0, "as were the first two");
+
+	n = 0;
+	hash_each(h, count, &n);
+	ok(n == 10002, "hash_each visited all 10002 keys");
+
+	/* every other one, so that plenty of runs get holes punched in them */
+	for (i = 0; i < 10000; i += 2) {
+		n = snprintf(key, sizeof(key), "host%d", i);
+		if ((uintptr_t)hash_del(h, key, n) != i + 1)
+			break;
+	}
+	ok(i == 10000, "deleted 5000 keys, getting their values back");
+	ok(h->count == 5002, "hash has 5002 keys left");
+	for (found = 0, i = 0; i < 10000; i++) {
+		n = snprintf(key, sizeof(key), "host%d", i);
+		if ((uintptr_t)hash_get(h, key, n) == (i % 2 ? i + 1 : 0))
+			found++;
+	}
+	ok(found == 10000, "deleted keys are gone, and the rest can still be found");
+	ok(hash_del(h, "host0", 5) == NULL, "deleting a key that isn't there finds nothing");
+	ok(hash_set(h, "host0", 5, "back") == 0 && strcmp(hash_get(h, "host0", 5), "back") == 0,
+			"a deleted key can be set again");
+
+	hash_free(h, NULL);
+	ok(hash_get(NULL, "web01", 5) == NULL, "hash_get on a NULL hash finds nothing");
+
+	h = hash_new(1000);
+	ok(h->size >= 1000 / 3 * 4, "hash_new(1000) sized for 1000 keys (%u slots)", h->size);
+	hash_free(h, NULL);
+
+	const char *a, *b;
+	h = hash_new(0);
+	strcpy(key, "web01");
+	a = intern(h, key, 5);
+	ok(a != NULL && a != key && strcmp(a, "web01") == 0, "interned a copy of web01");
+	key[0] = 'X';
+	ok(strcmp(a, "web01") == 0, "which doesn't change with the original");
+	b = intern(h, "web01", 5);
+	ok(b == a, "interning web01 again hands back the same copy");
+	ok(hash_get(h, "web01", 5) == a, "and so does looking it up");
+	ok(intern(h, "web01.example.com", 5) == a, "only len bytes are interned");
+	b = intern(h, "PING", 4);
+	ok(b != NULL && b != a && strcmp(b, "PING") == 0, "interned PING separately");
+	ok(h->count == 2, "2 names interned");
+	for (i = 0; i < 1000; i++) {
+		n = snprintf(key, sizeof(key), "svc%d", i);
+		intern(h, key, n);
+	}
+	ok(intern(h, "web01", 5) == a && intern(h, "PING", 4) == b,
+			"interned names stay put as the table grows");
+	hash_free(h, NULL);
+
+	return exit_status();
+}
@@ -4,9 +4,9 @@
 
 int main(int argc, char **argv)
 {
-	plan_tests(3);
+	plan_tests(12);
 	freopen("/dev/null", "w", stderr);
-	vdebug("%s: starting", __FILE__);
+	trace(IRIS_TRACE_ALL, "%s: starting", __FILE__);
 
 	int fd;
 	fd = net_bind("0.0.0.0", "5669");
@@ -23,5 +23,46 @@ int main(int argc, char **argv)
 	fd = net_bind("some.random.interface", "glort-port");
 	ok(fd < 0, "net_bind fails if getaddrinfo fails");
 
+	diag("Dual-stack wildcard bind");
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+	fd = net_bind(NULL, "5669");
+	ok(fd >= 0, "bound to *:5669");
+	ok(getsockname(fd, (struct sockaddr*)&ss, &len) == 0
+	 && (ss.ss_family == AF_INET6 || ss.ss_family == AF_INET),
+			"wildcard bind is IPv6 (dual-stack), or IPv4 on v4-only kernels");
+
+	int c = net_connect("127.0.0.1", 5669);
+	ok(c >= 0, "IPv4 connect to the wildcard listener");
+	close(c);
+	close(fd);
+
+	diag("Multi-address bind");
+	int fds[4], n;
+	n = net_bind_all("127.0.0.1:5669", "5668", fds, 4);
+	ok(n == 1, "net_bind_all bound 127.0.0.1:5669");
+	while (n > 0) close(fds[--n]);
+
+	n = net_bind_all("127.0.0.1", "5669", fds, 4);
+	ok(n == 1, "net_bind_all takes the default port for a bare address");
+	ok(n == 1 && net_bind_all("127.0.0.1", "5669", fds+1, 3) <= 0,
+			"net_bind_all fails on a listener conflict");
+	while (n > 0) close(fds[--n]);
+
+	n = net_bind_all("*:5669", "5668", fds, 4);
+	ok(n >= 1, "net_bind_all bound %d wildcard(s) for *:5669", n);
+	while (n > 0) close(fds[--n]);
+
+	n = net_bind_all("[::1]:5669", "5668", fds, 4);
+	if (n < 0) {
+		skip(2, "no IPv6 loopback here");
+	} else {
+		ok(n == 1, "net_bind_all bound [::1]:5669");
+		c = net_connect("[::1]", 5669);
+		ok(c >= 0, "IPv6 connect to [::1]:5669");
+		if (c >= 0) close(c);
+	}
+	while (n > 0) close(fds[--n]);
+
 	return exit_status();
 }
@@ -0,0 +1,67 @@
+#include "tap.c"
+#include "../iris.h"
+#include "dummy-calls.c"
+
+#define SOCK "t/tmp/iris.sock"
+
+int main(int argc, char **argv)
+{
+	plan_no_plan();
+	freopen("/dev/null", "w", stderr);
+	trace(IRIS_TRACE_ALL, "%s: starting", __FILE__);
+
+	int sockfd, epfd, fd, connfd;
+	struct client *c;
+	struct pdu pdu;
+
+	mkdir("t/tmp", 0777);
+	ok(net_bind_unix(NULL, 0) < 0, "net_bind_unix(NULL) fails");
+	ok(net_bind_unix("t/tmp/no/such/dir/iris.sock", 0) < 0, "net_bind_unix fails on a bad path");
+
+	sockfd = net_bind_unix(SOCK, 0);
+	ok(sockfd >= 0, "bound to unix:%s", SOCK);
+	close(sockfd);
+	sockfd = net_bind_unix(SOCK, 0);
+	ok(sockfd >= 0, "re-bound to unix:%s (stale socket file is removed)", SOCK);
+
+	ok((epfd = epoll_create(42)) >= 0, "[sanity] created an epoll fd");
+	ok(net_listener(epfd, sockfd, IRIS_PROTO_PDU, IRIS_CLIENT_TRUSTED) == 0,
+			"registered unix socket as a trusted PDU listener");
+	client_init(4);
+
+	ok(net_connect("unix:t/tmp/nonexistent.sock", 0) < 0, "net_connect to a missing socket fails");
+	fd = net_connect("unix:" SOCK, 0);
+	ok(fd >= 0, "connected to unix:%s", SOCK);
+
+	connfd = net_accept(sockfd, epfd);
+	ok(connfd >= 0, "accepted the unix socket connection");
+	c = client_find(connfd);
+	ok(c != NULL, "client registered for the connection");
+	ok(c && strcmp(c->addr, "<local>") == 0, "unix peers are <local>");
+	ok(c && (c->flags & IRIS_CLIENT_TRUSTED), "client inherits TRUSTED from the listener");
+	ok(c && c->proto == IRIS_PROTO_PDU, "client speaks PDU");
+
+	/** trusted unpacking **/
+	memset(&pdu, 0, sizeof(pdu));
+	pdu.ts = (uint32_t)time(NULL);
+	strcpy(pdu.host, "local");
+	ok(pdu_pack(&pdu) == 0, "packed a PDU");
+	pdu.crc32 = htonl(0xdecafbad);
+	ok(pdu_unpack_trusted(&pdu) == 0, "pdu_unpack_trusted ignores the CRC");
+	ok(pdu.crc32 == 0xdecafbad, "pdu_unpack_trusted leaves the CRC intact");
+
+	ok(pdu_pack(&pdu) == 0, "repacked the PDU");
+	pdu.crc32 = htonl(0xdecafbad);
+	ok(pdu_unpack(&pdu) != 0, "pdu_unpack still catches the CRC mismatch");
+
+	pdu.ts = (uint32_t)time(NULL) - 901;
+	ok(pdu_pack(&pdu) == 0, "repacked the PDU (stale)");
+	ok(pdu_unpack_trusted(&pdu) != 0, "pdu_unpack_trusted still checks packet age");
+
+	close(fd);
+	client_close(connfd);
+	close(sockfd);
+	unlink(SOCK);
+
+	return exit_status();
+}
@@ -206,7 +206,7 @@ int main(int argc, char **argv)
 
 
 	freopen("/dev/null", "w", stderr);
-	vdebug("%s: starting", __FILE__);
+	trace(IRIS_TRACE_ALL, "%s: starting", __FILE__);
 
 	return exit_status();
 }
@@ -0,0 +1,128 @@
+#include "tap.c"
+#include <sys/wait.h>
+#include "../iris.h"
+#include "dummy-calls.c"
+
+#define SPOOL "t/tmp/spool"
+
+static int segments(void)
+{
+	struct dirent *d;
+	DIR *dh = opendir(SPOOL);
+	int n = 0;
+
+	if (!dh) return -1;
+	while ((d = readdir(dh)) != NULL)
+		if (d->d_name[0] != '.') n++;
+	closedir(dh);
+	return n;
+}
+
+/* a send for spool_replay_via that only ever gets `confirm' through */
+static int confirm = 0;
+static int confirming(int fd, struct pdu *pdus, int n)
+{
+	return n < confirm ? n : confirm;
+}
+
+int main(int argc, char **argv)
+{
+	plan_no_plan();
+	freopen("/dev/null", "w", stderr);
+	trace(IRIS_TRACE_ALL, "%s: starting", __FILE__);
+
+	struct pdu packets[100], got;
+	time_t now;
+	int pipefd[2], i, n;
+
+	system("/bin/rm -rf " SPOOL);
+	ok(mkdir(SPOOL, 0777) == 0, "[sanity] created spool directory %s", SPOOL);
+
+	time(&now);
+	memset(packets, 0, sizeof(packets));
+	for (i = 0; i < 100; i++) {
+		snprintf(packets[i].host,    IRIS_PDU_HOST_LEN,    "host%d", i);
+		snprintf(packets[i].service, IRIS_PDU_SERVICE_LEN, "service%d", i);
+		snprintf(packets[i].output,  IRIS_PDU_OUTPUT_LEN,  "OK - result #%d", i);
+		packets[i].ts = (uint32_t)now;
+		pdu_pack(&packets[i]);
+	}
+
+	ok(spool_write(NULL, packets, 4) < 0, "spool_write(NULL dir) fails");
+	ok(spool_write("t/tmp/no/such/dir", packets, 4) < 0, "spool_write to missing dir fails");
+	ok(spool_write(SPOOL, packets, 0) == 0, "spool_write of no packets is a no-op");
+	ok(segments() == 0, "no segment created for an empty spool_write");
+
+	ok(spool_write(SPOOL, packets,    70) == 70, "spooled 70 packets");
+	ok(spool_write(SPOOL, packets+70, 30) == 30, "spooled 30 more packets");
+	ok(segments() == 2, "spool holds two segments");
+
+	/** replay everything, in order **/
+	ok(pipe(pipefd) == 0, "[sanity] created pipe structure");
+	if (fork() == 0) {
+		close(pipefd[0]);
+		_exit(spool_replay(SPOOL, pipefd[1], 0) == 100 ? 0 : 1);
+	}
+	close(pipefd[1]);
+	for (n = 0; pdu_read(pipefd[0], (uint8_t*)&got, 0) == sizeof(got); n++) {
+		if (pdu_unpack(&got) != 0 || strcmp(got.host, packets[n].host) != 0)
+			break;
+	}
+	close(pipefd[0]);
+	wait(&i);
+	ok(WIFEXITED(i) && WEXITSTATUS(i) == 0, "spool_replay reported 100 replayed results");
+	ok(n == 100, "read back %d/100 spooled packets, in order", n);
+	ok(segments() == 0, "replayed segments are removed");
+
+	/** rate-limited replay **/
+	struct timespec start, end;
+	ok(spool_write(SPOOL, packets, 20) == 20, "spooled 20 packets");
+	int null = open("/dev/null", O_WRONLY);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ok(spool_replay(SPOOL, null, 10) == 20, "replayed 20 packets at 10/s");
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ok(end.tv_sec - start.tv_sec >= 1, "rate-limited replay took at least a second");
+	close(null);
+
+	/** interrupted replay requeues the remainder **/
+	signal(SIGPIPE, SIG_IGN);
+	ok(spool_write(SPOOL, packets, 10) == 10, "spooled 10 packets");
+	ok(pipe(pipefd) == 0, "[sanity] created pipe structure");
+	close(pipefd[0]);
+	ok(spool_replay(SPOOL, pipefd[1], 0) < 0, "spool_replay to a broken pipe fails");
+	close(pipefd[1]);
+	ok(segments() == 1, "failed segment is left in the spool");
+
+	null = open("/dev/null", O_WRONLY);
+	ok(spool_replay(SPOOL, null, 0) == 10, "requeued segment still holds all 10 packets");
+	close(null);
+	ok(segments() == 0, "spool is empty");
+
+	/** results spooled before a long outage are still good on replay **/
+	for (i = 0; i < 5; i++) {
+		pdu_unpack(&packets[i]);
+		packets[i].ts = (uint32_t)(now - 3600);
+		pdu_pack(&packets[i]);
+	}
+	ok(spool_write(SPOOL, packets, 5) == 5, "spooled 5 hour-old packets");
+	ok(pipe(pipefd) == 0, "[sanity] created pipe structure");
+	ok(spool_replay(SPOOL, pipefd[1], 0) == 5, "replayed the hour-old packets");
+	close(pipefd[1]);
+	for (n = 0; pdu_read(pipefd[0], (uint8_t*)&got, 0) == sizeof(got); n++) {
+		if (pdu_unpack(&got) != 0 || got.ts < (uint32_t)now)
+			break;
+	}
+	close(pipefd[0]);
+	ok(n == 5, "all %d/5 replayed packets were re-stamped, and unpack", n);
+
+	/** a segment stays until all of it has been confirmed **/
+	ok(spool_write(SPOOL, packets, 10) == 10, "spooled 10 packets");
+	confirm = 3;
+	ok(spool_replay_via(SPOOL, -1, 0, confirming) < 0, "replay fails when only 3 are confirmed");
+	ok(segments() == 1, "the segment is still in the spool");
+	confirm = 100;
+	ok(spool_replay_via(SPOOL, -1, 0, confirming) == 7, "the other 7 are replayed next time");
+	ok(segments() == 0, "and then the segment is gone");
+
+	return exit_status();
+}
@@ -2,20 +2,26 @@
 #include "../iris.h"
 #include "dummy-calls.c"
 
+extern struct client_stats CLIENT_STATS;
+
 int main(int argc, char **argv)
 {
 	plan_no_plan();
 
 	struct sockaddr_in client1, client2, client3;
+	struct sockaddr_in6 client4, client5;
 	struct client *res;
 
 	memset(&client1, 0, sizeof(struct sockaddr_in));
+	client1.sin_family = AF_INET;
 	ok(inet_pton(AF_INET, "10.15.16.17", &(client1.sin_addr)) == 1,
 			"converted 10.15.16.17 for client1");
 	memset(&client2, 0, sizeof(struct sockaddr_in));
+	client2.sin_family = AF_INET;
 	ok(inet_pton(AF_INET, "10.0.0.9", &(client2.sin_addr)) == 1,
 			"converted 10.0.0.9 for client2");
 	memset(&client3, 0, sizeof(struct sockaddr_in));
+	client3.sin_family = AF_INET;
 	ok(inet_pton(AF_INET, "192.168.7.207", &(client3.sin_addr)) == 1,
 			"converted 192.168.7.207 for client3");
 
@@ -35,20 +41,52 @@ int main(int argc, char **argv)
 	ok(!client_addr(4), "no client at fd 4");
 
 
-	ok(client_new(4, &(client1.sin_addr)), "registered client1 with fd 4");
-	ok(client_new(5, &(client2.sin_addr)), "registered client2 with fd 5");
-	ok(client_new(6, &(client3.sin_addr)), "registered client3 with fd 6");
+	ok(client_new(4, (struct sockaddr*)&client1), "registered client1 with fd 4");
+	ok(client_new(5, (struct sockaddr*)&client2), "registered client2 with fd 5");
+	ok(client_new(6, (struct sockaddr*)&client3), "registered client3 with fd 6");
 
 	ok(client_find(6), "found client for fd 4");
 	ok(strcmp(client_addr(6), "192.168.7.207") == 0,
 			"Correct peer address for client3");
 
-	ok(!client_new(89, &(client1.sin_addr)), "cannot register new client; at capacity");
+	ok(!client_new(89, (struct sockaddr*)&client1), "cannot register new client; at capacity");
 	client_close(141); pass("client_close(<bad fd>) did not segfault");
 	client_close(5);
-	ok(client_new(89, &(client1.sin_addr)), "resuse of slots in the middle works");
+	ok(client_new(89, (struct sockaddr*)&client1), "resuse of slots in the middle works");
 	ok(strcmp(client_addr(89), "10.15.16.17") == 0,
 			"Correct peer address for client2 / fd 89");
 
+	memset(&client4, 0, sizeof(struct sockaddr_in6));
+	client4.sin6_family = AF_INET6;
+	ok(inet_pton(AF_INET6, "2001:db8:ffff:ffff:ffff:ffff:ffff:ffff", &(client4.sin6_addr)) == 1,
+			"converted a (longest-possible) IPv6 address for client4");
+	memset(&client5, 0, sizeof(struct sockaddr_in6));
+	client5.sin6_family = AF_INET6;
+	ok(inet_pton(AF_INET6, "::ffff:10.1.2.3", &(client5.sin6_addr)) == 1,
+			"converted a v4-mapped IPv6 address for client5");
+
+	client_close(4);
+	client_close(6);
+	ok(client_new(4, (struct sockaddr*)&client4), "registered client4 with fd 4");
+	ok(strcmp(client_addr(4), "2001:db8:ffff:ffff:ffff:ffff:ffff:ffff") == 0,
+			"Correct peer address for IPv6 client4");
+	ok(client_new(6, (struct sockaddr*)&client5), "registered client5 with fd 6");
+	ok(strcmp(client_addr(6), "10.1.2.3") == 0,
+			"v4-mapped peer address is shown as plain IPv4");
+
+	/* the table grows a chunk at a time, up to max_clients */
+	int i, n = IRIS_CLIENT_CHUNK * 2 + 10;
+	ok(client_init(n) == n, "allocated enough space for %d client objects", n);
+	ok(CLIENT_STATS.allocated == 0, "... lazily");
+	ok(client_new(1000, NULL) != NULL, "registered a client with fd 1000");
+	ok(CLIENT_STATS.allocated == IRIS_CLIENT_CHUNK, "which allocated one chunk of slots");
+	for (i = 1; i < n; i++)
+		if (!client_new(1000 + i, NULL)) break;
+	ok(i == n, "registered %d/%d clients", i, n);
+	ok(CLIENT_STATS.allocated == n, "the last chunk stops at max_clients");
+	ok(!client_new(5000, NULL), "cannot register new client; at capacity");
+	ok(client_find(1000 + n - 1) == client_at(n - 1), "found the last client, in the last chunk");
+	ok(client_find(1000 + n - 1)->pdu == NULL, "an idle client has no receive buffer");
+
 	return exit_status();
 }
@@ -0,0 +1,90 @@
+#include "tap.c"
+#include "../iris.h"
+
+int num_results = 0;
+
+int iris_call_submit_result(struct pdu *pdu) { num_results++; return 0; }
+int iris_call_recv_data(int fd) { return recv_data(fd); }
+int iris_call_register_fd(int fd) { return 0; }
+
+extern unsigned int READY_COUNT;
+
+/* a pipe with n packed PDUs waiting in it, and a client to read them */
+static struct client* stuffed(int n)
+{
+	struct pdu pdu;
+	struct client *c;
+	int pfd[2], i;
+
+	if (pipe(pfd) != 0 || nonblocking(pfd[0]) != 0)
+		return NULL;
+	fcntl(pfd[1], F_SETPIPE_SZ, 1024 * 1024);
+
+	memset(&pdu, 0, sizeof(pdu));
+	strcpy(pdu.host, "bursty");
+	for (i = 0; i < n; i++) {
+		pdu.ts = (uint32_t)time(NULL);
+		pdu_pack(&pdu);
+		if (write(pfd[1], &pdu, sizeof(pdu)) != sizeof(pdu))
+			return NULL;
+		pdu_unpack(&pdu);
+	}
+	close(pfd[1]);
+
+	if (!(c = client_new(pfd[0], NULL)))
+		return NULL;
+	return c;
+}
+
+int main(int argc, char **argv)
+{
+	plan_no_plan();
+	freopen("/dev/null", "w", stderr);
+
+	struct client *a, *b;
+	int fd, rounds;
+
+	ok(client_init(4) == 4, "allocated 4 client slots");
+	ok(ready_pop() == -1, "ready list starts out empty");
+
+	a = stuffed(IRIS_PDU_BUDGET * 3 + 1);
+	ok(a != NULL, "[sanity] client a has %d PDUs waiting", IRIS_PDU_BUDGET * 3 + 1);
+	fd = a->fd;
+
+	recv_data(fd);
+	ok(num_results == IRIS_PDU_BUDGET, "first read stops after %d PDUs", IRIS_PDU_BUDGET);
+	ok(a->flags & IRIS_CLIENT_READY, "client a is flagged as ready");
+	ok(READY_COUNT == 1, "client a is on the ready list");
+	ok(a->pdu == NULL, "client a gave back its receive buffer in between");
+
+	recv_data(fd);
+	ok(num_results == IRIS_PDU_BUDGET * 2, "a second read gets another budget's worth");
+	ok(READY_COUNT == 1, "client a is not put on the ready list twice");
+
+	ok(ready_pop() == fd, "ready list hands back client a");
+	a->flags &= ~IRIS_CLIENT_READY;
+	ok(ready_pop() == -1, "ready list is empty again");
+
+	/** two bursty clients take turns **/
+	num_results = 0;
+	a = stuffed(IRIS_PDU_BUDGET * 2);
+	b = stuffed(IRIS_PDU_BUDGET * 2);
+	ok(a && b, "[sanity] clients a and b have %d PDUs each", IRIS_PDU_BUDGET * 2);
+	recv_data(a->fd);
+	recv_data(b->fd);
+	ok(num_results == IRIS_PDU_BUDGET * 2, "each got one budget");
+	ok(ready_pop() == a->fd, "a ran out of budget first, so a goes first");
+	ok(ready_pop() == b->fd, "then b");
+
+	/** without room on the ready list, clients just read it all **/
+	extern unsigned int READY_SIZE;
+	READY_SIZE = 0;
+	num_results = 0;
+	a = stuffed(IRIS_PDU_BUDGET * 2 + 5);
+	for (rounds = 0; a->fd != -1; rounds++)
+		recv_data(a->fd);
+	ok(num_results == IRIS_PDU_BUDGET * 2 + 5, "got all %d PDUs", IRIS_PDU_BUDGET * 2 + 5);
+	ok(rounds == 1, "in one go, when there's no ready list");
+
+	return exit_status();
+}
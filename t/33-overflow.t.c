@@ -0,0 +1,125 @@
+#include "tap.c"
+#include "../iris.h"
+
+int iris_call_submit_result(struct pdu *pdu) { return 0; }
+int iris_call_recv_data(int fd) { return recv_data(fd); }
+int iris_call_register_fd(int fd) { return 0; }
+
+extern int OVERFLOW_POLICY;
+extern time_t MAX_LIFETIME;
+extern struct client_stats CLIENT_STATS;
+
+/* connects, and sends a PDU so that TCP_DEFER_ACCEPT lets it through */
+static int agent(void)
+{
+	struct pdu pdu;
+	int fd;
+
+	if ((fd = net_connect("127.0.0.1", 5671)) < 0)
+		return -1;
+	memset(&pdu, 0, sizeof(pdu));
+	strcpy(pdu.host, "crowded");
+	pdu.ts = (uint32_t)time(NULL);
+	pdu_pack(&pdu);
+	if (write(fd, &pdu, sizeof(pdu)) != sizeof(pdu))
+		return -1;
+	return fd;
+}
+
+static void accept_all(int sockfd, int epfd)
+{
+	usleep(100 * 1000);
+	while (net_accept(sockfd, epfd) >= 0)
+		;
+}
+
+/* has the server hung up on us? */
+static int hungup(int fd)
+{
+	char buf[sizeof(struct pdu)];
+	usleep(50 * 1000);
+	return read(fd, buf, sizeof(buf)) == 0
+	    || (errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+int main(int argc, char **argv)
+{
+	plan_no_plan();
+	freopen("/dev/null", "w", stderr);
+
+	int sockfd, epfd, a, b, c, d;
+
+	ok(client_init(2) == 2, "allocated 2 client slots");
+	sockfd = net_bind("127.0.0.1", "5671");
+	ok(sockfd >= 0, "[sanity] bound to 127.0.0.1:5671");
+	epfd = net_poller(sockfd);
+	ok(epfd >= 0, "[sanity] set up epoll");
+
+	/* reject (the default) */
+	a = agent(); b = agent(); c = agent();
+	nonblocking(a); nonblocking(b); nonblocking(c);
+	accept_all(sockfd, epfd);
+	ok(CLIENT_STATS.accepted == 3, "accepted all 3 connections");
+	ok(CLIENT_STATS.active == 2, "2 of them got a slot");
+	ok(CLIENT_STATS.rejected == 1, "the third was rejected");
+	ok(hungup(c), "... and hung up on");
+	ok(!hungup(a) && !hungup(b), "the first two are still connected");
+
+	/* queue */
+	OVERFLOW_POLICY = IRIS_OVERFLOW_QUEUE;
+	close(c);
+	c = agent();
+	nonblocking(c);
+	accept_all(sockfd, epfd);
+	ok(CLIENT_STATS.active == 2, "still 2 active clients");
+	ok(CLIENT_STATS.waiting == 1, "with 1 waiting");
+	ok(!hungup(c), "the waiting connection is held open");
+
+	client_close(client_at(0)->fd);
+	ok(CLIENT_STATS.active == 2, "closing a client admits the waiting one");
+	ok(CLIENT_STATS.waiting == 0, "which leaves nobody waiting");
+	ok(hungup(a), "the closed client was hung up on");
+
+	d = agent();
+	nonblocking(d);
+	accept_all(sockfd, epfd);
+	ok(CLIENT_STATS.waiting == 1, "a new connection is queued");
+	MAX_LIFETIME = -2;
+	clients_purge();
+	MAX_LIFETIME = 20;
+	ok(CLIENT_STATS.expired == 1, "and given up on once it has waited too long");
+	ok(CLIENT_STATS.waiting == 0, "leaving nobody waiting");
+	ok(hungup(d), "the expired connection was hung up on");
+	close(d);
+
+	/* evict; c (in slot 0) has been quiet the longest */
+	OVERFLOW_POLICY = IRIS_OVERFLOW_EVICT;
+	client_at(0)->last -= 60;
+	d = agent();
+	nonblocking(d);
+	accept_all(sockfd, epfd);
+	ok(CLIENT_STATS.evicted == 1, "a new connection evicts an idle client");
+	ok(CLIENT_STATS.active == 2, "keeping 2 active clients");
+	ok(!hungup(d), "the new connection is held open");
+	ok(hungup(c), "the longest-idle client was hung up on");
+	ok(!hungup(b), "the other one wasn't");
+
+	/* admin clients are never evicted */
+	close(c);
+	client_at(0)->last -= 60;
+	client_at(0)->proto = IRIS_PROTO_ADMIN;
+	c = agent();
+	nonblocking(c);
+	accept_all(sockfd, epfd);
+	ok(CLIENT_STATS.evicted == 2, "another new connection evicts another client");
+	ok(!hungup(d), "but not the (idler) admin one");
+	ok(hungup(b), "... the other one instead");
+	client_at(0)->proto = IRIS_PROTO_PDU;
+
+	ok(CLIENT_STATS.peak == 2, "peak usage was 2 slots");
+
+	close(a); close(b); close(c); close(d);
+	client_deinit();
+	close(sockfd);
+	return exit_status();
+}
@@ -0,0 +1,86 @@
+#include "tap.c"
+#include "../iris.h"
+
+int num_results = 0;
+
+int iris_call_submit_result(struct pdu *pdu)
+{
+	num_results++;
+	return strcmp(pdu->host, "full") == 0 ? IRIS_ACK_QUEUE_FULL : IRIS_ACK_OK;
+}
+int iris_call_recv_data(int fd) { return recv_data(fd); }
+int iris_call_register_fd(int fd) { return 0; }
+
+static int send_pdus(int fd, int n, int bogus)
+{
+	struct pdu pdu;
+	int i;
+
+	memset(&pdu, 0, sizeof(pdu));
+	for (i = 1; i <= n; i++) {
+		strcpy(pdu.host, i == -bogus ? "full" : "acked");
+		pdu.ts = (uint32_t)time(NULL);
+		pdu_pack(&pdu);
+		if (i == bogus)
+			pdu.crc32 ^= 0xdead;
+		if (write(fd, &pdu, sizeof(pdu)) != sizeof(pdu))
+			return -1;
+		pdu_unpack(&pdu);
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	plan_no_plan();
+	freopen("/dev/null", "w", stderr);
+
+	struct client *c;
+	struct ack ack;
+	int sv[2];
+
+	ok(client_init(4) == 4, "allocated 4 client slots");
+	ok(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "[sanity] got a socketpair");
+	nonblocking(sv[0]);
+
+	c = client_new(sv[0], NULL);
+	c->flags |= IRIS_CLIENT_ACK;
+
+	ok(send_pdus(sv[1], 5, 0) == 0, "[sanity] sent 5 PDUs");
+	recv_data(sv[0]);
+	ok(num_results == 5, "got all 5 results");
+	ok(ack_read(sv[1], &ack) == 0, "read an ack frame");
+	ok(ack.type == IRIS_ACK_ACCEPTED && ack.seq == 5, "everything through no. 5 was accepted");
+
+	ok(send_pdus(sv[1], 3, 2) == 0, "[sanity] sent 3 more PDUs, the second one corrupt");
+	recv_data(sv[0]);
+	ok(num_results == 7, "got 2 of the 3 results");
+	ok(ack_read(sv[1], &ack) == 0, "read an ack frame");
+	ok(ack.type == IRIS_ACK_REJECTED && ack.seq == 7, "no. 7 was rejected");
+	ok(ack.reason == IRIS_ACK_BOGUS, "... for being bogus (%s)", ack_reason(ack.reason));
+	ok(ack_read(sv[1], &ack) == 0, "read another ack frame");
+	ok(ack.type == IRIS_ACK_ACCEPTED && ack.seq == 8, "then everything through no. 8 was dealt with");
+
+	ok(send_pdus(sv[1], 2, -1) == 0, "[sanity] sent 2 more PDUs, the first with nowhere to go");
+	recv_data(sv[0]);
+	ok(num_results == 9, "both were handed on");
+	ok(ack_read(sv[1], &ack) == 0, "read an ack frame");
+	ok(ack.type == IRIS_ACK_REJECTED && ack.seq == 9, "no. 9 was rejected");
+	ok(ack.reason == IRIS_ACK_QUEUE_FULL, "... for want of room (%s)", ack_reason(ack.reason));
+	ok(ack_read(sv[1], &ack) == 0, "read another ack frame");
+	ok(ack.type == IRIS_ACK_ACCEPTED && ack.seq == 10, "then everything through no. 10 was dealt with");
+
+	recv_data(sv[0]);
+	nonblocking(sv[1]);
+	ok(ack_read(sv[1], &ack) != 0 && errno == EAGAIN, "nothing new, no new ack");
+
+	/* whatever is left gets acknowledged before hanging up */
+	ok(send_pdus(sv[1], 1, 0) == 0, "[sanity] sent one more PDU");
+	shutdown(sv[1], SHUT_WR);
+	recv_data(sv[0]);
+	ok(c->fd == -1, "client is closed at EOF");
+	ok(ack_read(sv[1], &ack) == 0 && ack.seq == 11, "after acknowledging no. 11");
+
+	close(sv[1]);
+	return exit_status();
+}
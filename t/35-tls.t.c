@@ -0,0 +1,127 @@
+#include "tap.c"
+#include "../iris.h"
+#include <sys/wait.h>
+
+int num_results = 0;
+
+int iris_call_submit_result(struct pdu *pdu) { num_results++; return 0; }
+int iris_call_recv_data(int fd) { return recv_data(fd); }
+int iris_call_register_fd(int fd) { return 0; }
+
+#ifndef HAVE_TLS
+int main(int argc, char **argv)
+{
+	plan_skip_all("built without TLS support (make TLS=1)");
+	return exit_status();
+}
+#else
+
+extern struct client_stats CLIENT_STATS;
+
+/* connects, sends n PDUs over TLS, and hangs up; returns the session */
+static SSL_SESSION* agent(SSL_CTX *ctx, SSL_SESSION *resume, int n)
+{
+	struct pdu pdu;
+	SSL_SESSION *sess;
+	SSL *ssl;
+	char buf[64];
+	int fd, i;
+
+	if ((fd = net_connect("127.0.0.1", 5672)) < 0)
+		_exit(1);
+	ssl = SSL_new(ctx);
+	SSL_set_fd(ssl, fd);
+	if (resume)
+		SSL_set_session(ssl, resume);
+	if (SSL_connect(ssl) != 1)
+		_exit(2);
+
+	memset(&pdu, 0, sizeof(pdu));
+	strcpy(pdu.host, "encrypted");
+	for (i = 0; i < n; i++) {
+		pdu.ts = (uint32_t)time(NULL);
+		pdu_pack(&pdu);
+		if (SSL_write(ssl, &pdu, sizeof(pdu)) != sizeof(pdu))
+			_exit(3);
+		pdu_unpack(&pdu);
+	}
+	SSL_shutdown(ssl);
+	while (SSL_read(ssl, buf, sizeof(buf)) > 0)
+		;
+	sess = SSL_get1_session(ssl);
+	SSL_free(ssl);
+	close(fd);
+	return sess;
+}
+
+/* runs the reactor until the agent is done (or it's been too long) */
+static void serve(int sockfd, int epfd, pid_t pid)
+{
+	struct epoll_event ev[8];
+	int i, n, status;
+	time_t give_up = time(NULL) + 10;
+
+	while (time(NULL) < give_up) {
+		n = epoll_wait(epfd, ev, 8, 50);
+		for (i = 0; i < n; i++) {
+			int fd = ev[i].data.fd;
+			if (fd == sockfd) {
+				while ((fd = net_accept(sockfd, epfd)) >= 0)
+					recv_data(fd);
+			} else {
+				recv_data(fd);
+			}
+		}
+		if (n == 0 && waitpid(pid, &status, WNOHANG) == pid)
+			return;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	plan_no_plan();
+	freopen("/dev/null", "w", stderr);
+
+	struct server s;
+	int sockfd, tlsfd, epfd;
+	pid_t pid;
+
+	server_init(&s);
+	ok(tls_init(&s) != 0, "tls_init fails without a certificate and key");
+	s.tls_cert = "t/conf/tls.crt";
+	s.tls_key  = "t/conf/tls.key";
+	ok(tls_init(&s) == 0, "tls_init loads t/conf/tls.{crt,key}");
+
+	ok(client_init(4) == 4, "allocated 4 client slots");
+	sockfd = net_bind("127.0.0.1", "5673");
+	ok(sockfd >= 0, "[sanity] bound to 127.0.0.1:5673");
+	epfd = net_poller(sockfd);
+	ok(epfd >= 0, "[sanity] set up epoll");
+	tlsfd = net_bind("127.0.0.1", "5672");
+	ok(tlsfd >= 0 && net_listener(epfd, tlsfd, IRIS_PROTO_PDU, IRIS_CLIENT_TLS) == 0,
+			"[sanity] listening for TLS on 127.0.0.1:5672");
+
+	if ((pid = fork()) == 0) {
+		SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+		SSL_SESSION *sess;
+		SSL_CTX_load_verify_locations(ctx, "t/conf/tls.crt", NULL);
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+
+		sess = agent(ctx, NULL, 3);
+		agent(ctx, sess, 2);
+		_exit(0);
+	}
+	serve(tlsfd, epfd, pid);
+
+	ok(num_results == 5, "got all 5 results over TLS (got %d)", num_results);
+	ok(CLIENT_STATS.handshakes == 2, "did 2 handshakes");
+	ok(CLIENT_STATS.resumed == 1, "the second one resumed the first's session");
+	ok(CLIENT_STATS.tls_failed == 0, "no TLS failures");
+	ok(CLIENT_STATS.active == 0, "both connections were closed at EOF");
+
+	client_deinit();
+	close(tlsfd);
+	close(sockfd);
+	return exit_status();
+}
+#endif
@@ -0,0 +1,129 @@
+#include "tap.c"
+#include "../iris.h"
+#include <pthread.h>
+#include <sys/wait.h>
+
+#define PORT      "5674"
+#define SENDERS   8
+#define RESULTS   20000
+
+volatile int num_results = 0;
+
+int iris_call_submit_result(struct pdu *pdu) { __sync_fetch_and_add(&num_results, 1); return 0; }
+int iris_call_recv_data(int fd) { return recv_data(fd); }
+int iris_call_register_fd(int fd) { return 0; }
+
+int sockfd, epfd;
+
+static void* reactor(void *udata)
+{
+	mainloop(sockfd, epfd);
+	return NULL;
+}
+
+static int connected(void)
+{
+	struct sockaddr_in sa;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port   = htons(atoi(PORT));
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) != 0)
+		return -1;
+	return fd;
+}
+
+/* writes every PDU in two halves, and now and then hangs up and
+   reconnects, so a reload is bound to catch someone mid-PDU, and
+   someone else waiting to be accepted */
+static int sender(void)
+{
+	struct pdu pdu;
+	int fds[SENDERS], i, f;
+
+	for (f = 0; f < SENDERS; f++)
+		if ((fds[f] = connected()) < 0)
+			return 1;
+
+	memset(&pdu, 0, sizeof(pdu));
+	strcpy(pdu.host, "reloaded");
+	for (i = 0; i < RESULTS; i++) {
+		f = i % SENDERS;
+		if (i % 1000 == 999) {
+			close(fds[f]);
+			if ((fds[f] = connected()) < 0)
+				return 1;
+		}
+		pdu.ts = (uint32_t)time(NULL);
+		pdu_pack(&pdu);
+		if (write(fds[f], &pdu, 1000) != 1000
+		 || write(fds[f], (char*)&pdu + 1000, sizeof(pdu) - 1000) != sizeof(pdu) - 1000)
+			return 1;
+		pdu_unpack(&pdu);
+	}
+	for (f = 0; f < SENDERS; f++)
+		close(fds[f]);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	plan_no_plan();
+	freopen("/dev/null", "w", stderr);
+
+	struct server s;
+	pthread_t tid;
+	pid_t pid;
+	int status = -1, reloads = 0, adopted = 1, handed = 0, waited;
+
+	server_init(&s);
+	s.max_clients = 64;
+	ok(iris_adopt(&s, &sockfd, &epfd) == 1, "nothing to adopt on a cold start");
+
+	ok(client_init(s.max_clients) == 64, "allocated 64 client slots");
+	sockfd = net_bind("127.0.0.1", PORT);
+	ok(sockfd >= 0, "[sanity] bound to 127.0.0.1:" PORT);
+	epfd = net_poller(sockfd);
+	ok(epfd >= 0, "[sanity] set up epoll");
+	ok(pthread_create(&tid, NULL, reactor, NULL) == 0, "[sanity] started the reactor");
+
+	if ((pid = fork()) == 0)
+		_exit(sender());
+
+	/* reload, over and over, until the sender is done */
+	while (waitpid(pid, &status, WNOHANG) == 0) {
+		usleep(10 * 1000);
+		mainloop_stop(IRIS_STOP_PAUSE);
+		pthread_join(tid, NULL);
+
+		handed += iris_handoff(sockfd, epfd) == 0;
+		if (client_at(0) != NULL || !getenv(IRIS_HANDOFF_ENV))
+			break;
+
+		/* the new copy starts out like any other */
+		sockfd = epfd = -1;
+		client_init(s.max_clients);
+		usleep(5 * 1000);
+
+		adopted = iris_adopt(&s, &sockfd, &epfd);
+		if (adopted != 0 || pthread_create(&tid, NULL, reactor, NULL) != 0)
+			break;
+		reloads++;
+	}
+	ok(WIFEXITED(status) && WEXITSTATUS(status) == 0, "sender sent all %d results", RESULTS);
+	ok(reloads >= 3, "reloaded %d times while it did", reloads);
+	ok(handed == reloads && adopted == 0, "every handoff was taken over");
+	ok(getenv(IRIS_HANDOFF_ENV) == NULL, "and cleared from the environment");
+
+	for (waited = 0; num_results < RESULTS && waited < 500; waited++)
+		usleep(10 * 1000);
+	ok(num_results == RESULTS, "got all %d results (%d)", RESULTS, num_results);
+
+	mainloop_stop(IRIS_STOP_PAUSE);
+	pthread_join(tid, NULL);
+	ok(1, "reactor stopped");
+
+	return exit_status();
+}
@@ -0,0 +1,123 @@
+#include "tap.c"
+#include "../iris.h"
+#include <pthread.h>
+
+#define PORT "5675"
+
+volatile int num_results = 0;
+
+int iris_call_submit_result(struct pdu *pdu) { __sync_fetch_and_add(&num_results, 1); return 0; }
+int iris_call_recv_data(int fd) { return recv_data(fd); }
+int iris_call_register_fd(int fd) { return 0; }
+
+extern struct client_stats CLIENT_STATS;
+int sockfd, epfd;
+volatile int stopped = 0;
+
+static void* reactor(void *udata)
+{
+	mainloop(sockfd, epfd);
+	stopped = 1;
+	return NULL;
+}
+
+static int agent(void)
+{
+	struct sockaddr_in sa;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port   = htons(atoi(PORT));
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* n whole PDUs, then the first half of one more if half is set */
+static int send_pdus(int fd, int n, int half)
+{
+	struct pdu pdu;
+	int i;
+
+	memset(&pdu, 0, sizeof(pdu));
+	strcpy(pdu.host, "draining");
+	pdu.ts = (uint32_t)time(NULL);
+	pdu_pack(&pdu);
+	for (i = 0; i < n; i++)
+		if (write(fd, &pdu, sizeof(pdu)) != sizeof(pdu))
+			return -1;
+	if (half && write(fd, &pdu, 1000) != 1000)
+		return -1;
+	return 0;
+}
+
+static int hungup(int fd)
+{
+	char c;
+	struct timeval tv = { 1, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	return read(fd, &c, 1) == 0;
+}
+
+int main(int argc, char **argv)
+{
+	plan_no_plan();
+	freopen("/dev/null", "w", stderr);
+
+	struct timespec start, end;
+	struct pdu pdu;
+	pthread_t tid;
+	int a, b, c, waited;
+
+	ok(client_init(8) == 8, "allocated 8 client slots");
+	sockfd = net_bind("127.0.0.1", PORT);
+	ok(sockfd >= 0, "[sanity] bound to 127.0.0.1:" PORT);
+	epfd = net_poller(sockfd);
+	ok(epfd >= 0, "[sanity] set up epoll");
+	ok(pthread_create(&tid, NULL, reactor, NULL) == 0, "[sanity] started the reactor");
+
+	a = agent(); b = agent(); c = agent();
+	ok(a >= 0 && b >= 0 && c >= 0, "[sanity] connected 3 agents");
+	ok(send_pdus(b, 1, 0) == 0, "[sanity] b sent a result, and then went quiet");
+
+	/* a is caught mid-PDU, c has a couple waiting to be read */
+	ok(send_pdus(a, 3, 1) == 0, "[sanity] a sent 3 results, and half of a fourth");
+	ok(send_pdus(c, 2, 0) == 0, "[sanity] c sent 2 results");
+	for (waited = 0; CLIENT_STATS.active < 3 && waited < 100; waited++)
+		usleep(10 * 1000);
+	ok(CLIENT_STATS.active == 3, "[sanity] all 3 were accepted");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	mainloop_stop(IRIS_STOP_DRAIN);
+	usleep(200 * 1000);
+	ok(!stopped, "reactor is still waiting on a's last PDU");
+	ok(agent() < 0, "new connections are refused while draining");
+	ok(hungup(b), "b was hung up on, having nothing more to say");
+
+	memset(&pdu, 0, sizeof(pdu));
+	strcpy(pdu.host, "draining");
+	pdu.ts = (uint32_t)time(NULL);
+	pdu_pack(&pdu);
+	ok(write(a, (char*)&pdu + 1000, sizeof(pdu) - 1000) == sizeof(pdu) - 1000,
+			"[sanity] a sent the rest of its fourth");
+
+	pthread_join(tid, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ok(num_results == 1 + 4 + 2, "got all 7 results (%d)", num_results);
+	ok(end.tv_sec - start.tv_sec < IRIS_DRAIN_GRACE, "without waiting out the grace period");
+	ok(CLIENT_STATS.active == 0, "every client was closed");
+	ok(hungup(a) && hungup(c), "a and c were hung up on, too");
+
+	client_deinit();
+	ok(client_at(0) == NULL, "client table is gone");
+	ok(client_init(2) == 2, "and can be set up again");
+	client_deinit();
+	net_close(epfd);
+
+	close(a); close(b); close(c);
+	return exit_status();
+}
@@ -0,0 +1,139 @@
+#include "tap.c"
+#include "../iris.h"
+#include <pthread.h>
+
+#define DIR  "t/tmp/reload"
+#define CONF DIR "/iris.conf"
+
+int iris_call_submit_result(struct pdu *pdu) { return 0; }
+int iris_call_recv_data(int fd) { return recv_data(fd); }
+int iris_call_register_fd(int fd) { return 0; }
+
+extern time_t MAX_LIFETIME;
+extern int OVERFLOW_POLICY;
+extern unsigned int NUM_CLIENTS, OVERFLOW_MAX;
+
+volatile int applied = 0;
+int sockfd, epfd;
+
+static void apply(const struct server *s)
+{
+	server_apply(s);
+	applied++;
+}
+
+static void* reactor(void *udata)
+{
+	mainloop(sockfd, epfd);
+	return NULL;
+}
+
+static void config(const char *file, const char *text)
+{
+	FILE *io = fopen(file, "w");
+	fputs(text, io);
+	fclose(io);
+}
+
+/* for the reactor to get around to it */
+static int reloaded(int n)
+{
+	int waited;
+	for (waited = 0; applied < n && waited < 200; waited++)
+		usleep(10 * 1000);
+	return applied == n;
+}
+
+int main(int argc, char **argv)
+{
+	plan_no_plan();
+	freopen("/dev/null", "w", stderr);
+
+	struct server s;
+	pthread_t tid;
+	struct client *c;
+	int fds[2], n;
+
+	/** server_check **/
+	server_init(&s);
+	ok(server_check(&s) == 0, "the defaults check out");
+	s.max_clients = 0;
+	ok(server_check(&s) == 1, "max_clients = 0 doesn't");
+	s.max_clients = 16;
+	s.tls_port = strdup("5671");
+	ok(server_check(&s) == 1, "neither does tls_port without a cert and key");
+	s.overflow_policy = IRIS_OVERFLOW_QUEUE;
+	s.overflow_queue = 0;
+	ok(server_check(&s) == 2, "or queueing overflow with no queue");
+	server_free(&s);
+	ok(s.tls_port == NULL, "server_free clears the struct out");
+
+	/** parse_config leaves the globals alone; server_apply doesn't **/
+	mkdir(DIR, 0755);
+	config(CONF, "max_lifetime = 7\noverflow_policy = evict\n");
+	server_init(&s);
+	ok(parse_config_file(CONF, &s) == 0, "[sanity] parsed " CONF);
+	ok(MAX_LIFETIME == 20 && OVERFLOW_POLICY == IRIS_OVERFLOW_REJECT,
+			"parsing the config changed nothing");
+	server_apply(&s);
+	ok(MAX_LIFETIME == 7 && OVERFLOW_POLICY == IRIS_OVERFLOW_EVICT,
+			"applying it did");
+	server_free(&s);
+
+	/** live reload **/
+	config(CONF, "max_clients = 4\n");
+	ok(client_init(4) == 4, "allocated 4 client slots");
+	sockfd = net_bind("127.0.0.1", "5676");
+	epfd = net_poller(sockfd);
+	ok(sockfd >= 0 && epfd >= 0, "[sanity] bound to 127.0.0.1:5676");
+	ok(config_watch(epfd, CONF, apply) == 0, "watching " CONF);
+
+	ok(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "[sanity] got a socketpair");
+	nonblocking(fds[0]);
+	ok((c = client_new(fds[0], NULL)) != NULL, "a client is connected");
+	ok(pthread_create(&tid, NULL, reactor, NULL) == 0, "[sanity] started the reactor");
+
+	config(CONF, "max_clients = 600\nmax_lifetime = 30\noverflow_queue = 16\n");
+	ok(reloaded(1), "rewriting the config reloads it");
+	ok(NUM_CLIENTS == 600, "max_clients went up to %u", NUM_CLIENTS);
+	ok(MAX_LIFETIME == 30, "max_lifetime is now %d", (int)MAX_LIFETIME);
+	ok(OVERFLOW_MAX == 16, "overflow_queue is now %u", OVERFLOW_MAX);
+	ok(client_find(fds[0]) == c && c->fd == fds[0], "the client is still connected");
+
+	config(CONF, "max_clients = lots\n");
+	usleep(200 * 1000);
+	ok(applied == 1, "a broken config isn't applied");
+	ok(NUM_CLIENTS == 600, "max_clients is still %u", NUM_CLIENTS);
+
+	config(CONF, "max_clients = 0\n");
+	usleep(200 * 1000);
+	ok(applied == 1, "nor is one that fails the checks iriscfg makes");
+
+	config(DIR "/iris.conf.new", "max_clients = 2\n");
+	usleep(200 * 1000);
+	ok(applied == 1, "writing some other file in the same directory doesn't reload");
+	rename(DIR "/iris.conf.new", CONF);
+	ok(reloaded(2), "renaming over the config does");
+	ok(NUM_CLIENTS == 2, "max_clients went down to %u", NUM_CLIENTS);
+	ok(client_find(fds[0]) == c, "and the client is still connected");
+	ok(MAX_LIFETIME == 20, "settings that aren't there any more go back to their defaults");
+
+	mainloop_stop(IRIS_STOP_PAUSE);
+	pthread_join(tid, NULL);
+
+	/** tables only grow, a chunk at a time **/
+	config(CONF, "max_clients = 1000\n");
+	ok(config_reload() == 0, "config_reload() reloads on demand");
+	for (n = 0; client_new(-2 - n, NULL) != NULL; n++)
+		;
+	ok(n == 999, "filled all 1000 slots (1 + %d)", n);
+	ok(client_at(999) != NULL && client_at(999)->fd == -1000, "the last one's where it should be");
+	ok(client_at(0) == c && c->fd == fds[0], "as is the first");
+
+	close(fds[1]);
+	client_deinit();
+	net_close(epfd);
+	unlink(CONF);
+	rmdir(DIR);
+	return exit_status();
+}
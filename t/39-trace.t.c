@@ -0,0 +1,126 @@
+#include "tap.c"
+#include "../iris.h"
+#include "dummy-calls.c"
+
+static struct client* connect_from(int fd, const char *ip)
+{
+	struct sockaddr_in sin;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	inet_pton(AF_INET, ip, &sin.sin_addr);
+	return client_new(fd, (struct sockaddr*)&sin);
+}
+
+static int lines(void)
+{
+	char buf[IRIS_TRACE_LINE];
+	int n = 0;
+
+	while (trace_read(buf, sizeof(buf)) >= 0)
+		n++;
+	return n;
+}
+
+static int parse(const char *text, struct server *s)
+{
+	FILE *io = fmemopen((void*)text, strlen(text), "r");
+	int rc;
+
+	server_init(s);
+	rc = parse_config(io, s);
+	fclose(io);
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	char buf[IRIS_TRACE_LINE];
+	char *scope[2] = { "10.0.0.2", "nope" };
+	struct client *a, *b, *c;
+	struct server s;
+	uint32_t mask;
+	int i;
+
+	plan_no_plan();
+
+	ok(trace_parse("net,client,read", &mask) == 0
+	 && mask == (IRIS_TRACE_NET|IRIS_TRACE_CLIENT|IRIS_TRACE_READ),
+			"parsed a list of trace categories");
+	ok(trace_parse("all", &mask) == 0 && mask == IRIS_TRACE_ALL, "parsed `all'");
+	ok(trace_parse("none", &mask) == 0 && mask == 0, "parsed `none'");
+	ok(trace_parse("net,bogus", &mask) != 0, "rejected an unknown category");
+	ok(strcmp(trace_names(IRIS_TRACE_NET|IRIS_TRACE_SINK, buf, sizeof(buf)), "net,sink") == 0,
+			"category names for a mask");
+	ok(strcmp(trace_names(0, buf, sizeof(buf)), "none") == 0, "... and for no mask at all");
+
+	/* off, nothing gets as far as formatting */
+	trace(IRIS_TRACE_NET, "should not see this");
+	ok(trace_read(buf, sizeof(buf)) < 0, "nothing traced while tracing is off");
+
+	trace_set(IRIS_TRACE_NET);
+	trace(IRIS_TRACE_NET, "hello from fd %d", 42);
+	trace(IRIS_TRACE_READ, "not this, though");
+	ok(trace_read(buf, sizeof(buf)) > 0, "traced a line in a category that's on");
+	ok(strcmp(buf, "hello from fd 42") == 0, "line came through the ring intact");
+	ok(trace_read(buf, sizeof(buf)) < 0, "but not one from a category that's off");
+
+	/* scoped to one address */
+	ok(client_init(4) == 4, "set up a client table");
+	a = connect_from(4, "10.0.0.1");
+	b = connect_from(5, "10.0.0.2");
+	ok(a && (a->flags & IRIS_CLIENT_TRACED), "unscoped, every client is traced");
+
+	trace_set(IRIS_TRACE_CLIENT);
+	ok(trace_scope(scope, 1) == 0, "scoped tracing to 10.0.0.2");
+	ok(!(a->flags & IRIS_CLIENT_TRACED), "10.0.0.1 no longer traced");
+	ok(b->flags & IRIS_CLIENT_TRACED, "10.0.0.2 still is");
+	c = connect_from(6, "10.0.0.2");
+	ok(c && (c->flags & IRIS_CLIENT_TRACED), "new clients from 10.0.0.2 are traced too");
+
+	lines();
+	trace(IRIS_TRACE_CLIENT, "global");
+	ctrace(a, IRIS_TRACE_CLIENT, "from a");
+	ctrace(b, IRIS_TRACE_CLIENT, "from b");
+	ctrace(b, IRIS_TRACE_READ, "from b, but not a category that's on");
+	ok(trace_read(buf, sizeof(buf)) > 0 && strcmp(buf, "from b") == 0,
+			"only the client in scope was traced");
+	ok(trace_read(buf, sizeof(buf)) < 0, "... and nothing else");
+
+	ok(trace_scope(scope, 2) != 0, "refused a scope with a bad address in it");
+	ok(!(a->flags & IRIS_CLIENT_TRACED) && (b->flags & IRIS_CLIENT_TRACED),
+			"old scope still in place");
+	ok(trace_scope(NULL, 0) == 0, "unscoped tracing again");
+	ok(a->flags & IRIS_CLIENT_TRACED, "10.0.0.1 is traced again");
+	client_deinit();
+	lines();
+
+	/* the ring drops what it can't hold, rather than block */
+	trace_set(IRIS_TRACE_ALL);
+	for (i = 0; i < IRIS_TRACE_RING + 5; i++)
+		trace(IRIS_TRACE_LOOP, "line %d", i);
+	ok(trace_dropped() == 5, "dropped lines once the ring was full");
+	ok(trace_read(buf, sizeof(buf)) > 0 && strcmp(buf, "line 0") == 0,
+			"oldest line comes out first");
+	ok(lines() == IRIS_TRACE_RING - 1, "the rest of the ring was kept");
+
+	/* and the thread empties it out */
+	ok(trace_start() == 0, "started the trace thread");
+	trace(IRIS_TRACE_LOOP, "to syslog");
+	trace_stop();
+	ok(trace_read(buf, sizeof(buf)) < 0, "trace thread emptied the ring before it stopped");
+	trace_set(0);
+
+	/* iris.conf */
+	ok(parse("trace = net,tls\ntrace_from = 10.0.0.2\ntrace_from = ::1\n", &s) == 0,
+			"parsed trace settings");
+	ok(s.trace == (IRIS_TRACE_NET|IRIS_TRACE_TLS), "trace categories set");
+	ok(s.num_trace_from == 2 && strcmp(s.trace_from[1], "::1") == 0, "trace_from addresses set");
+	server_free(&s);
+	ok(parse("trace = net,bogus\n", &s) == 17, "unknown trace category is an error");
+	server_free(&s);
+	ok(parse("trace_from = example.com\n", &s) == 18, "trace_from must be an address");
+	server_free(&s);
+
+	return exit_status();
+}
@@ -0,0 +1,135 @@
+#include "tap.c"
+#include <sys/wait.h>
+#include "../iris.h"
+#include "dummy-calls.c"
+
+#define NET_HOST "127.0.0.1"
+#define NET_PORT "12359"
+#define SPOOL    "t/tmp/relay-spool"
+
+int upstream_main(int sockfd, uint32_t ts)
+{
+	struct pdu pdu;
+	int fd, n = 0;
+
+	close(0); close(1); close(2);
+	while ((fd = accept(sockfd, NULL, NULL)) < 0) /* sockfd is O_NONBLOCK */
+		;
+	while (pdu_read(fd, (uint8_t*)&pdu, 0) == sizeof(pdu)) {
+		if (pdu_unpack(&pdu) != 0 || pdu.ts != ts || pdu.rc != n % 4)
+			return 100 + n;
+		n++;
+	}
+	return n;
+}
+
+/* counts the results that arrive intact, however old they started out */
+int upstream_count(int sockfd)
+{
+	struct pdu pdu;
+	int fd, n = 0;
+
+	close(0); close(1); close(2);
+	while ((fd = accept(sockfd, NULL, NULL)) < 0)
+		;
+	while (pdu_read(fd, (uint8_t*)&pdu, 0) == sizeof(pdu) && pdu_unpack(&pdu) == 0)
+		n++;
+	return n;
+}
+
+int main(int argc, char **argv)
+{
+	plan_no_plan();
+	freopen("/dev/null", "w", stderr);
+	trace(IRIS_TRACE_ALL, "%s: starting", __FILE__);
+
+	struct relay r;
+	struct pdu pdu;
+	time_t now;
+	int sockfd, i, status;
+
+	ok(relay_init(NULL, NET_HOST ":" NET_PORT, 4) != 0, "relay_init(NULL) fails");
+	ok(relay_init(&r, NULL, 4) != 0, "relay_init needs an upstream");
+	ok(relay_init(&r, NET_HOST ":" NET_PORT, 0) != 0, "relay_init needs a batch size");
+	ok(relay_init(&r, NET_HOST ":", 4) != 0, "relay_init rejects a bad port");
+
+	ok(relay_init(&r, "some.host", 4) == 0, "relay_init without a port");
+	ok(r.port == IRIS_DEFAULT_PORT, "upstream port defaults to %d", IRIS_DEFAULT_PORT);
+	relay_deinit(&r);
+
+	time(&now);
+	memset(&pdu, 0, sizeof(pdu));
+	pdu.version = IRIS_PROTOCOL_VERSION;
+	pdu.ts = (uint32_t)now;
+	strcpy(pdu.host,    "relayed.host");
+	strcpy(pdu.service, "relayed.service");
+	strcpy(pdu.output,  "OK - it came through the relay");
+
+	/** batched relaying to a live upstream **/
+	sockfd = net_bind(NET_HOST, NET_PORT);
+	ok(sockfd >= 0, "[sanity] bound upstream to %s:%s", NET_HOST, NET_PORT);
+	if (fork() == 0) _exit(upstream_main(sockfd, pdu.ts));
+	close(sockfd);
+
+	ok(relay_init(&r, NET_HOST ":" NET_PORT, 4) == 0, "relay_init to %s:%s", NET_HOST, NET_PORT);
+	for (i = 0; i < 10; i++) {
+		pdu.rc = i % 4;
+		if (relay_submit(&r, &pdu) != 0) break;
+	}
+	ok(i == 10, "submitted 10 results to the relay");
+	ok(r.n == 2, "2 results still buffered after two full batches");
+	ok(relay_flush(&r) == 2, "flushed the last 2 results");
+	ok(relay_flush(&r) == 0, "nothing left to flush");
+	relay_deinit(&r);
+
+	wait(&status);
+	ok(WIFEXITED(status) && WEXITSTATUS(status) == 10,
+		"upstream received 10 intact results (got %d)", WEXITSTATUS(status));
+
+	/** dead upstream, with a spool **/
+	system("/bin/rm -rf " SPOOL);
+	mkdir(SPOOL, 0777);
+	ok(relay_init(&r, NET_HOST ":" NET_PORT, 4) == 0, "relay_init to (dead) %s:%s", NET_HOST, NET_PORT);
+	r.spool = SPOOL;
+	for (i = 0; i < 3; i++)
+		relay_submit(&r, &pdu);
+	ok(relay_flush(&r) == 0, "relay_flush to a dead upstream spools the batch");
+	ok(r.n == 0, "batch is empty after spooling");
+
+	int null = open("/dev/null", O_WRONLY);
+	ok(spool_replay(SPOOL, null, 0) == 3, "spool holds the 3 undelivered results");
+	close(null);
+
+	ok(r.backoff == 1 && r.retry > 0, "a failed connect puts off the next one");
+
+	r.spool = NULL;
+	relay_submit(&r, &pdu);
+	ok(relay_flush(&r) < 0, "relay_flush to a dead upstream without a spool fails");
+	relay_deinit(&r);
+
+	/** an upstream that comes back gets the spool, stale or not **/
+	struct pdu old;
+	memcpy(&old, &pdu, sizeof(old));
+	old.ts = (uint32_t)(now - 3600);
+	pdu_pack(&old);
+	for (i = 0; i < 3; i++)
+		spool_write(SPOOL, &old, 1);
+
+	sockfd = net_bind(NET_HOST, NET_PORT);
+	ok(sockfd >= 0, "[sanity] bound upstream to %s:%s", NET_HOST, NET_PORT);
+	if (fork() == 0) _exit(upstream_count(sockfd));
+	close(sockfd);
+
+	ok(relay_init(&r, NET_HOST ":" NET_PORT, 4) == 0, "relay_init to %s:%s", NET_HOST, NET_PORT);
+	r.spool = SPOOL;
+	relay_submit(&r, &pdu);
+	ok(relay_flush(&r) == 1, "flushed 1 result, after the spool");
+	ok(r.backoff == 0, "a good connect resets the backoff");
+	relay_deinit(&r);
+
+	wait(&status);
+	ok(WIFEXITED(status) && WEXITSTATUS(status) == 4,
+		"upstream took the hour-old spool, and the new result (got %d)", WEXITSTATUS(status));
+
+	return exit_status();
+}
@@ -0,0 +1,139 @@
+#include "tap.c"
+#include "../iris.h"
+#include "../sink.h"
+#include "dummy-calls.c"
+
+#define OUTFILE "t/tmp/sink.out"
+#define CRDIR   "t/tmp/checkresults"
+
+static void fill(struct pdu *pdu, int i)
+{
+	memset(pdu, 0, sizeof(struct pdu));
+	pdu->version = IRIS_PROTOCOL_VERSION;
+	pdu->ts      = (uint32_t)time(NULL);
+	pdu->rc      = i % 4;
+	snprintf(pdu->host,    IRIS_PDU_HOST_LEN,    "host%d", i);
+	snprintf(pdu->service, IRIS_PDU_SERVICE_LEN, "service%d", i);
+	snprintf(pdu->output,  IRIS_PDU_OUTPUT_LEN,  "result #%d\nline two", i);
+}
+
+static char *slurp(const char *file)
+{
+	static char buf[8192];
+	int fd = open(file, O_RDONLY);
+	ssize_t n = fd < 0 ? -1 : read(fd, buf, sizeof(buf)-1);
+	if (fd >= 0) close(fd);
+	buf[n > 0 ? n : 0] = '\0';
+	return buf;
+}
+
+int main(int argc, char **argv)
+{
+	plan_no_plan();
+	freopen("/dev/null", "w", stderr);
+	trace(IRIS_TRACE_ALL, "%s: starting", __FILE__);
+
+	struct server s;
+	struct sink *sink;
+	struct pdu pdu;
+	struct stat st;
+	int i, n;
+
+	server_init(&s);
+	ok(!sink_new(NULL), "sink_new(NULL) fails");
+	ok(!sink_new(&s), "sink_new needs a sink type");
+	s.sink = "bogus";
+	ok(!sink_new(&s), "sink_new fails on an unknown sink type");
+	s.sink = "file";
+	ok(!sink_new(&s), "file sink needs a sink_path");
+	s.sink = "relay";
+	ok(!sink_new(&s), "relay sink needs an upstream");
+
+	/** null sink **/
+	s.sink = "null";
+	ok((sink = sink_new(&s)) != NULL, "created a null sink");
+	ok(sink_start(sink) == 0, "started the null sink thread");
+	for (i = 0; i < 1000; i++) {
+		fill(&pdu, i);
+		while (sink_submit(sink, &pdu) != 0)
+			usleep(1000);
+	}
+	pthread_mutex_lock(&sink->lock);
+	n = sink->written + sink->count;
+	pthread_mutex_unlock(&sink->lock);
+	ok(n == 1000, "all 1000 results written or queued (%d)", n);
+	sink_stop(sink);
+	pass("stopped the null sink");
+
+	/** file sink **/
+	unlink(OUTFILE);
+	s.sink      = "file";
+	s.sink_path = OUTFILE;
+	ok((sink = sink_new(&s)) != NULL, "created a file sink");
+	ok(sink_start(sink) == 0, "started the file sink thread");
+	for (i = 0; i < 10; i++) {
+		fill(&pdu, i);
+		sink_submit(sink, &pdu);
+	}
+	sink_stop(sink);
+	ok(stat(OUTFILE, &st) == 0 && st.st_size == 10 * sizeof(struct pdu),
+			"file sink wrote 10 packed results");
+	int fd = open(OUTFILE, O_RDONLY);
+	for (n = 0; pdu_read(fd, (uint8_t*)&pdu, 0) == sizeof(pdu); n++)
+		if (pdu_unpack(&pdu) != 0 || pdu.rc != n % 4) break;
+	close(fd);
+	ok(n == 10, "read back %d/10 valid results from the file", n);
+
+	/** queue overflow **/
+	s.sink_queue = 4;
+	ok((sink = sink_new(&s)) != NULL, "created a file sink with a tiny queue");
+	for (i = 0, n = 0; i < 6; i++) {
+		fill(&pdu, i);
+		if (sink_submit(sink, &pdu) == 0) n++;
+	}
+	ok(n == 4, "queued 4 results before the queue filled up");
+	ok(sink->dropped == 2, "dropped the 2 results that didn't fit");
+	ok(sink_start(sink) == 0, "started the file sink thread");
+	sink_stop(sink);
+	s.sink_queue = 4096;
+
+	/** checkresult sink **/
+	system("/bin/rm -rf " CRDIR);
+	s.sink      = "checkresult";
+	s.sink_path = CRDIR;
+	ok(!sink_new(&s), "checkresult sink needs an existing directory");
+	mkdir(CRDIR, 0777);
+	ok((sink = sink_new(&s)) != NULL, "created a checkresult sink");
+	for (i = 0; i < 3; i++) {
+		fill(&pdu, i);
+		sink_submit(sink, &pdu);
+	}
+	fill(&pdu, 3);
+	strcpy(pdu.service, "HOST");
+	sink_submit(sink, &pdu);
+	ok(sink_start(sink) == 0, "started the checkresult sink thread");
+	sink_stop(sink);
+
+	char file[512] = "";
+	struct dirent *d;
+	DIR *dh = opendir(CRDIR);
+	for (n = 0; dh && (d = readdir(dh)) != NULL; ) {
+		if (d->d_name[0] == '.') continue;
+		n++;
+		if (strlen(d->d_name) == 7 && d->d_name[0] == 'c')
+			snprintf(file, sizeof(file), CRDIR "/%s", d->d_name);
+	}
+	if (dh) closedir(dh);
+	ok(n == 2, "one check result file, and its .ok marker");
+	ok(*file, "check result file is named cXXXXXX");
+
+	char *cr = slurp(file);
+	ok(strstr(cr, "file_time=") != NULL, "check result file has a file_time");
+	ok(strstr(cr, "host_name=host0\nservice_description=service0\n") != NULL, "first result");
+	ok(strstr(cr, "return_code=2\noutput=result #2\\nline two\n") != NULL,
+			"output newlines are escaped");
+	ok(strstr(cr, "host_name=host3\ncheck_type=1\n") != NULL,
+			"HOST results have no service_description");
+
+	return exit_status();
+}
@@ -0,0 +1,259 @@
+#include "tap.c"
+#include "../iris.h"
+#include <pthread.h>
+
+#define DIR  "t/tmp/admin"
+#define CONF DIR "/iris.conf"
+#define SOCK DIR "/admin.sock"
+
+int iris_call_submit_result(struct pdu *pdu) { return 0; }
+int iris_call_recv_data(int fd) { return recv_data(fd); }
+int iris_call_register_fd(int fd) { return 0; }
+
+extern struct client_stats CLIENT_STATS;
+extern struct ingest_stats INGEST;
+
+volatile int applied = 0;
+int sockfd, epfd;
+
+static void apply(const struct server *s)
+{
+	server_apply(s);
+	applied++;
+}
+
+static void* reactor(void *udata)
+{
+	mainloop(sockfd, epfd);
+	return NULL;
+}
+
+/* sends a command line (or several), and reads back n answers */
+static char* ask(const char *cmd, int n)
+{
+	static char buf[8 * 1024 * 1024];
+	size_t len = 0;
+	ssize_t r;
+	int fd;
+
+	buf[0] = '\0';
+	if ((fd = net_connect(IRIS_UNIX_PREFIX SOCK, 0)) < 0)
+		return buf;
+	write_full(fd, (const uint8_t*)cmd, strlen(cmd));
+	while (len < sizeof(buf) - 1 && (r = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0) {
+		len += r;
+		buf[len] = '\0';
+		if (len >= 2 && strcmp(buf + len - 2, ".\n") == 0 && --n == 0)
+			break;
+	}
+	close(fd);
+	return buf;
+}
+
+static int count(const char *haystack, const char *needle)
+{
+	int n = 0;
+	for (; (haystack = strstr(haystack, needle)) != NULL; haystack++)
+		n++;
+	return n;
+}
+
+/* connects to the PDU port and sends part of a PDU, to show up as a
+   (busy, but not finished) client */
+static int agent(int bytes)
+{
+	char junk[1024] = {0};
+	int fd = net_connect("127.0.0.1", 5677);
+	if (fd >= 0)
+		write(fd, junk, bytes);
+	return fd;
+}
+
+/* sends one good result, for host, and a bad one */
+static void results(const char *host)
+{
+	struct pdu pdu;
+	int fd;
+
+	memset(&pdu, 0, sizeof(pdu));
+	strcpy(pdu.host, host);
+	strcpy(pdu.service, "disk");
+	strcpy(pdu.output, "DISK OK");
+	pdu.ts = time(NULL);
+	pdu_pack(&pdu);
+	fd = net_connect("127.0.0.1", 5677);
+	write(fd, &pdu, sizeof(pdu));
+	pdu.crc32 ^= 1;
+	write(fd, &pdu, sizeof(pdu));
+	close(fd);
+}
+
+static void extra(void)
+{
+	admin_stat("test.extra", 42);
+}
+
+static int waitfor(unsigned int active)
+{
+	int waited;
+	for (waited = 0; CLIENT_STATS.active != active && waited < 200; waited++)
+		usleep(10 * 1000);
+	return CLIENT_STATS.active == active;
+}
+
+int main(int argc, char **argv)
+{
+	plan_no_plan();
+
+	struct server s;
+	struct stat st;
+	pthread_t tid;
+	struct source *src;
+	char *out, big[5 * 5000 + 1];
+	int a, b, fd, n;
+
+	mkdir(DIR, 0755);
+	FILE *io = fopen(CONF, "w");
+	fprintf(io, "admin_unix = %s\n", SOCK);
+	fclose(io);
+
+	server_init(&s);
+	ok(parse_config_file(CONF, &s) == 0 && s.admin_unix && strcmp(s.admin_unix, SOCK) == 0,
+			"parsed admin_unix from " CONF);
+
+	ok(client_init(16) == 16, "allocated 16 client slots");
+	sockfd = net_bind("127.0.0.1", "5677");
+	epfd = net_poller(sockfd);
+	ok(sockfd >= 0 && epfd >= 0, "[sanity] bound to 127.0.0.1:5677");
+	ok(net_listeners(&s, epfd) == 1, "admin socket is listening");
+	ok(stat(SOCK, &st) == 0 && (st.st_mode & 0777) == 0600, "admin socket is 0600");
+	ok(config_watch(epfd, CONF, apply) == 0, "[sanity] watching " CONF);
+	ok(pthread_create(&tid, NULL, reactor, NULL) == 0, "[sanity] started the reactor");
+
+	a = agent(100);
+	b = agent(200);
+	ok(a >= 0 && b >= 0 && waitfor(2), "two agents connected");
+
+	out = ask("stats\n", 1);
+	ok(strstr(out, "clients.active 3\n") != NULL, "stats counts both agents, and us");
+	ok(strstr(out, "clients.max 16\n") != NULL, "stats has max_clients");
+
+	waitfor(2); /* the last admin connection may not be reaped yet */
+	out = ask("clients\n", 1);
+	ok(count(out, "127.0.0.1") == 2, "clients lists both agents");
+	ok(count(out, " admin ") == 1, "and the admin connection");
+	ok(strstr(out, "mid-pdu") != NULL, "agents halfway through a PDU say so");
+
+	out = ask("top-talkers\n", 1);
+	ok(strstr(out, "127.0.0.1") != NULL && count(out, "\n") == 3,
+			"top-talkers sums the agents up by address, and leaves us out");
+	ok(strstr(out, "       2          300") != NULL, "2 clients, 300 bytes between them");
+
+	out = ask("kick nonsense\n", 1);
+	ok(strncmp(out, "error:", 6) == 0, "kick wants an IP address");
+	out = ask("kick 127.0.0.1\n", 1);
+	ok(strcmp(out, "kicked 2 clients from 127.0.0.1\n.\n") == 0, "kicked both agents");
+	ok(read(a, big, 1) == 0 && read(b, big, 1) == 0, "and they were hung up on");
+	close(a);
+	close(b);
+	ok(waitfor(0), "[sanity] nobody's left");
+	out = ask("top-talkers\n", 1);
+	ok(strstr(out, "       0          300        0        2        0") != NULL,
+			"the source table remembers 127.0.0.1: 300 bytes, over 2 connections");
+
+	out = ask("top-hosts\n", 1);
+	ok(strcmp(out, "host                                     results\n.\n") == 0,
+			"top-hosts starts counting the first time it's asked");
+	results("web01");
+	results("web01");
+	results("db01");
+	for (n = 0; (INGEST.results < 3 || INGEST.bogus_crc < 3) && n < 200; n++)
+		usleep(10 * 1000);
+	out = ask("top-hosts 1\n", 1);
+	ok(strstr(out, "\nweb01 ") != NULL && strstr(out, " 2\n") != NULL && !strstr(out, "db01"),
+			"top-hosts has web01 first, with 2 results");
+
+	admin_stats_extra(extra);
+	out = admin_query(SOCK, "stats\nhelp\n", 2);
+	ok(out && count(out, "\n.\n") == 2, "admin_query read back both answers");
+	ok(out && strstr(out, "ingest.results 3\n") && strstr(out, "ingest.bogus.crc 3\n"),
+			"stats counts results, and bogus ones by reason");
+	snprintf(big, sizeof(big), "ingest.bytes %lu\n", 300 + 6 * sizeof(struct pdu));
+	ok(out && strstr(out, big) != NULL, "and bytes, from every client");
+	ok(out && strstr(out, "\ntest.extra 42\n.\n") != NULL, "the program gets to add its own");
+	ok(out && strstr(out, "sources.tracked 1\n") && strstr(out, "sources.evicted 0\n"),
+			"one source tracked, nobody evicted");
+	free(out);
+	admin_stats_extra(NULL);
+
+	out = ask("top-talkers\n", 1);
+	ok(strstr(out, " 3        5        3 ") != NULL,
+			"and 127.0.0.1 is up to 3 results, 5 connections, 3 bogus");
+
+	out = ask("loglevel warning\n", 1);
+	ok(strcmp(out, "loglevel warning\n.\n") == 0, "set the log level");
+	out = ask("loglevel\n", 1);
+	ok(strcmp(out, "loglevel warning\n.\n") == 0, "and it stuck");
+	out = ask("loglevel chatty\n", 1);
+	ok(strncmp(out, "error:", 6) == 0, "unknown log levels are an error");
+	ask("loglevel debug\n", 1);
+
+	out = ask("trace net,read\n", 1);
+	ok(strcmp(out, "trace net,read\n.\n") == 0, "switched tracing on");
+	out = ask("trace none\n", 1);
+	ok(strcmp(out, "trace none\n.\n") == 0, "and off again");
+
+	out = ask("reload\n", 1);
+	ok(strcmp(out, "reloaded\n.\n") == 0 && applied == 1, "reload re-read " CONF);
+
+	out = ask("frobnicate\n", 1);
+	ok(strncmp(out, "error: unknown command", 22) == 0, "unknown commands are an error");
+
+	/* more than the socket buffer holds, all queued up at once, and
+	   then the client closes its end before reading any of it */
+	for (n = 0; n < 5000; n++)
+		memcpy(big + n * 5, "help\n", 5);
+	big[5 * 5000] = '\0';
+	fd = net_connect(IRIS_UNIX_PREFIX SOCK, 0);
+	ok(write_full(fd, (const uint8_t*)big, strlen(big)) == strlen(big), "[sanity] sent 5000 commands");
+	shutdown(fd, SHUT_WR);
+	{
+		static char all[8 * 1024 * 1024];
+		size_t len = 0;
+		ssize_t r;
+		while ((r = read(fd, all + len, sizeof(all) - 1 - len)) > 0)
+			len += r;
+		all[len] = '\0';
+		ok(count(all, "\n.\n") == 5000, "got all 5000 answers (%d), then EOF", count(all, "\n.\n"));
+	}
+	close(fd);
+	ok(waitfor(0), "the admin client was closed once it had its answers");
+
+	mainloop_stop(IRIS_STOP_PAUSE);
+	pthread_join(tid, NULL);
+
+	/* the reactor's stopped; fill the source table up, and then some */
+	for (n = 0; n < IRIS_SOURCES + 100; n++) {
+		char addr[32];
+		snprintf(addr, sizeof(addr), "10.0.%d.%d", n / 256, n % 256);
+		if (!(src = source_get(addr)))
+			break;
+		src->bytes += 1000 + n;
+	}
+	ok(n == IRIS_SOURCES + 100, "[sanity] %d more sources", n);
+	ok(source_get("127.0.0.1")->connections == 5, "the biggest sender is still there");
+	/* 10.0.3.255 was the first one in without room: 10.0.0.0 (the
+	   smallest, at 1000 bytes) made way for it */
+	src = source_get("10.0.3.255");
+	ok(src->bytes == 1000 + 1000 + 1023 && src->error == 1000,
+			"a newcomer took over from the smallest, and its bytes, as error");
+	ok(src->connections == 0 && src->results == 0, "everything else started from scratch");
+
+	client_deinit();
+	net_close(epfd);
+	server_free(&s);
+	unlink(CONF);
+	unlink(SOCK);
+	rmdir(DIR);
+	return exit_status();
+}
@@ -5,7 +5,7 @@
 #define NET_PORT "12356"
 
 int children = 0;
-void iris_call_submit_result(struct pdu *pdu) { }
+int iris_call_submit_result(struct pdu *pdu) { return 0; }
 int iris_call_recv_data(int fd)
 {
 	pass("saw fd %d (%d children still active)", fd, --children);
@@ -44,7 +44,7 @@ int main(int argc, char **argv)
 	int sockfd, epfd;
 
 	freopen("/dev/null", "w", stderr);
-	vdebug("%s: starting", __FILE__);
+	trace(IRIS_TRACE_ALL, "%s: starting", __FILE__);
 
 	ok(net_poller(-1) < 0, "net_poller startup fails with bad sockfd");
 
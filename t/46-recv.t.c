@@ -10,11 +10,12 @@ int num_packets    = 0;
 void timedout(int sig) { _exit(5); }
 
 int iris_call_recv_data(int fd) { return 0; }
-void iris_call_submit_result(struct pdu *pdu)
+int iris_call_submit_result(struct pdu *pdu)
 {
 	ok(pdu->rc == num_packets % 3, "Got packet with RC %d (expect %d)",
 			pdu->rc, num_packets % 3);
 	num_packets++;
+	return 0;
 }
 
 int child_main(int fd)
@@ -77,7 +78,7 @@ int main(int argc, char **argv)
 	client_init(8);
 
 	plan_no_plan();
-	vdebug("%s: starting", __FILE__);
+	trace(IRIS_TRACE_ALL, "%s: starting", __FILE__);
 
 	SETUP(pipefd, 1);
 	if (fork() == 0) {
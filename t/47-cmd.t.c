@@ -0,0 +1,116 @@
+#include "tap.c"
+#include "../iris.h"
+
+void _string_is(const char *got, const char *want,
+		const char *fn, char *file, unsigned int line, char *test)
+{
+	if ((!got && !want) || (got && want && strcmp(got, want) == 0)) {
+		pass("%s", test);
+		return;
+	}
+
+	fail("%s", test);
+	diag("    Failed test %s", test);
+	diag("       got: '%s'", got);
+	diag("  expected: '%s'", want);
+}
+#define string_is(got,want,test) _string_is((got),(want),__func__,__FILE__,__LINE__,(test))
+
+int num_results = 0;
+struct pdu last;
+
+int iris_call_submit_result(struct pdu *pdu)
+{
+	memcpy(&last, pdu, sizeof(last));
+	num_results++;
+	return 0;
+}
+int iris_call_recv_data(int fd) { return 0; }
+int iris_call_register_fd(int fd) { return 0; }
+
+int main(int argc, char **argv)
+{
+	plan_no_plan();
+	freopen("/dev/null", "w", stderr);
+	trace(IRIS_TRACE_ALL, "%s: starting", __FILE__);
+
+	struct pdu pdu;
+	char line[8192];
+
+	ok(cmd_parse(NULL, &pdu) != 0, "cmd_parse(NULL) fails");
+
+	strcpy(line, "[1400000000] PROCESS_SERVICE_CHECK_RESULT;web01;http;2;CRITICAL - down; really");
+	ok(cmd_parse(line, &pdu) == 0, "parsed a service check result");
+	ok(pdu.ts == 1400000000, "timestamp parsed");
+	ok(pdu.rc == 2, "return code parsed");
+	ok(pdu.version == IRIS_PROTOCOL_VERSION, "version filled in");
+	string_is(pdu.host,    "web01", "host parsed");
+	string_is(pdu.service, "http",  "service parsed");
+	string_is(pdu.output,  "CRITICAL - down; really", "output keeps its semicolons");
+
+	strcpy(line, "PROCESS_HOST_CHECK_RESULT;web02;1;DOWN");
+	ok(cmd_parse(line, &pdu) == 0, "parsed a host check result, without a timestamp");
+	ok(pdu.ts >= time(NULL) - 5, "timestamp defaults to now");
+	string_is(pdu.host,    "web02", "host parsed");
+	string_is(pdu.service, "HOST",  "host checks use the HOST service");
+	string_is(pdu.output,  "DOWN",  "output parsed");
+
+	strcpy(line, "PROCESS_SERVICE_CHECK_RESULT;web01;http;2;");
+	ok(cmd_parse(line, &pdu) == 0, "empty output is okay");
+
+	char *bogus[] = {
+		"",
+		"ACKNOWLEDGE_HOST_PROBLEM;web01;1;1;1;jhunt;fixing it",
+		"[xyz] PROCESS_HOST_CHECK_RESULT;web02;1;DOWN",
+		"[1400000000 PROCESS_HOST_CHECK_RESULT;web02;1;DOWN",
+		"PROCESS_SERVICE_CHECK_RESULT;web01;http;4;no such rc",
+		"PROCESS_SERVICE_CHECK_RESULT;web01;http;12;two digits",
+		"PROCESS_SERVICE_CHECK_RESULT;web01;http;2",
+		"PROCESS_SERVICE_CHECK_RESULT;web01;http",
+		"PROCESS_SERVICE_CHECK_RESULT;;http;0;no host",
+		"PROCESS_HOST_CHECK_RESULT;web02",
+		NULL
+	};
+	char **b;
+	for (b = bogus; *b; b++) {
+		strcpy(line, *b);
+		ok(cmd_parse(line, &pdu) != 0, "bogus command: '%s'", *b);
+	}
+
+	memset(line, 'x', sizeof(line)); line[sizeof(line)-1] = '\0';
+	memcpy(line, "PROCESS_HOST_CHECK_RESULT;", 26);
+	ok(cmd_parse(line, &pdu) != 0, "overlong host names are rejected");
+
+	/** stream of commands over a pipe **/
+	int pipefd[2];
+	struct client *c;
+
+	client_init(4);
+	ok(pipe(pipefd) == 0, "[sanity] created pipe structure");
+	ok(nonblocking(pipefd[0]) == 0, "set O_NONBLOCK on read end of pipe");
+	if (fork() == 0) {
+		close(pipefd[0]);
+		int i;
+		for (i = 0; i < 100; i++) {
+			snprintf(line, sizeof(line),
+				"[%lu] PROCESS_SERVICE_CHECK_RESULT;host%d;svc;%d;result %d\r\n",
+				(unsigned long)time(NULL), i, i % 4, i);
+			write(pipefd[1], line, strlen(line));
+		}
+		write(pipefd[1], "garbage\n", 8);
+		memset(line, 'x', sizeof(line));
+		write(pipefd[1], line, sizeof(line));
+		write(pipefd[1], "\nPROCESS_HOST_CHECK_RESULT;last;0;no newline", 44);
+		_exit(0);
+	}
+	close(pipefd[1]);
+
+	c = client_new(pipefd[0], NULL);
+	c->proto = IRIS_PROTO_CMD;
+	while (c->fd != -1)
+		recv_data(pipefd[0]);
+	ok(num_results == 101, "received %d/101 results from the command stream", num_results);
+	string_is(last.host, "last", "final unterminated line is processed at EOF");
+
+	return exit_status();
+}
@@ -0,0 +1,128 @@
+#include "tap.c"
+#include "../iris.h"
+#include <sys/wait.h>
+
+#define RING "t/tmp/iris.shm"
+
+#define PRODUCERS  4
+#define PER_PRODUCER  2500
+
+int num_results = 0;
+int num_ok = 0;
+int seen[PRODUCERS];
+
+int iris_call_submit_result(struct pdu *pdu)
+{
+	int p, i;
+	num_results++;
+	if (sscanf(pdu->host, "p%d", &p) != 1 || sscanf(pdu->service, "s%d", &i) != 1)
+		return 0;
+	if (p < 0 || p >= PRODUCERS)
+		return 0;
+	/* each producer's results must arrive in order */
+	if (i == seen[p]) {
+		seen[p]++;
+		num_ok++;
+	}
+	return 0;
+}
+int iris_call_recv_data(int fd) { return 0; }
+int iris_call_register_fd(int fd) { return 0; }
+
+static void produce(int p)
+{
+	struct shmring *r;
+	struct pdu pdu;
+	int i;
+
+	if (!(r = shmring_open(RING)))
+		_exit(1);
+	for (i = 0; i < PER_PRODUCER; i++) {
+		memset(&pdu, 0, sizeof(pdu));
+		pdu.ts = (uint32_t)time(NULL);
+		pdu.rc = i % 4;
+		snprintf(pdu.host,    sizeof(pdu.host),    "p%d", p);
+		snprintf(pdu.service, sizeof(pdu.service), "s%d", i);
+		while (shmring_put(r, &pdu) != 0)
+			usleep(50);
+	}
+	shmring_close(r);
+	_exit(0);
+}
+
+int main(int argc, char **argv)
+{
+	plan_no_plan();
+	freopen("/dev/null", "w", stderr);
+
+	struct shmring *ring, *prod;
+	struct pdu pdu;
+	struct stat st;
+	struct epoll_event ev;
+	int epfd, i, status, ok_exits;
+
+	mkdir("t/tmp", 0777);
+	unlink(RING);
+	ok(shmring_open(RING) == NULL, "can't attach to a ring that doesn't exist");
+
+	ring = shmring_create(RING, 5);
+	ok(ring != NULL, "created a ring at %s", RING);
+	ok(ring && ring->hdr->slots == 8, "slot count is rounded up to a power of two");
+	ok(stat(RING IRIS_SHM_WAKE, &st) == 0 && S_ISFIFO(st.st_mode), "wakeup FIFO exists");
+
+	/** single-process: fill, overflow, drain **/
+	prod = shmring_open(RING);
+	ok(prod != NULL, "attached a producer");
+
+	memset(&pdu, 0, sizeof(pdu));
+	pdu.ts = (uint32_t)time(NULL);
+	strcpy(pdu.host, "p0");
+	for (i = 0; i < 8; i++) {
+		snprintf(pdu.service, sizeof(pdu.service), "s%d", i);
+		if (shmring_put(prod, &pdu) != 0) break;
+	}
+	ok(i == 8, "put 8 PDUs into an 8-slot ring");
+	ok(shmring_put(prod, &pdu) != 0 && errno == EAGAIN, "ninth put fails with EAGAIN");
+	ok(ring->hdr->sleeping == 0, "first put woke the consumer");
+
+	ok(shmring_consume(ring) == 8, "consumed all 8");
+	ok(num_ok == 8, "results arrived in order");
+	ok(ring->hdr->sleeping == 1, "consumer went back to sleep");
+	ok(shmring_consume(ring) == 0, "nothing left to consume");
+
+	pdu.ts = (uint32_t)time(NULL) - 901;
+	ok(shmring_put(prod, &pdu) == 0, "put a stale PDU");
+	ok(shmring_consume(ring) == 1, "stale PDU is consumed...");
+	ok(num_results == 8, "...but not submitted");
+	shmring_close(prod);
+	shmring_close(ring);
+	ok(stat(RING, &st) != 0, "closing the consumer removes the ring");
+
+	/** multi-process, via epoll **/
+	num_results = num_ok = 0;
+	memset(seen, 0, sizeof(seen));
+	ring = shmring_create(RING, 64);
+	ok(ring != NULL, "created a 64-slot ring");
+	ok((epfd = epoll_create(42)) >= 0, "[sanity] created an epoll fd");
+	ok(net_shmring(epfd, ring) == 0, "registered the ring with epoll");
+
+	for (i = 0; i < PRODUCERS; i++)
+		if (fork() == 0) produce(i);
+
+	while (num_results < PRODUCERS * PER_PRODUCER) {
+		if (epoll_wait(epfd, &ev, 1, 5000) != 1)
+			break;
+		shmring_consume(ring);
+	}
+	ok_exits = 0;
+	for (i = 0; i < PRODUCERS; i++)
+		if (wait(&status) > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+			ok_exits++;
+	ok(ok_exits == PRODUCERS, "all %d producers finished", PRODUCERS);
+	ok(num_results == PRODUCERS * PER_PRODUCER, "received %d/%d results",
+			num_results, PRODUCERS * PER_PRODUCER);
+	ok(num_ok == PRODUCERS * PER_PRODUCER, "every producer's results arrived in order");
+
+	shmring_close(ring);
+	return exit_status();
+}
@@ -0,0 +1,106 @@
+#include "tap.c"
+#include "../iris.h"
+
+#define PORT 15669
+
+int num_results = 0;
+struct pdu last;
+
+int iris_call_submit_result(struct pdu *pdu)
+{
+	memcpy(&last, pdu, sizeof(last));
+	num_results++;
+	return 0;
+}
+int iris_call_recv_data(int fd) { return 0; }
+int iris_call_register_fd(int fd) { return 0; }
+
+static void fill(struct pdu *pdu, const char *host)
+{
+	memset(pdu, 0, sizeof(struct pdu));
+	pdu->ts = (uint32_t)time(NULL);
+	strcpy(pdu->host, host);
+	strcpy(pdu->service, "svc");
+	strcpy(pdu->output, "OK");
+	pdu_pack(pdu);
+}
+
+int main(int argc, char **argv)
+{
+	plan_no_plan();
+	freopen("/dev/null", "w", stderr);
+
+	struct pdu pdus[IRIS_UDP_MAX_PDUS + 1];
+	struct source *src;
+	char port[8];
+	int sockfd, fd, epfd, i;
+
+	snprintf(port, sizeof(port), "%d", PORT);
+	sockfd = net_bind_udp("127.0.0.1", port);
+	ok(sockfd >= 0, "bound to udp 127.0.0.1:%s", port);
+	ok((epfd = epoll_create(42)) >= 0, "[sanity] created an epoll fd");
+	ok(net_listener(epfd, sockfd, IRIS_PROTO_UDP, 0) == 0, "registered the UDP listener");
+
+	fd = net_connect_udp("127.0.0.1", PORT);
+	ok(fd >= 0, "connected a UDP socket");
+
+	ok(recv_datagrams(sockfd) == 0, "nothing to read yet");
+
+	/* one PDU */
+	fill(&pdus[0], "single");
+	ok(send(fd, pdus, sizeof(struct pdu), 0) == sizeof(struct pdu), "sent a 1-PDU datagram");
+
+	/* a full datagram */
+	for (i = 0; i < IRIS_UDP_MAX_PDUS; i++)
+		fill(&pdus[i], "multi");
+	ok(send(fd, pdus, IRIS_UDP_MAX_PDUS * sizeof(struct pdu), 0) > 0,
+			"sent a %d-PDU datagram", IRIS_UDP_MAX_PDUS);
+
+	/* one good, one bad */
+	fill(&pdus[0], "good");
+	fill(&pdus[1], "bad");
+	pdus[1].crc32 ^= 0xffffffff;
+	ok(send(fd, pdus, 2 * sizeof(struct pdu), 0) > 0, "sent a datagram with a bogus PDU");
+
+	/* half a PDU */
+	ok(send(fd, pdus, sizeof(struct pdu) / 2, 0) > 0, "sent a truncated datagram");
+
+	ok(recv_datagrams(sockfd) == 4, "read 4 datagrams in one go");
+	ok(num_results == 1 + IRIS_UDP_MAX_PDUS + 1, "got %d/%d results",
+			num_results, 1 + IRIS_UDP_MAX_PDUS + 1);
+	ok(strcmp(last.host, "good") == 0, "last result is from the good PDU");
+
+	src = source_get("127.0.0.1");
+	ok(src->datagrams == 4, "4 datagrams counted for 127.0.0.1");
+	ok(src->results == 1 + IRIS_UDP_MAX_PDUS + 1, "results counted for 127.0.0.1");
+	ok(src->bogus == 2, "1 bogus PDU and 1 truncated datagram counted for 127.0.0.1");
+
+	/** more than one batch (as many as the receive buffer will hold) **/
+	int n = IRIS_UDP_BATCH * 2 + 1, size;
+	socklen_t len = sizeof(size);
+	getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &size, &len);
+	if (n > size / 10000)
+		n = size / 10000;
+	diag("sending %d datagrams into a %d-byte receive buffer", n, size);
+
+	num_results = 0;
+	fill(&pdus[0], "batch");
+	for (i = 0; i < n; i++)
+		send(fd, pdus, sizeof(struct pdu), 0);
+	ok(recv_datagrams(sockfd) == n, "drained %d datagrams", n);
+	ok(num_results == n, "got a result from each");
+
+	/** the source table is shared with everything else **/
+	for (i = 0; i < IRIS_SOURCES + 10; i++) {
+		char addr[INET_ADDRSTRLEN];
+		snprintf(addr, sizeof(addr), "10.0.%d.%d", i / 256, i % 256);
+		src = source_get(addr);
+		src->bytes = 1000000;
+	}
+	ok(source_get("127.0.0.1")->datagrams == 0,
+			"a quiet UDP sender gives way to busier ones");
+
+	close(fd);
+	close(sockfd);
+	return exit_status();
+}